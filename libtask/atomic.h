@@ -27,11 +27,48 @@
 #define libtask_atomic_add(x,n) __atomic_add_fetch((x), (n), __ATOMIC_SEQ_CST)
 #define libtask_atomic_sub(x,n) __atomic_sub_fetch((x), (n), __ATOMIC_SEQ_CST)
 
+// Macros with weaker memory ordering for the lock-free queues. Use
+// them only when the ordering requirements are obvious.
+
+#define libtask_atomic_load_relaxed(x) __atomic_load_n((x), __ATOMIC_RELAXED)
+#define libtask_atomic_load_acquire(x) __atomic_load_n((x), __ATOMIC_ACQUIRE)
+#define libtask_atomic_store_relaxed(x,n)		\
+  __atomic_store_n((x), (n), __ATOMIC_RELAXED)
+#define libtask_atomic_store_release(x,n)		\
+  __atomic_store_n((x), (n), __ATOMIC_RELEASE)
+#define libtask_atomic_fetch_add_relaxed(x,n)	\
+  __atomic_fetch_add((x), (n), __ATOMIC_RELAXED)
+#define libtask_atomic_exchange_acq_rel(x,n)		\
+  __atomic_exchange_n((x), (n), __ATOMIC_ACQ_REL)
+#define libtask_atomic_cmpxchg_release(p,o,n)				\
+  ({									\
+    __typeof ((o)) tmp = (o);						\
+    __atomic_compare_exchange_n((p), &tmp, (n), false /* weak */,	\
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED);	\
+    tmp;								\
+  })
+
+// Full memory barrier.
+#define libtask_atomic_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+// Hint to the processor that the thread is spinning.
+#if defined(__x86_64__) || defined(__i386__)
+#define libtask_cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define libtask_cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define libtask_cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+// Compare-and-swap that returns the old value. Callers compare it
+// with the expected value to tell if the swap happened, so the
+// exchange must be strong: a spurious failure would return the
+// expected value and look like a success.
 #define libtask_atomic_cmpxchg(p,o,n)					\
   ({									\
     __typeof ((o)) tmp = (o);						\
     __atomic_compare_exchange_n((p), &tmp, (n),				\
-				true /* strong */,			\
+				false /* weak */,			\
 				__ATOMIC_SEQ_CST,			\
 				__ATOMIC_SEQ_CST);			\
     tmp;								\
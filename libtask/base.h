@@ -29,4 +29,18 @@
 #include <string.h>
 #include <limits.h>
 
+// Size of a cache line. Data written by different threads is kept at
+// least this far apart, so that the writes don't contend for a line.
+#define LIBTASK_CACHE_LINE_SIZE 64
+#define LIBTASK_CACHE_ALIGNED __attribute__((aligned(LIBTASK_CACHE_LINE_SIZE)))
+
+// Allocate memory for objects with cache line aligned members. Memory
+// is released with free.
+static inline void *
+libtask__cache_aligned_malloc(size_t size)
+{
+  void *memory = NULL;
+  return posix_memalign(&memory, LIBTASK_CACHE_LINE_SIZE, size) ? NULL : memory;
+}
+
 #endif // _LIBTASK_BASE_H_
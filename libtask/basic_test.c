@@ -41,11 +41,28 @@ static struct argp_option options[] = {
   {0}
 };
 
+static libtask_task_key_t key;
+static int32_t ndestroyed = 0;
+
+static void
+destroy(void *value)
+{
+  free(value);
+  libtask_atomic_add(&ndestroyed, 1);
+}
+
 int
 work(void *arg_)
 {
   libtask_task_pool_t *task_pools = (libtask_task_pool_t *)arg_;
 
+  // Task-local value follows the task across threads and task-pools.
+  libtask_task_t **value = malloc(sizeof(libtask_task_t *));
+  CHECK(value);
+  *value = libtask_get_task_current();
+  CHECK(libtask_task_getspecific(key) == NULL);
+  CHECK(libtask_task_setspecific(key, value) == 0);
+
   int nyields = 0;
   int nswitches = 0;
 
@@ -61,10 +78,18 @@ work(void *arg_)
       libtask_task_pool_schedule(&task_pools[random() % num_task_pools]);
       break;
     }
+    CHECK(libtask_task_getspecific(key) == value);
+    CHECK(*value == libtask_get_task_current());
   }
   return 0;
 }
 
+int
+nop(void *arg_)
+{
+  return 0;
+}
+
 static error_t
 parse_options(int key, char *arg, struct argp_state *state)
 {
@@ -115,6 +140,10 @@ main(int argc, char *argv[])
   struct argp argp = { options, parse_options, 0, 0, children };
   argp_parse(&argp, argc, argv, 0, 0, 0);
 
+  CHECK(libtask_task_key_create(&key, destroy) == 0);
+  CHECK(libtask_task_getspecific(key) == NULL);
+  CHECK(libtask_task_setspecific(key, &key) == EINVAL);
+
   // Create task pools.
   libtask_task_pool_t *task_pools =
     malloc(sizeof (libtask_task_pool_t) * num_task_pools);
@@ -134,6 +163,7 @@ main(int argc, char *argv[])
   }
 
   // Create threads for each task-pool.
+  int64_t start_usecs = libtask_now_usecs();
   pthread_t *threads =
     malloc(sizeof (pthread_t) * num_task_pools * num_threads);
   CHECK(threads);
@@ -146,6 +176,17 @@ main(int argc, char *argv[])
   for (int i = 0; i < num_tasks * num_task_pools; i++) {
     CHECK(libtask_task_wait(&tasks[i]) == 0);
   }
+  DEBUG("all tasks finished in %ld usecs\n", libtask_now_usecs() - start_usecs);
+  CHECK(ndestroyed == num_tasks * num_task_pools);
+
+  // Tasks created on the heap are freed by their last reference.
+  for (int i = 0; i < num_task_pools; i++) {
+    libtask_task_t *task;
+    CHECK(libtask_task_create(&task, &task_pools[i], nop, NULL,
+			      TASK_STACK_SIZE) == 0);
+    CHECK(libtask_task_wait(task) == 0);
+    libtask_task_unref(task);
+  }
 
   // Stop and kill all threads.
   for (int i = 0; i < num_threads * num_task_pools; i++) {
@@ -159,6 +200,33 @@ main(int argc, char *argv[])
     CHECK(libtask_task_unref(&tasks[i]) == 0);
   }
 
+  // Every task must have taken its stack from its task-pool's cache.
+  for (int i = 0; i < num_task_pools; i++) {
+    libtask_stack_cache_stats_t stats;
+    libtask_stack_cache_get_stats(&task_pools[i].stack_cache, &stats);
+    DEBUG("stack cache %d: hits %ld misses %ld free %ld\n", i,
+	  stats.nhits, stats.nmisses, stats.nfree);
+    CHECK(stats.nhits + stats.nmisses == num_tasks + 1);
+  }
+
+  // Spinning of idle threads is checked by spin_test.
+  for (int i = 0; i < num_task_pools; i++) {
+    libtask_task_pool_stats_t stats;
+    libtask_task_pool_get_stats(&task_pools[i], &stats);
+    DEBUG("task-pool %d: spins %ld found %ld spin-usecs %ld parks %ld "
+	  "wakes %ld\n", i, stats.nspins, stats.nspins_found, stats.spin_usecs,
+	  stats.nparks, stats.nwakes);
+  }
+
+  // Contention on the task-pool locks; zero without spinlock stats.
+  // Spinlocks themselves are checked by spinlock_test.
+  for (int i = 0; i < num_task_pools; i++) {
+    libtask_spinlock_stats_t stats;
+    libtask_spinlock_get_stats(&task_pools[i].spinlock, &stats);
+    DEBUG("task-pool %d spinlock: acquires %ld contended %ld spins %ld\n", i,
+	  stats.nacquires, stats.ncontended, stats.nspins);
+  }
+
   // Kill all task-pools.
   for (int i = 0; i < num_task_pools; i++) {
     CHECK(libtask_task_pool_unref(&task_pools[i]) == 0);
@@ -20,17 +20,13 @@
 //
 // Testcase that simulates the c10k challenge.
 //
-// 1. We use two task-pools one for io and another for CPU to create
-//    10k clients.
+// 1. We use a task-pool to create 10k clients, which connect and
+//    talk to the servers with the asynchronous io functions.
 //
-// 2. We use one dedicated thread (part of cpu task-pool) to use epoll
-//    to accept the 10k clients and create one task for each
-//    client. These tasks are executed by the CPU task-pool relying on
-//    the epoll for non-blocking send/receive operations.
-//
-// 3. The only blocking system call "connect" here is performed by the
-//    io threads and rest is CPU insentive (with the exception of
-//    epoll_wait) and is handled by cpu threads of the cpu task-pool.
+// 2. We use one listener task (part of cpu task-pool) to accept the
+//    10k clients and create one task for each client. These tasks are
+//    executed by the CPU task-pool relying on its reactor for
+//    non-blocking send/receive operations.
 //
 
 #include <argp.h>
@@ -50,36 +46,21 @@
 
 #define TASK_STACK_SIZE (64*1024)
 
-static int32_t num_io_threads = 10;
 static int32_t num_cpu_threads = 5;
 static int32_t num_clients = 100;
 static int32_t num_messages = 100;
 static int32_t socket_accept_backlog = 10000;
 
 static struct argp_option options[] = {
-  {"num-io-threads",  0, "PINT32", 0, "No. of threads in the io task-pool."},
-  {"num-cpu-threads", 1, "PINT32", 0, "No. of threads in the cpu task-pool."},
-  {"num-clients",     2, "PINT32", 0, "No. of clients for c10k challenge."},
-  {"num-messages",    3, "PINT32", 0, "No. of messages per client."},
-  {"socket-accept-backlog", 4, "PINT32", 0, "Size of socket accept backlog."},
+  {"num-cpu-threads", 0, "PINT32", 0, "No. of threads in the cpu task-pool."},
+  {"num-clients",     1, "PINT32", 0, "No. of clients for c10k challenge."},
+  {"num-messages",    2, "PINT32", 0, "No. of messages per client."},
+  {"socket-accept-backlog", 3, "PINT32", 0, "Size of socket accept backlog."},
   {0}
 };
 
-static libtask_task_pool_t *io_pool;
 static libtask_task_pool_t *cpu_pool;
 
-#define INPOOL(pool,expr)						\
-  ({									\
-    libtask_task_pool_t *first = libtask_get_task_pool_current();	\
-    libtask_task_pool_schedule(pool);					\
-    __typeof ((expr)) result = (expr);					\
-    libtask_task_pool_schedule(first);					\
-    result;								\
-  })
-
-#define ASYNC(expr) INPOOL(io_pool, (expr))
-
-static int epfd = -1; // The epoll fd.
 static uint16_t port_number = 0;
 
 static uint32_t nsent = 0;
@@ -88,6 +69,9 @@ static uint32_t nreceived = 0;
 static int nserved = 0;
 static int nrequested = 0;
 
+// Listener waits on this for the server tasks to finish.
+static libtask_semaphore_t servers_finished;
+
 static inline void
 set_nonblocking(int fd)
 {
@@ -98,7 +82,7 @@ set_nonblocking(int fd)
 int
 client_worker_main(void *arg_)
 {
-  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
   if (sockfd < 0) {
     DEBUG("%s\n", strerror(errno));
     exit(1);
@@ -110,59 +94,33 @@ client_worker_main(void *arg_)
   addr.sin_port = port_number;
   CHECK(inet_aton("127.0.0.1", &addr.sin_addr) != 0);
 
-  int r = ASYNC(connect(sockfd, (const struct sockaddr *)&addr, sizeof(addr)));
+  int r = libtask_connect(sockfd, (const struct sockaddr *)&addr,
+			  sizeof(addr));
   CHECK(r == 0);
   DEBUG("connected\n");
 
   libtask_task_t *current = libtask_get_task_current();
 
-  libtask_semaphore_t sem;
-  libtask_semaphore_initialize(&sem, 0);
-
-  struct epoll_event event;
-  event.events = 0;
-  event.data.ptr = NULL;
-  r = epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &event);
-  CHECK(r != -1);
-
   void *who = NULL;
   char buffer[128];
   for (int ii = 0; ii < num_messages; ii++) {
-    // Wait for a message.
-    event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
-    event.data.ptr = &sem;
-    r = epoll_ctl(epfd, EPOLL_CTL_MOD, sockfd, &event);
-    CHECK(r != -1);
-    libtask_semaphore_down(&sem);
-
     // Receive a message.
-    ssize_t nrecv = recv(sockfd, buffer, sizeof(buffer), 0);
+    ssize_t nrecv = libtask_read(sockfd, buffer, sizeof(buffer));
     CHECK(nrecv >= 0);
     int jj = -1;
     CHECK(sscanf(buffer, "%p %d\n", &who, &jj) == 2);
     CHECK(ii == jj);
     libtask_atomic_add(&nreceived, 1);
 
-    // Wait for a send.
-    event.events = EPOLLOUT | EPOLLET | EPOLLONESHOT;
-    event.data.ptr = &sem;
-    r = epoll_ctl(epfd, EPOLL_CTL_MOD, sockfd, &event);
-    CHECK(r != -1);
-    libtask_semaphore_down(&sem);
-
     // Send a message.
     int size = snprintf(buffer, sizeof(buffer), "%p %d\n", current, ii) + 1;
-    ssize_t cnt = send(sockfd, buffer, size, 0);
+    ssize_t cnt = libtask_write(sockfd, buffer, size);
     CHECK(cnt >= 0);
     libtask_atomic_add(&nsent, 1);
   }
 
-  r = epoll_ctl(epfd, EPOLL_CTL_DEL, sockfd, NULL);
-  CHECK(r != -1);
   close(sockfd);
 
-  libtask_semaphore_finalize(&sem);
-
   int32_t nfinished = libtask_atomic_add(&nrequested, 1);
   if (nfinished == num_clients) {
     DEBUG("all clients finished\n");
@@ -178,24 +136,11 @@ server_worker_main(void *arg_)
   int sockfd = (int)(uintptr_t)arg_;
   libtask_task_t *current = libtask_get_task_current();
 
-  libtask_semaphore_t sem;
-  libtask_semaphore_initialize(&sem, 0);
-
-  struct epoll_event event;
-  event.events = 0;
-  event.data.ptr = NULL;
-  int r = epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &event);
-  CHECK(r != -1);
-
   void *who = NULL;
   char buffer[128];
   for (int ii = 0; ii < num_messages; ii++) {
     // Wait for a send.
-    event.events = EPOLLOUT | EPOLLET | EPOLLONESHOT;
-    event.data.ptr = &sem;
-    r = epoll_ctl(epfd, EPOLL_CTL_MOD, sockfd, &event);
-    CHECK(r != -1);
-    libtask_semaphore_down(&sem);
+    CHECK(libtask_fd_wait(sockfd, EPOLLOUT) == 0);
 
     // Send a message.
     int size = snprintf(buffer, sizeof(buffer), "%p %d\n", current, ii) + 1;
@@ -204,11 +149,7 @@ server_worker_main(void *arg_)
     libtask_atomic_add(&nsent, 1);
 
     // Wait for a reply.
-    event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
-    event.data.ptr = &sem;
-    r = epoll_ctl(epfd, EPOLL_CTL_MOD, sockfd, &event);
-    CHECK(r != -1);
-    libtask_semaphore_down(&sem);
+    CHECK(libtask_fd_wait(sockfd, EPOLLIN) == 0);
 
     // Receive a message.
     ssize_t nrecv = recv(sockfd, buffer, sizeof(buffer), 0);
@@ -219,18 +160,15 @@ server_worker_main(void *arg_)
     libtask_atomic_add(&nreceived, 1);
   }
 
-  r = epoll_ctl(epfd, EPOLL_CTL_DEL, sockfd, NULL);
-  CHECK(r != -1);
   close(sockfd);
 
-  libtask_semaphore_finalize(&sem);
-
   int32_t nfinished = libtask_atomic_add(&nserved, 1);
   if (nfinished == num_clients) {
     DEBUG("all servers finished\n");
   } else {
     DEBUG("servers finished: %d\n", nfinished);
   }
+  libtask_semaphore_up(&servers_finished);
   return 0;
 }
 
@@ -240,54 +178,24 @@ listener_task_main(void *arg_)
   int sockfd = (int)(uintptr_t)arg_;
   set_nonblocking(sockfd);
 
-  struct epoll_event event;
-  event.events = 0;
-  event.data.ptr = NULL;
-  int r = epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &event);
-
-  while (libtask_atomic_load(&nserved) < num_clients ||
-	 libtask_atomic_load(&nrequested) < num_clients) {
-
-    struct epoll_event event;
-    event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLONESHOT | EPOLLERR | EPOLLPRI | EPOLLRDHUP;
-    event.data.fd = sockfd;
-    CHECK(epoll_ctl(epfd, EPOLL_CTL_MOD, sockfd, &event) == 0);
-
-    int r = epoll_wait(epfd, &event, 1, 10);
-    if (r == -1) {
-      if (errno != EINTR) {
-	perror("epoll_wait");
-      }
+  for (int naccepted = 0; naccepted < num_clients; ) {
+    int clientfd = libtask_accept(sockfd, NULL, NULL);
+    if (clientfd < 0) {
+      CHECK(errno == EINTR);
       continue;
     }
+    naccepted++;
 
-    if (r == 1) {
-      if (event.data.fd == sockfd) {
-	int clientfd = accept4(sockfd, NULL, NULL, SOCK_NONBLOCK);
-	CHECK(clientfd >= 0);
-
-	libtask_task_t *task = NULL;
-	CHECK(libtask_task_create(&task, cpu_pool,
-				  server_worker_main, (void*)clientfd,
-				  TASK_STACK_SIZE) == 0);
-	CHECK(task != NULL);
-	DEBUG("created new task\n");
-	CHECK(libtask_task_unref(task) != 0);
-
-      } else if ((event.events & EPOLLIN) || (event.events & EPOLLOUT)) {
-	/* Event is on a client fd, so schedule the corresponding task. */
-	libtask_semaphore_t *sem = (libtask_semaphore_t *) event.data.ptr;
-	libtask_semaphore_up(sem);
+    CHECK(libtask_task_spawn_detached(cpu_pool,
+				      server_worker_main, (void*)clientfd,
+				      TASK_STACK_SIZE) == 0);
+    DEBUG("created new task\n");
+  }
 
-      } else {
-	DEBUG("unknown event for %p\n", event.data.ptr);
-      }
-    }
+  for (int i = 0; i < num_clients; i++) {
+    libtask_semaphore_down(&servers_finished);
   }
   DEBUG("listener task finished\n");
-
-  r = epoll_ctl(epfd, EPOLL_CTL_DEL, sockfd, NULL);
-  CHECK(r != -1);
   return 0;
 }
 
@@ -335,31 +243,25 @@ static error_t
 parse_options(int key, char *arg, struct argp_state *state)
 {
   switch(key) {
-  case 0: // num-io-threads
-    if (!str2pint32(arg, 10, &num_io_threads)) {
-      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
-    }
-    break;
-
-  case 1: // num-cpu-threads
+  case 0: // num-cpu-threads
     if (!str2pint32(arg, 10, &num_cpu_threads)) {
       argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
     }
     break;
 
-  case 2: // num-clients
+  case 1: // num-clients
     if (!str2pint32(arg, 10, &num_clients)) {
       argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
     }
     break;
 
-  case 3: // num-messages
+  case 2: // num-messages
     if (!str2pint32(arg, 10, &num_messages)) {
       argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
     }
     break;
 
-  case 4: // socket-accept-backlog
+  case 3: // socket-accept-backlog
     if (!str2pint32(arg, 10, &socket_accept_backlog)) {
       argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
     }
@@ -381,14 +283,12 @@ main(int argc, char *argv[])
   struct argp argp = { options, parse_options, 0, 0, children };
   argp_parse(&argp, argc, argv, 0, 0, 0);
 
-  epfd = epoll_create1(0);
-  CHECK(epfd >= 0);
+  libtask_semaphore_initialize(&servers_finished, 0);
 
   int sockfd = -1;
   CHECK(create_listening_socket(socket_accept_backlog, &sockfd,
 				&port_number) == 0);
 
-  CHECK(libtask_task_pool_create(&io_pool) == 0);
   CHECK(libtask_task_pool_create(&cpu_pool) == 0);
 
   // Create listener and client tasks.
@@ -408,10 +308,7 @@ main(int argc, char *argv[])
 				  TASK_STACK_SIZE) == 0);
   }
 
-  pthread_t io_threads[num_io_threads];
-  for (int i = 0; i < num_io_threads; i++) {
-    CHECK(libtask_task_pool_start(io_pool, &io_threads[i]) == 0);
-  }
+  int64_t start_usecs = libtask_now_usecs();
   pthread_t cpu_threads[num_cpu_threads];
   for (int i = 0; i < num_cpu_threads; i++) {
     CHECK(libtask_task_pool_start(cpu_pool, &cpu_threads[i]) == 0);
@@ -422,12 +319,9 @@ main(int argc, char *argv[])
   for (int i = 0; i < num_clients; i++) {
     CHECK(libtask_task_wait(&client_tasks[i]) == 0);
   }
+  DEBUG("all tasks finished in %ld usecs\n", libtask_now_usecs() - start_usecs);
 
   // Wait for threads to finish.
-  for (int i = 0; i < num_io_threads; i++) {
-    CHECK(libtask_task_pool_stop(io_pool, io_threads[i]) == 0);
-    CHECK(pthread_join(io_threads[i], NULL) == 0);
-  }
   for (int i = 0; i < num_cpu_threads; i++) {
     CHECK(libtask_task_pool_stop(cpu_pool, cpu_threads[i]) == 0);
     CHECK(pthread_join(cpu_threads[i], NULL) == 0);
@@ -441,14 +335,13 @@ main(int argc, char *argv[])
   free(client_tasks);
 
   // Destroy the task pools.
-  CHECK(libtask_task_pool_unref(io_pool) == 0);
   CHECK(libtask_task_pool_unref(cpu_pool) == 0);
 
   DEBUG("nsent: %d nreceived: %d\n", nsent, nreceived);
   CHECK(nsent == nreceived);
   CHECK(nsent == num_clients * num_messages * 2);
 
+  libtask_semaphore_finalize(&servers_finished);
   close(sockfd);
-  close(epfd);
   return 0;
 }
@@ -0,0 +1,488 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <sched.h>
+#include <string.h>
+
+#include "libtask/task.h"
+#include "libtask/task_pool.h"
+#include "libtask/channel.h"
+#include "libtask/futex.h"
+#include "libtask/log.h"
+
+// A task or a thread waiting in libtask_select has a waiter for every
+// case, queued in the channels, and all of them share a group. The
+// first operation that completes a case marks the group done with its
+// index, so waiters of the other cases are skipped.
+typedef struct {
+  volatile int32_t done;
+  libtask_task_t *task;
+  uint32_t futex;
+} libtask_channel_group_t;
+
+typedef struct {
+  libtask_list_t link;
+  libtask_channel_group_t *group;
+  libtask_select_case_t *select_case;
+  int32_t index;
+} libtask_channel_waiter_t;
+
+// Round robin position of the ready operations in libtask_select.
+static __thread uint32_t select_start;
+
+error_t
+libtask_channel_initialize(libtask_channel_t *channel, int32_t elem_size,
+			   int32_t capacity)
+{
+  assert(elem_size > 0 && capacity >= 0);
+  channel->elem_size = elem_size;
+  channel->capacity = capacity;
+  channel->count = 0;
+  channel->nsenders = 0;
+  channel->tail = 0;
+  channel->head = 0;
+  channel->seqs = NULL;
+  channel->elems = NULL;
+  if (capacity) {
+    channel->seqs = (uint64_t *)malloc(sizeof(uint64_t) * capacity);
+    channel->elems = (char *)malloc((size_t)elem_size * capacity);
+    if (!channel->seqs || !channel->elems) {
+      free((void *)channel->seqs);
+      free(channel->elems);
+      return ENOMEM;
+    }
+    for (int32_t i = 0; i < capacity; i++) {
+      channel->seqs[i] = i;
+    }
+  }
+  libtask_spinlock_initialize(&channel->spinlock);
+  channel->closed = false;
+  libtask_list_initialize(&channel->send_list);
+  libtask_list_initialize(&channel->recv_list);
+  return 0;
+}
+
+void
+libtask_channel_finalize(libtask_channel_t *channel)
+{
+  assert(libtask_list_empty(&channel->send_list));
+  assert(libtask_list_empty(&channel->recv_list));
+  libtask_spinlock_finalize(&channel->spinlock);
+  free((void *)channel->seqs);
+  free(channel->elems);
+}
+
+//
+// Buffer
+//
+
+// Reserve up to nelems values to send. Callers without the spinlock
+// can move the count only between one and capacity - 1, so that they
+// never need to wake up receivers of an empty buffer and never fill
+// the buffer while senders may be waiting.
+//
+// Returns the number of values reserved.
+static inline int32_t
+libtask__channel_reserve_send(libtask_channel_t *channel, int32_t nelems,
+			      bool locked)
+{
+  int32_t min = locked ? 0 : 1;
+  int32_t max = locked ? channel->capacity : channel->capacity - 1;
+  int32_t count = libtask_atomic_load(&channel->count);
+  while (count >= min && count < max) {
+    int32_t n = nelems < max - count ? nelems : max - count;
+    int32_t old = libtask_atomic_cmpxchg(&channel->count, count, count + n);
+    if (old == count) {
+      return n;
+    }
+    count = old;
+  }
+  return 0;
+}
+
+// Reserve up to nelems values to receive. Callers without the
+// spinlock cannot take from a full buffer, because senders may be
+// waiting for it.
+//
+// Returns the number of values reserved.
+static inline int32_t
+libtask__channel_reserve_recv(libtask_channel_t *channel, int32_t nelems,
+			      bool locked)
+{
+  int32_t max = locked ? channel->capacity : channel->capacity - 1;
+  int32_t count = libtask_atomic_load(&channel->count);
+  while (count > 0 && count <= max) {
+    int32_t n = nelems < count ? nelems : count;
+    int32_t old = libtask_atomic_cmpxchg(&channel->count, count, count - n);
+    if (old == count) {
+      return n;
+    }
+    count = old;
+  }
+  return 0;
+}
+
+// Wait for the sequence number of a slot. The other side has already
+// reserved the slot and is copying the value.
+static inline void
+libtask__channel_wait_slot(volatile uint64_t *seq, uint64_t value)
+{
+  for (int i = 0; libtask_atomic_load_acquire(seq) != value; i++) {
+    if (i < LIBTASK_SPINLOCK_YIELD) {
+      libtask_cpu_relax();
+    } else {
+      sched_yield();
+    }
+  }
+}
+
+// Write reserved values into the buffer.
+static void
+libtask__channel_put(libtask_channel_t *channel, const char *elems,
+		     int32_t nelems)
+{
+  uint64_t pos = __atomic_fetch_add(&channel->tail, nelems, __ATOMIC_RELAXED);
+  for (int32_t i = 0; i < nelems; i++, pos++) {
+    int32_t slot = pos % channel->capacity;
+    libtask__channel_wait_slot(&channel->seqs[slot], pos);
+    memcpy(channel->elems + (size_t)slot * channel->elem_size,
+	   elems + (size_t)i * channel->elem_size, channel->elem_size);
+    libtask_atomic_store_release(&channel->seqs[slot], pos + 1);
+  }
+}
+
+// Read reserved values from the buffer.
+static void
+libtask__channel_get(libtask_channel_t *channel, char *elems, int32_t nelems)
+{
+  uint64_t pos = __atomic_fetch_add(&channel->head, nelems, __ATOMIC_RELAXED);
+  for (int32_t i = 0; i < nelems; i++, pos++) {
+    int32_t slot = pos % channel->capacity;
+    libtask__channel_wait_slot(&channel->seqs[slot], pos + 1);
+    memcpy(elems + (size_t)i * channel->elem_size,
+	   channel->elems + (size_t)slot * channel->elem_size,
+	   channel->elem_size);
+    libtask_atomic_store_release(&channel->seqs[slot],
+				 pos + channel->capacity);
+  }
+}
+
+// Send up to nelems values without the spinlock unless the channel is
+// closed. Sender is counted from before it checks the flag until its
+// values are in the buffer, which pairs with the wait in
+// libtask_channel_close.
+//
+// Returns the number of values sent.
+static int32_t
+libtask__channel_send_unlocked(libtask_channel_t *channel, const char *elems,
+			       int32_t nelems)
+{
+  int32_t n = 0;
+  libtask_atomic_add(&channel->nsenders, 1);
+  if (!libtask_atomic_load(&channel->closed)) {
+    n = libtask__channel_reserve_send(channel, nelems, false);
+    if (n) {
+      libtask__channel_put(channel, elems, n);
+    }
+  }
+  libtask_atomic_sub(&channel->nsenders, 1);
+  return n;
+}
+
+//
+// Waiters
+//
+
+// Take the first waiter from a queue whose group is not done yet and
+// mark its group done. Spinlock must be held.
+static libtask_channel_waiter_t *
+libtask__channel_dequeue(libtask_list_t *list)
+{
+  libtask_list_t *link;
+  while ((link = libtask_list_pop_front(list))) {
+    libtask_channel_waiter_t *waiter =
+      libtask_list_entry(link, libtask_channel_waiter_t, link);
+    if (libtask_atomic_cmpxchg(&waiter->group->done, -1, waiter->index) ==
+	-1) {
+      return waiter;
+    }
+  }
+  return NULL;
+}
+
+// Complete the case of a dequeued waiter and wake it up. Waiter
+// cleans up its other cases under the spinlocks of their channels, so
+// it doesn't go away while the spinlock is held.
+static void
+libtask__channel_wake(libtask_channel_waiter_t *waiter, error_t error)
+{
+  libtask_channel_group_t *group = waiter->group;
+  waiter->select_case->error = error;
+  if (group->task) {
+    libtask__task_pool_wakeup(group->task->owner, group->task);
+  } else {
+    libtask_atomic_store_release(&group->futex, 1);
+    libtask_futex_wake(&group->futex, 1);
+  }
+}
+
+// Try to perform an operation. Spinlock of the channel must be held.
+//
+// Returns true if the operation is performed.
+static bool
+libtask__channel_try(libtask_select_case_t *select_case)
+{
+  libtask_channel_t *channel = select_case->channel;
+  libtask_channel_waiter_t *waiter;
+
+  if (select_case->send) {
+    if (channel->closed) {
+      select_case->error = EPIPE;
+      return true;
+    }
+    // Receivers wait only on an empty buffer.
+    if ((waiter = libtask__channel_dequeue(&channel->recv_list))) {
+      memcpy(waiter->select_case->elem, select_case->elem,
+	     channel->elem_size);
+      libtask__channel_wake(waiter, 0);
+    } else if (libtask__channel_reserve_send(channel, 1, true)) {
+      libtask__channel_put(channel, select_case->elem, 1);
+    } else {
+      return false;
+    }
+    select_case->error = 0;
+    return true;
+  }
+
+  if (libtask__channel_reserve_recv(channel, 1, true)) {
+    libtask__channel_get(channel, select_case->elem, 1);
+    // Senders wait only on a full buffer, where a slot is free now
+    // and nobody else can fill it without the spinlock.
+    if ((waiter = libtask__channel_dequeue(&channel->send_list))) {
+      CHECK(libtask__channel_reserve_send(channel, 1, true) == 1);
+      libtask__channel_put(channel, waiter->select_case->elem, 1);
+      libtask__channel_wake(waiter, 0);
+    }
+  } else if ((waiter = libtask__channel_dequeue(&channel->send_list))) {
+    // Unbuffered channel.
+    memcpy(select_case->elem, waiter->select_case->elem, channel->elem_size);
+    libtask__channel_wake(waiter, 0);
+  } else if (channel->closed) {
+    select_case->error = EPIPE;
+    return true;
+  } else {
+    return false;
+  }
+  select_case->error = 0;
+  return true;
+}
+
+//
+// Select
+//
+
+// Lock the distinct channels of the cases in address order, which
+// avoids deadlocks with other selects. Channels are sorted into the
+// array.
+//
+// Returns the number of distinct channels.
+static int32_t
+libtask__channel_lock_all(libtask_select_case_t *cases, int32_t ncases,
+			  libtask_channel_t **channels)
+{
+  int32_t n = 0;
+  for (int32_t i = 0; i < ncases; i++) {
+    libtask_channel_t *channel = cases[i].channel;
+    int32_t j = 0;
+    while (j < n && channels[j] < channel) {
+      j++;
+    }
+    if (j < n && channels[j] == channel) {
+      continue;
+    }
+    memmove(&channels[j + 1], &channels[j], sizeof(channels[0]) * (n - j));
+    channels[j] = channel;
+    n++;
+  }
+  for (int32_t i = 0; i < n; i++) {
+    libtask_spinlock_lock(&channels[i]->spinlock);
+  }
+  return n;
+}
+
+static void
+libtask__channel_unlock_all(libtask_channel_t **channels, int32_t n)
+{
+  for (int32_t i = n - 1; i >= 0; i--) {
+    libtask_spinlock_unlock(&channels[i]->spinlock);
+  }
+}
+
+int32_t
+libtask_select(libtask_select_case_t *cases, int32_t ncases, bool wait)
+{
+  assert(ncases > 0);
+  libtask_channel_t *channels[ncases];
+  int32_t nchannels = libtask__channel_lock_all(cases, ncases, channels);
+
+  uint32_t start = select_start++;
+  for (int32_t i = 0; i < ncases; i++) {
+    int32_t index = (start + i) % ncases;
+    if (libtask__channel_try(&cases[index])) {
+      libtask__channel_unlock_all(channels, nchannels);
+      return index;
+    }
+  }
+  if (!wait) {
+    libtask__channel_unlock_all(channels, nchannels);
+    return -1;
+  }
+
+  libtask_channel_group_t group;
+  group.done = -1;
+  group.task = libtask_get_task_current();
+  group.futex = 0;
+  libtask_channel_waiter_t waiters[ncases];
+  for (int32_t i = 0; i < ncases; i++) {
+    libtask_channel_t *channel = cases[i].channel;
+    libtask_list_initialize(&waiters[i].link);
+    waiters[i].group = &group;
+    waiters[i].select_case = &cases[i];
+    waiters[i].index = i;
+    libtask_list_push_back(cases[i].send ? &channel->send_list :
+			   &channel->recv_list, &waiters[i].link);
+  }
+  libtask__channel_unlock_all(channels, nchannels);
+
+  if (group.task) {
+    // Task context!
+    libtask__task_suspend();
+  } else {
+    // Pthread context!
+    while (libtask_atomic_load_acquire(&group.futex) == 0) {
+      libtask_futex_wait(&group.futex, 0, NULL);
+    }
+  }
+
+  // Unlink the waiters of the other cases.
+  libtask__channel_lock_all(cases, ncases, channels);
+  for (int32_t i = 0; i < ncases; i++) {
+    if (!libtask_list_empty(&waiters[i].link)) {
+      libtask_list_erase(&waiters[i].link);
+    }
+  }
+  libtask__channel_unlock_all(channels, nchannels);
+  return group.done;
+}
+
+//
+// Operations
+//
+
+void
+libtask_channel_close(libtask_channel_t *channel)
+{
+  libtask_spinlock_lock(&channel->spinlock);
+  libtask_atomic_store(&channel->closed, true);
+  libtask_channel_waiter_t *waiter;
+  while ((waiter = libtask__channel_dequeue(&channel->recv_list))) {
+    libtask__channel_wake(waiter, EPIPE);
+  }
+  while ((waiter = libtask__channel_dequeue(&channel->send_list))) {
+    libtask__channel_wake(waiter, EPIPE);
+  }
+  libtask_spinlock_unlock(&channel->spinlock);
+
+  // Senders that have missed the flag finish their sends without the
+  // spinlock.
+  for (int i = 0; libtask_atomic_load(&channel->nsenders) != 0; i++) {
+    if (i < LIBTASK_SPINLOCK_YIELD) {
+      libtask_cpu_relax();
+    } else {
+      sched_yield();
+    }
+  }
+}
+
+error_t
+libtask_channel_send(libtask_channel_t *channel, const void *elem)
+{
+  if (libtask__channel_send_unlocked(channel, elem, 1)) {
+    return 0;
+  }
+
+  libtask_select_case_t select_case = { channel, true, (void *)elem, 0 };
+  libtask_select(&select_case, 1, true);
+  return select_case.error;
+}
+
+error_t
+libtask_channel_recv(libtask_channel_t *channel, void *elem)
+{
+  if (libtask__channel_reserve_recv(channel, 1, false)) {
+    libtask__channel_get(channel, elem, 1);
+    return 0;
+  }
+
+  libtask_select_case_t select_case = { channel, false, elem, 0 };
+  libtask_select(&select_case, 1, true);
+  return select_case.error;
+}
+
+int32_t
+libtask_channel_send_many(libtask_channel_t *channel, const void *elems,
+			  int32_t nelems)
+{
+  const char *next = (const char *)elems;
+  int32_t nsent = 0;
+  while (nsent < nelems) {
+    int32_t n = libtask__channel_send_unlocked(channel, next, nelems - nsent);
+    if (n == 0) {
+      if (libtask_channel_send(channel, next) != 0) {
+	break;
+      }
+      n = 1;
+    }
+    nsent += n;
+    next += (size_t)n * channel->elem_size;
+  }
+  return nsent;
+}
+
+int32_t
+libtask_channel_recv_many(libtask_channel_t *channel, void *elems,
+			  int32_t nelems)
+{
+  char *next = (char *)elems;
+  int32_t nrecv = libtask__channel_reserve_recv(channel, nelems, false);
+  if (nrecv) {
+    libtask__channel_get(channel, next, nrecv);
+    return nrecv;
+  }
+  if (libtask_channel_recv(channel, next) != 0) {
+    return 0;
+  }
+
+  // Take the rest from the buffer without waiting.
+  int32_t n = libtask__channel_reserve_recv(channel, nelems - 1, false);
+  if (n) {
+    libtask__channel_get(channel, next + channel->elem_size, n);
+  }
+  return n + 1;
+}
@@ -0,0 +1,179 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _LIBTASK_CHANNEL_H_
+#define _LIBTASK_CHANNEL_H_
+
+#include "libtask/list.h"
+#include "libtask/spinlock.h"
+
+// Channel
+//
+// A channel passes fixed size values between tasks, possibly of
+// different task-pools, and normal threads in FIFO order. Buffered
+// channels hold up to a capacity of values and senders wait only when
+// the buffer is full. Unbuffered channels, with zero capacity, make
+// senders wait until a receiver takes the value.
+//
+// Buffer is a ring of slots with sequence numbers, where senders and
+// receivers first reserve values from the count and then claim slot
+// positions. While the buffer is neither full nor empty, nobody can
+// be waiting, so sends and receives reserve with a compare-and-swap
+// and never take the spinlock. Transitions from empty and full
+// buffers, which have to wake up waiters, are made with the spinlock
+// held. Senders without the spinlock are counted while they check the
+// closed flag and fill their slots, and closing waits for them, so
+// that no send succeeds after libtask_channel_close returns.
+
+typedef struct {
+  // Size of the values and capacity of the buffer.
+  int32_t elem_size;
+  int32_t capacity;
+
+  // Number of values in the buffer, including the ones being written
+  // or read, number of senders in the buffer without the spinlock and
+  // the next positions to write and read.
+  volatile int32_t count;
+  volatile int32_t nsenders;
+  volatile uint64_t tail;
+  volatile uint64_t head;
+
+  // Sequence numbers of the slots and the values. A slot at position
+  // p is free to write when its sequence is p and has a value to read
+  // when it is p + 1.
+  volatile uint64_t *seqs;
+  char *elems;
+
+  // Spinlock protects the flag and the queues of waiting senders and
+  // receivers.
+  libtask_spinlock_t spinlock;
+  volatile bool closed;
+  libtask_list_t send_list;
+  libtask_list_t recv_list;
+} libtask_channel_t;
+
+// Initialize a channel.
+//
+// channel: The channel.
+//
+// elem_size: Size of the values in bytes.
+//
+// capacity: Number of values the channel can buffer, or zero.
+//
+// Returns zero on success and ENOMEM on out of memory.
+error_t
+libtask_channel_initialize(libtask_channel_t *channel, int32_t elem_size,
+			   int32_t capacity);
+
+// Destroy a channel. No tasks or threads must be waiting on the
+// channel.
+//
+// channel: The channel.
+void
+libtask_channel_finalize(libtask_channel_t *channel);
+
+// Close a channel. Waiting senders and receivers return EPIPE and so
+// do all sends that start after close returns; sends that race with it
+// either fail or complete before it returns. Values in the buffer can
+// still be received.
+//
+// channel: The channel.
+void
+libtask_channel_close(libtask_channel_t *channel);
+
+// Send a value and wait if necessary.
+//
+// channel: The channel.
+//
+// elem: The value, which is copied.
+//
+// Returns zero on success or EPIPE if the channel is closed.
+error_t
+libtask_channel_send(libtask_channel_t *channel, const void *elem);
+
+// Receive a value and wait if necessary.
+//
+// channel: The channel.
+//
+// elem: Output buffer for the value.
+//
+// Returns zero on success or EPIPE if the channel is closed and its
+// buffer is empty.
+error_t
+libtask_channel_recv(libtask_channel_t *channel, void *elem);
+
+// Send an array of values and wait if necessary. Values are reserved
+// in batches while the buffer is neither full nor empty.
+//
+// channel: The channel.
+//
+// elems: The values.
+//
+// nelems: Number of values.
+//
+// Returns the number of values sent, which is less than nelems only
+// if the channel is closed.
+int32_t
+libtask_channel_send_many(libtask_channel_t *channel, const void *elems,
+			  int32_t nelems);
+
+// Receive up to an array of values. Waits for one value if necessary
+// and takes as many more as the buffer has.
+//
+// channel: The channel.
+//
+// elems: Output buffer for the values.
+//
+// nelems: Maximum number of values.
+//
+// Returns the number of values received, which is zero only if the
+// channel is closed and its buffer is empty.
+int32_t
+libtask_channel_recv_many(libtask_channel_t *channel, void *elems,
+			  int32_t nelems);
+
+// A send or receive operation for libtask_select.
+typedef struct {
+  // The channel, the direction and the value to send or the output
+  // buffer for the value to receive.
+  libtask_channel_t *channel;
+  bool send;
+  void *elem;
+
+  // Result of the operation when it is selected, which is zero or
+  // EPIPE as for libtask_channel_send and libtask_channel_recv.
+  error_t error;
+} libtask_select_case_t;
+
+// Perform one of many channel operations, whichever can proceed
+// first. When many operations are ready, one is picked in a round
+// robin fashion. Same channel may appear in more than one case.
+//
+// cases: The operations.
+//
+// ncases: Number of operations.
+//
+// wait: Whether to wait when no operation is ready.
+//
+// Returns the index of the performed operation or -1 if none was
+// ready and wait is false.
+int32_t
+libtask_select(libtask_select_case_t *cases, int32_t ncases, bool wait);
+
+#endif // _LIBTASK_CHANNEL_H_
@@ -0,0 +1,313 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+//
+// Testcase for the channels. Producer tasks of one task-pool send
+// numbers over a buffered channel, singly and in batches, to consumer
+// tasks of another task-pool and a normal thread until the channel is
+// closed; every number must be received exactly once. Unbuffered
+// channels and selects are checked between a task and a thread. Last,
+// senders race with a close, which no send may outlive.
+//
+
+#include <argp.h>
+#include <pthread.h>
+
+#include "libtask/libtask.h"
+#include "libtask/log.h"
+
+#define TASK_STACK_SIZE (64*1024)
+#define BATCH_SIZE 8
+
+static int32_t num_threads = 2;
+static int32_t num_producers = 10;
+static int32_t num_consumers = 10;
+static int32_t num_items = 10000;
+static int32_t capacity = 16;
+
+static struct argp_option options[] = {
+  {"num-threads",   0, "PINT32", 0, "No. of threads in each task-pool."},
+  {"num-producers", 1, "PINT32", 0, "No. of producers."},
+  {"num-consumers", 2, "PINT32", 0, "No. of consumers."},
+  {"num-items",     3, "PINT32", 0, "No. of items per producer."},
+  {"capacity",      4, "PINT32", 0, "Capacity of the buffered channel."},
+  {0}
+};
+
+static libtask_channel_t numbers;
+static int64_t nreceived = 0;
+static int64_t sum = 0;
+
+static libtask_channel_t pings;
+static libtask_channel_t pongs;
+static libtask_channel_t quit;
+
+int
+producer(void *arg_)
+{
+  int64_t batch[BATCH_SIZE];
+  for (int64_t i = 1; i <= num_items;) {
+    if (random() % 2) {
+      CHECK(libtask_channel_send(&numbers, &i) == 0);
+      i++;
+      continue;
+    }
+    int32_t n = 0;
+    while (n < BATCH_SIZE && i <= num_items) {
+      batch[n++] = i++;
+    }
+    CHECK(libtask_channel_send_many(&numbers, batch, n) == n);
+  }
+  return 0;
+}
+
+static void
+consume(void)
+{
+  int64_t batch[BATCH_SIZE];
+  int32_t n;
+  while ((n = libtask_channel_recv_many(&numbers, batch,
+					1 + random() % BATCH_SIZE))) {
+    for (int32_t i = 0; i < n; i++) {
+      libtask_atomic_add(&sum, batch[i]);
+    }
+    libtask_atomic_add(&nreceived, n);
+  }
+  int64_t value;
+  CHECK(libtask_channel_recv(&numbers, &value) == EPIPE);
+}
+
+int
+consumer(void *arg_)
+{
+  consume();
+  return 0;
+}
+
+void *
+tconsumer(void *arg_)
+{
+  consume();
+  return NULL;
+}
+
+// Sends to the racy channel until it is closed. A send that starts
+// after the close has returned must fail.
+static libtask_channel_t racy;
+static int32_t racy_closed = 0;
+static int64_t nracy_sent = 0;
+
+int
+racer(void *arg_)
+{
+  int64_t value = 1;
+  while (true) {
+    bool closed = libtask_atomic_load(&racy_closed);
+    if (libtask_channel_send(&racy, &value) != 0) {
+      break;
+    }
+    CHECK(!closed);
+    libtask_atomic_add(&nracy_sent, 1);
+  }
+  return 0;
+}
+
+// Answers pings over an unbuffered channel until a quit message.
+int
+ponger(void *arg_)
+{
+  while (true) {
+    int32_t value;
+    libtask_select_case_t cases[2] = {
+      { &pings, false, &value, 0 },
+      { &quit, false, &value, 0 },
+    };
+    int32_t index = libtask_select(cases, 2, true);
+    CHECK(cases[index].error == 0);
+    if (index == 1) {
+      break;
+    }
+    value++;
+    CHECK(libtask_channel_send(&pongs, &value) == 0);
+  }
+  return 0;
+}
+
+static error_t
+parse_options(int key, char *arg, struct argp_state *state)
+{
+  switch(key) {
+  case 0: // num-threads
+    if (!str2pint32(arg, 10, &num_threads)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 1: // num-producers
+    if (!str2pint32(arg, 10, &num_producers)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 2: // num-consumers
+    if (!str2pint32(arg, 10, &num_consumers)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 3: // num-items
+    if (!str2pint32(arg, 10, &num_items)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 4: // capacity
+    if (!str2pint32(arg, 10, &capacity)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  default:
+    return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct argp_child children[2];
+  children[0] = libtask_argp_child;
+  children[1] = (struct argp_child){0};
+
+  struct argp argp = { options, parse_options, 0, 0, children };
+  argp_parse(&argp, argc, argv, 0, 0, 0);
+
+  CHECK(libtask_channel_initialize(&numbers, sizeof(int64_t), capacity) == 0);
+  CHECK(libtask_channel_initialize(&pings, sizeof(int32_t), 0) == 0);
+  CHECK(libtask_channel_initialize(&pongs, sizeof(int32_t), 0) == 0);
+  CHECK(libtask_channel_initialize(&quit, sizeof(int32_t), 1) == 0);
+
+  libtask_task_pool_t pools[2];
+  pthread_t threads[2][num_threads];
+  for (int i = 0; i < 2; i++) {
+    CHECK(libtask_task_pool_initialize(&pools[i]) == 0);
+    for (int j = 0; j < num_threads; j++) {
+      CHECK(libtask_task_pool_start(&pools[i], &threads[i][j]) == 0);
+    }
+  }
+
+  libtask_task_t producers[num_producers];
+  for (int i = 0; i < num_producers; i++) {
+    CHECK(libtask_task_initialize(&producers[i], &pools[0], producer, NULL,
+				  TASK_STACK_SIZE) == 0);
+  }
+  libtask_task_t consumers[num_consumers];
+  for (int i = 0; i < num_consumers; i++) {
+    CHECK(libtask_task_initialize(&consumers[i], &pools[1], consumer, NULL,
+				  TASK_STACK_SIZE) == 0);
+  }
+  pthread_t pthread;
+  CHECK(pthread_create(&pthread, NULL, tconsumer, NULL) == 0);
+
+  // Ping-pong with a task over the unbuffered channels.
+  libtask_task_t ponger_task;
+  CHECK(libtask_task_initialize(&ponger_task, &pools[0], ponger, NULL,
+				TASK_STACK_SIZE) == 0);
+  for (int32_t i = 0; i < 1000; i++) {
+    int32_t value = i;
+    CHECK(libtask_channel_send(&pings, &value) == 0);
+    CHECK(libtask_channel_recv(&pongs, &value) == 0);
+    CHECK(value == i + 1);
+  }
+  int32_t value = 0;
+  libtask_select_case_t cases[2] = {
+    { &pongs, false, &value, 0 },
+    { &quit, true, &value, 0 },
+  };
+  CHECK(libtask_select(cases, 1, false) == -1);
+  CHECK(libtask_select(cases, 2, false) == 1);
+  CHECK(libtask_task_wait(&ponger_task) == 0);
+
+  for (int i = 0; i < num_producers; i++) {
+    CHECK(libtask_task_wait(&producers[i]) == 0);
+  }
+  libtask_channel_close(&numbers);
+  CHECK(libtask_channel_send(&numbers, &value) == EPIPE);
+  for (int i = 0; i < num_consumers; i++) {
+    CHECK(libtask_task_wait(&consumers[i]) == 0);
+  }
+  CHECK(pthread_join(pthread, NULL) == 0);
+
+  // Close the racy channel while it is neither empty nor full.
+  CHECK(libtask_channel_initialize(&racy, sizeof(int64_t), 64) == 0);
+  libtask_task_t racers[num_producers];
+  for (int i = 0; i < num_producers; i++) {
+    CHECK(libtask_task_initialize(&racers[i], &pools[0], racer, NULL,
+				  TASK_STACK_SIZE) == 0);
+  }
+  int64_t nracy_received = 0;
+  int64_t number;
+  for (int i = 0; i < 10000; i++) {
+    CHECK(libtask_channel_recv(&racy, &number) == 0);
+    nracy_received++;
+  }
+  libtask_channel_close(&racy);
+  libtask_atomic_store(&racy_closed, 1);
+  while (libtask_channel_recv(&racy, &number) == 0) {
+    nracy_received++;
+  }
+  for (int i = 0; i < num_producers; i++) {
+    CHECK(libtask_task_wait(&racers[i]) == 0);
+  }
+  CHECK(nracy_received == nracy_sent);
+
+  DEBUG("received %ld numbers\n", nreceived);
+  int64_t n = num_items;
+  CHECK(nreceived == n * num_producers);
+  CHECK(sum == n * (n + 1) / 2 * num_producers);
+
+  for (int i = 0; i < 2; i++) {
+    for (int j = 0; j < num_threads; j++) {
+      CHECK(libtask_task_pool_stop(&pools[i], threads[i][j]) == 0);
+      CHECK(pthread_join(threads[i][j], NULL) == 0);
+    }
+  }
+  for (int i = 0; i < num_producers; i++) {
+    CHECK(libtask_task_unref(&producers[i]) == 0);
+  }
+  for (int i = 0; i < num_consumers; i++) {
+    CHECK(libtask_task_unref(&consumers[i]) == 0);
+  }
+  CHECK(libtask_task_unref(&ponger_task) == 0);
+  for (int i = 0; i < num_producers; i++) {
+    CHECK(libtask_task_unref(&racers[i]) == 0);
+  }
+  for (int i = 0; i < 2; i++) {
+    CHECK(libtask_task_pool_finalize(&pools[i]) == 0);
+  }
+
+  libtask_channel_finalize(&numbers);
+  libtask_channel_finalize(&pings);
+  libtask_channel_finalize(&pongs);
+  libtask_channel_finalize(&quit);
+  libtask_channel_finalize(&racy);
+  return 0;
+}
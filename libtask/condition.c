@@ -20,14 +20,15 @@
 #include "libtask/task.h"
 #include "libtask/task_pool.h"
 #include "libtask/condition.h"
+#include "libtask/futex.h"
 #include "libtask/log.h"
 
 void
 libtask_condition_initialize(libtask_condition_t *cond,
 			     libtask_spinlock_t *spinlock)
 {
-  pthread_cond_init(&cond->cond, NULL);
-  pthread_mutex_init(&cond->mutex, NULL);
+  cond->futex = 0;
+  cond->nwaiters = 0;
   cond->spinlock = spinlock;
   libtask_list_initialize(&cond->list);
 }
@@ -36,8 +37,26 @@ void
 libtask_condition_finalize(libtask_condition_t *cond)
 {
   assert(libtask_list_empty(&cond->list));
-  pthread_cond_destroy(&cond->cond);
-  pthread_mutex_destroy(&cond->mutex);
+  assert(cond->nwaiters == 0);
+}
+
+// Wait on the futex word in pthread context. Spinlock must be held
+// and is released while waiting. Spurious wake ups are possible.
+static error_t
+libtask__condition_park(libtask_condition_t *cond,
+			const struct timespec *deadline)
+{
+  uint32_t value = cond->futex;
+  cond->nwaiters++;
+  libtask_spinlock_unlock(cond->spinlock);
+
+  // A wake up after the unlock changes the word and the wait returns
+  // immediately.
+  error_t error = libtask_futex_wait(&cond->futex, value, deadline);
+
+  libtask_spinlock_lock(cond->spinlock);
+  cond->nwaiters--;
+  return error == ETIMEDOUT ? ETIMEDOUT : 0;
 }
 
 void
@@ -51,19 +70,50 @@ libtask_condition_wait(libtask_condition_t *cond)
     // Task context!
     libtask_list_push_back(&cond->list, &task->waiting_link);
     libtask_spinlock_unlock(cond->spinlock);
-    libtask__task_suspend();
+    libtask__task_suspend_unpinned();
+    libtask_spinlock_lock(cond->spinlock);
 
   } else {
     // Pthread context!
-    CHECK(pthread_mutex_lock(&cond->mutex) == 0);
+    libtask__condition_park(cond, NULL);
+  }
+}
 
-    libtask_spinlock_unlock(cond->spinlock);
-    pthread_cond_wait(&cond->cond, &cond->mutex);
+error_t
+libtask_condition_wait_timed(libtask_condition_t *cond, int64_t deadline_usecs)
+{
+  // Spinlock must be locked before wait is called!
+  assert(libtask_spinlock_status(cond->spinlock) == false);
 
-    CHECK(pthread_mutex_unlock(&cond->mutex) == 0);
+  if (deadline_usecs <= libtask_clock_usecs()) {
+    return ETIMEDOUT;
   }
 
-  libtask_spinlock_lock(cond->spinlock);
+  error_t error = 0;
+  libtask_task_t *task = libtask_get_task_current();
+  if (task) {
+    // Task context!
+    libtask_timed_wait_t wait;
+    libtask_list_push_back(&cond->list, &task->waiting_link);
+    error = libtask__timed_wait_start(&wait, task, cond->spinlock,
+				      deadline_usecs);
+    if (error) {
+      libtask_list_erase(&task->waiting_link);
+      return error;
+    }
+    libtask_spinlock_unlock(cond->spinlock);
+    libtask__task_suspend();
+    error = libtask__timed_wait_finish(&wait);
+    libtask_spinlock_lock(cond->spinlock);
+
+  } else {
+    // Pthread context!
+    struct timespec ts;
+    ts.tv_sec = deadline_usecs / 1000000;
+    ts.tv_nsec = (deadline_usecs % 1000000) * 1000;
+    error = libtask__condition_park(cond, &ts);
+  }
+  return error;
 }
 
 static inline bool
@@ -77,15 +127,10 @@ libtask_condition_wakeup_first(libtask_condition_t *cond, libtask_list_t *list)
   libtask_task_t *task = libtask_list_entry(link, libtask_task_t,
 					    waiting_link);
   libtask_task_pool_t *task_pool = task->owner;
-  if (&task_pool->spinlock != cond->spinlock) {
-    libtask_spinlock_lock(&task_pool->spinlock);
-  }
-
-  libtask_list_push_back(&task_pool->waiting_list, &task->waiting_link);
-  libtask_condition_signal(&task_pool->waiting_condition);
-
-  if (&task_pool->spinlock != cond->spinlock) {
-    libtask_spinlock_unlock(&task_pool->spinlock);
+  if (&task_pool->spinlock == cond->spinlock) {
+    libtask__task_pool_wakeup_locked(task_pool, task);
+  } else {
+    libtask__task_pool_wakeup(task_pool, task);
   }
   return true;
 }
@@ -95,10 +140,10 @@ libtask_condition_signal(libtask_condition_t *cond)
 {
   assert(libtask_spinlock_status(cond->spinlock) == false);
 
-  if (libtask_condition_wakeup_first(cond, &cond->list) == false) {
-    CHECK(pthread_mutex_lock(&cond->mutex) == 0);
-    pthread_cond_signal(&cond->cond);
-    CHECK(pthread_mutex_unlock(&cond->mutex) == 0);
+  if (libtask_condition_wakeup_first(cond, &cond->list) == false &&
+      cond->nwaiters > 0) {
+    cond->futex++;
+    libtask_futex_wake(&cond->futex, 1);
   }
 }
 
@@ -114,5 +159,8 @@ libtask_condition_broadcast(libtask_condition_t *cond)
   while (!libtask_list_empty(&list)) {
     libtask_condition_wakeup_first(cond, &list);
   }
-  pthread_cond_broadcast(&cond->cond);
+  if (cond->nwaiters > 0) {
+    cond->futex++;
+    libtask_futex_wake(&cond->futex, INT_MAX);
+  }
 }
@@ -20,8 +20,6 @@
 #ifndef _LIBTASK_CONDITION_H_
 #define _LIBTASK_CONDITION_H_
 
-#include <pthread.h>
-
 #include "libtask/list.h"
 #include "libtask/spinlock.h"
 
@@ -38,12 +36,12 @@ typedef struct {
   // List of tasks waiting on this condition variable.
   libtask_list_t list;
 
-  // The pthread condition variable for normal threads to wait.
-  pthread_cond_t cond;
-
-  // The pthread mutex that is required by the pthread condition
-  // variable.
-  pthread_mutex_t mutex;
+  // Normal threads wait on this futex word, which is incremented on
+  // every wake up, and nwaiters is the number of such threads. Both
+  // are protected by the spinlock, so signals skip the system call
+  // when no thread is waiting.
+  uint32_t futex;
+  uint32_t nwaiters;
 } libtask_condition_t;
 
 // Initialize a condition variable. Condition variables are always
@@ -72,6 +70,20 @@ libtask_condition_finalize(libtask_condition_t *cond);
 void
 libtask_condition_wait(libtask_condition_t *cond);
 
+// Wait on a condition variable until a deadline. Same as above, but
+// gives up when the deadline passes.
+//
+// cond: The condition variable.
+//
+// deadline_usecs: Absolute deadline in libtask_clock_usecs time.
+//
+// Returns zero when woken up, ETIMEDOUT if deadline has passed or an
+// error number if the deadline cannot be set. Spinlock is locked
+// again in all cases.
+error_t
+libtask_condition_wait_timed(libtask_condition_t *cond,
+			     int64_t deadline_usecs);
+
 // Wake up one task or a thread waiting on the condition variable.
 // The spinlock this condition variable is associated with must be
 // locked by the caller. When a task is woken, its task-pool is also
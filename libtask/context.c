@@ -0,0 +1,95 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "libtask/context.h"
+#include "libtask/log.h"
+
+#if defined(LIBTASK_CONTEXT_X86_64)
+
+// Defined in context_x86_64.S. Calls r12 with r13 as the argument.
+void libtask__context_trampoline(void);
+
+void
+libtask__context_initialize(libtask_context_t *context,
+			    char *stack, int32_t nbytes,
+			    void (*function)(void *), void *argument)
+{
+  // Build the frame that libtask__context_switch pops on a resume:
+  // mxcsr and x87 control word, r15, r14, r13, r12, rbx, rbp and the
+  // return address.  Two padding slots keep the stack pointer 16-byte
+  // aligned when trampoline makes the call.
+  uintptr_t top = ((uintptr_t) (stack + nbytes)) & ~((uintptr_t) 15);
+  uint64_t *frame = (uint64_t *) (top - 10 * sizeof(uint64_t));
+
+  frame[0] = 0x1f80 | ((uint64_t) 0x037f << 32); // Default mxcsr and fpucw.
+  frame[1] = 0;					 // r15
+  frame[2] = 0;					 // r14
+  frame[3] = (uint64_t) argument;		 // r13
+  frame[4] = (uint64_t) function;		 // r12
+  frame[5] = 0;					 // rbx
+  frame[6] = 0;					 // rbp
+  frame[7] = (uint64_t) libtask__context_trampoline;
+  frame[8] = 0;
+  frame[9] = 0;
+  context->sp = frame;
+}
+
+#elif defined(LIBTASK_CONTEXT_AARCH64)
+
+// Defined in context_aarch64.S. Calls x19 with x20 as the argument.
+void libtask__context_trampoline(void);
+
+void
+libtask__context_initialize(libtask_context_t *context,
+			    char *stack, int32_t nbytes,
+			    void (*function)(void *), void *argument)
+{
+  // Build the frame that libtask__context_switch pops on a resume:
+  // x19-x28, x29, x30 and d8-d15 followed by 16 bytes of padding.
+  uintptr_t top = ((uintptr_t) (stack + nbytes)) & ~((uintptr_t) 15);
+  uint64_t *frame = (uint64_t *) (top - 22 * sizeof(uint64_t));
+
+  memset(frame, 0, 22 * sizeof(uint64_t));
+  frame[0] = (uint64_t) function;		 // x19
+  frame[1] = (uint64_t) argument;		 // x20
+  frame[11] = (uint64_t) libtask__context_trampoline; // x30
+  context->sp = frame;
+}
+
+#else
+
+void
+libtask__context_initialize(libtask_context_t *context,
+			    char *stack, int32_t nbytes,
+			    void (*function)(void *), void *argument)
+{
+  CHECK(getcontext(&context->uct) == 0);
+  context->uct.uc_stack.ss_sp = stack;
+  context->uct.uc_stack.ss_size = nbytes;
+  context->uct.uc_link = NULL;
+  makecontext(&context->uct, (void(*)())function, 1, argument);
+}
+
+void
+libtask__context_switch(libtask_context_t *from, libtask_context_t *to)
+{
+  CHECK(swapcontext(&from->uct, &to->uct) == 0);
+}
+
+#endif
@@ -0,0 +1,104 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _LIBTASK_CONTEXT_H_
+#define _LIBTASK_CONTEXT_H_
+
+#include "libtask/base.h"
+
+// Execution Context
+//
+// A context is the saved state of a stack of execution, so that
+// control can leave it and resume it later.  Two implementations are
+// available and one of them is selected at configure time:
+//
+// 1. An assembly routine (x86-64 and aarch64) that saves only the
+//    callee-saved registers on the stack being left and records the
+//    stack pointer in the context.  Caller-saved registers are
+//    already saved by the compiler at the call site, so nothing else
+//    is needed.
+//
+// 2. The portable ucontext interface.  It is much slower because
+//    glibc saves and restores the signal mask with a system call on
+//    every swapcontext.
+
+#if defined(LIBTASK_CONTEXT_X86_64) || defined(LIBTASK_CONTEXT_AARCH64)
+
+#define LIBTASK_CONTEXT_ASM 1
+
+typedef struct {
+  // Stack pointer of the suspended context. All other registers are
+  // saved on the stack itself.
+  void *sp;
+} libtask_context_t;
+
+#else
+
+#include <ucontext.h>
+
+typedef struct {
+  ucontext_t uct;
+} libtask_context_t;
+
+#endif
+
+// Prepare a context such that switching to it calls a function on a
+// new stack.  The function must never return.
+//
+// context: The context to initialize.
+//
+// stack: Lowest address of the stack memory.
+//
+// nbytes: Size of the stack memory in bytes.
+//
+// function: Function to call when context is resumed for the first
+//           time.
+//
+// argument: Argument to the function.
+void
+libtask__context_initialize(libtask_context_t *context,
+			    char *stack, int32_t nbytes,
+			    void (*function)(void *), void *argument);
+
+// Save the current context into from and resume the context in
+// to. Returns when some other context switches back into from.
+//
+// from: Context where current state is saved.
+//
+// to: Context to resume.
+void
+libtask__context_switch(libtask_context_t *from, libtask_context_t *to);
+
+// Get the stack pointer of a suspended context or NULL when it is not
+// known for this platform.
+static inline char *
+libtask__context_stack_pointer(const libtask_context_t *context)
+{
+#if defined(LIBTASK_CONTEXT_ASM)
+  return (char *)context->sp;
+#elif defined(__x86_64__)
+  return (char *)context->uct.uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+  return (char *)context->uct.uc_mcontext.sp;
+#else
+  return NULL;
+#endif
+}
+
+#endif // _LIBTASK_CONTEXT_H_
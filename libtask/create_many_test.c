@@ -0,0 +1,188 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+//
+// Testcase for batch task creation. Batches of tasks are created from
+// the main thread and from a task, and every task checks its argument
+// and hops between task-pools before it finishes.
+//
+
+#include <argp.h>
+#include <pthread.h>
+
+#include "libtask/libtask.h"
+#include "libtask/log.h"
+
+#define TASK_STACK_SIZE (16*1024)
+
+static int32_t num_threads = 2;
+static int32_t num_tasks = 1000;
+static int32_t num_batches = 4;
+
+static struct argp_option options[] = {
+  {"num-threads", 0, "PINT32", 0, "No. of threads in each task-pool."},
+  {"num-tasks",   1, "PINT32", 0, "No. of tasks in a batch."},
+  {"num-batches", 2, "PINT32", 0, "No. of batches created by main thread."},
+  {0}
+};
+
+static libtask_task_pool_t pools[2];
+static int32_t nfinished = 0;
+
+int
+work(void *arg_)
+{
+  int32_t *slot = (int32_t *)arg_;
+  CHECK(*slot == 0);
+  if (random() % 2) {
+    libtask_task_pool_schedule(&pools[random() % 2]);
+  }
+  *slot = 1;
+  libtask_atomic_add(&nfinished, 1);
+  return 0;
+}
+
+// Arguments for the tasks of a batch.
+static void **
+make_arguments(int32_t **slotsp)
+{
+  int32_t *slots = calloc(num_tasks, sizeof(int32_t));
+  void **arguments = malloc(num_tasks * sizeof(void *));
+  CHECK(slots && arguments);
+  for (int i = 0; i < num_tasks; i++) {
+    arguments[i] = &slots[i];
+  }
+  *slotsp = slots;
+  return arguments;
+}
+
+// Wait for a batch and destroy it.
+static void
+finish(libtask_task_t **tasks, int32_t *slots)
+{
+  for (int i = 0; i < num_tasks; i++) {
+    CHECK(libtask_task_wait(tasks[i]) == 0);
+    CHECK(slots[i] == 1);
+  }
+  for (int i = 0; i < num_tasks; i++) {
+    CHECK(libtask_task_unref(tasks[i]) == 0);
+  }
+}
+
+// Creates a batch from task context.
+int
+spawner(void *arg_)
+{
+  int32_t *slots;
+  void **arguments = make_arguments(&slots);
+  libtask_task_t **tasks = malloc(num_tasks * sizeof(libtask_task_t *));
+  CHECK(tasks);
+  CHECK(libtask_task_create_many(tasks, num_tasks, &pools[1], work,
+				 arguments, TASK_STACK_SIZE) == 0);
+  finish(tasks, slots);
+  free(tasks);
+  free(arguments);
+  free(slots);
+  return 0;
+}
+
+static error_t
+parse_options(int key, char *arg, struct argp_state *state)
+{
+  switch(key) {
+  case 0: // num-threads
+    if (!str2pint32(arg, 10, &num_threads)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 1: // num-tasks
+    if (!str2pint32(arg, 10, &num_tasks)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 2: // num-batches
+    if (!str2pint32(arg, 10, &num_batches)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  default:
+    return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct argp_child children[2];
+  children[0] = libtask_argp_child;
+  children[1] = (struct argp_child){0};
+
+  struct argp argp = { options, parse_options, 0, 0, children };
+  argp_parse(&argp, argc, argv, 0, 0, 0);
+
+  pthread_t threads[2][num_threads];
+  for (int i = 0; i < 2; i++) {
+    CHECK(libtask_task_pool_initialize(&pools[i]) == 0);
+    for (int j = 0; j < num_threads; j++) {
+      CHECK(libtask_task_pool_start(&pools[i], &threads[i][j]) == 0);
+    }
+  }
+
+  libtask_task_t *task;
+  CHECK(libtask_task_create_many(&task, 0, &pools[0], work, NULL,
+				 TASK_STACK_SIZE) == EINVAL);
+
+  libtask_task_t spawner_task;
+  CHECK(libtask_task_initialize(&spawner_task, &pools[0], spawner, NULL,
+				TASK_STACK_SIZE) == 0);
+
+  int64_t start_usecs = libtask_now_usecs();
+  for (int i = 0; i < num_batches; i++) {
+    int32_t *slots;
+    void **arguments = make_arguments(&slots);
+    libtask_task_t **tasks = malloc(num_tasks * sizeof(libtask_task_t *));
+    CHECK(tasks);
+    CHECK(libtask_task_create_many(tasks, num_tasks, &pools[i % 2], work,
+				   arguments, TASK_STACK_SIZE) == 0);
+    finish(tasks, slots);
+    free(tasks);
+    free(arguments);
+    free(slots);
+  }
+  CHECK(libtask_task_wait(&spawner_task) == 0);
+  DEBUG("%d batches finished in %ld usecs\n", num_batches + 1,
+	libtask_now_usecs() - start_usecs);
+  CHECK(nfinished == num_tasks * (num_batches + 1));
+
+  for (int i = 0; i < 2; i++) {
+    for (int j = 0; j < num_threads; j++) {
+      CHECK(libtask_task_pool_stop(&pools[i], threads[i][j]) == 0);
+      CHECK(pthread_join(threads[i][j], NULL) == 0);
+    }
+  }
+  CHECK(libtask_task_unref(&spawner_task) == 0);
+  for (int i = 0; i < 2; i++) {
+    CHECK(libtask_task_pool_finalize(&pools[i]) == 0);
+  }
+  return 0;
+}
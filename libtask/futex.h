@@ -0,0 +1,69 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _LIBTASK_FUTEX_H_
+#define _LIBTASK_FUTEX_H_
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libtask/base.h"
+
+// Thin wrappers over the futex system call for process private
+// futexes.
+
+// Wait until the futex word is woken up, if it still has the expected
+// value.
+//
+// word: The futex word.
+//
+// value: Expected value of the word.
+//
+// deadline: Absolute CLOCK_MONOTONIC deadline or NULL.
+//
+// Returns zero when woken up, EAGAIN if word didn't have the value,
+// EINTR on a signal or ETIMEDOUT.
+static inline error_t
+libtask_futex_wait(uint32_t *word, uint32_t value,
+		   const struct timespec *deadline)
+{
+  if (syscall(SYS_futex, word, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG,
+	      value, deadline, NULL, FUTEX_BITSET_MATCH_ANY) < 0) {
+    return errno;
+  }
+  return 0;
+}
+
+// Wake up threads waiting on a futex word.
+//
+// word: The futex word.
+//
+// count: Maximum number of threads to wake up.
+//
+// Returns the number of threads woken up.
+static inline int
+libtask_futex_wake(uint32_t *word, int count)
+{
+  return (int)syscall(SYS_futex, word, FUTEX_WAKE | FUTEX_PRIVATE_FLAG,
+		      count, NULL, NULL, 0);
+}
+
+#endif // _LIBTASK_FUTEX_H_
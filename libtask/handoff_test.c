@@ -0,0 +1,293 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+//
+// Testcase for the direct handoffs. Pairs of tasks ping-pong through
+// semaphores with handoffs enabled while other tasks yield to random
+// peers; every round must complete and every yield must either switch
+// or find the peer not waiting to run. Finally, a task hands off a
+// thread that is asked to stop, which must still run the woken task.
+//
+
+#include <argp.h>
+#include <unistd.h>
+
+#include "libtask/libtask.h"
+#include "libtask/log.h"
+
+#define TASK_STACK_SIZE (64*1024)
+
+static int32_t num_threads = 4;
+static int32_t num_pairs = 10;
+static int32_t num_rounds = 1000;
+static int32_t num_yielders = 20;
+static int32_t num_yields = 1000;
+
+static struct argp_option options[] = {
+  {"num-threads",  0, "PINT32", 0, "No. of threads in the task-pool."},
+  {"num-pairs",    1, "PINT32", 0, "No. of ping-pong task pairs."},
+  {"num-rounds",   2, "PINT32", 0, "No. of ping-pongs per pair."},
+  {"num-yielders", 3, "PINT32", 0, "No. of tasks yielding to each other."},
+  {"num-yields",   4, "PINT32", 0, "No. of yields per yielding task."},
+  {0}
+};
+
+typedef struct {
+  libtask_semaphore_t ping;
+  libtask_semaphore_t pong;
+  int32_t nrounds;
+} pair_t;
+
+static libtask_task_t *yielders;
+static int32_t nyielded = 0;
+static int32_t nswitched = 0;
+static int32_t nfinished = 0;
+
+int
+pinger(void *arg_)
+{
+  pair_t *pair = (pair_t *)arg_;
+  for (int i = 0; i < num_rounds; i++) {
+    libtask_semaphore_up(&pair->ping);
+    libtask_semaphore_down(&pair->pong);
+  }
+  return 0;
+}
+
+int
+ponger(void *arg_)
+{
+  pair_t *pair = (pair_t *)arg_;
+  for (int i = 0; i < num_rounds; i++) {
+    libtask_semaphore_down(&pair->ping);
+    pair->nrounds++;
+    libtask_semaphore_up(&pair->pong);
+  }
+  return 0;
+}
+
+int
+yielder(void *arg_)
+{
+  libtask_task_t *self = libtask_get_task_current();
+  CHECK(libtask_yield_to(self) == EINVAL);
+
+  for (int i = 0; i < num_yields; i++) {
+    libtask_task_t *peer = &yielders[random() % num_yielders];
+    error_t error = libtask_yield_to(peer);
+    if (peer == self) {
+      CHECK(error == EINVAL);
+      continue;
+    }
+    CHECK(error == 0 || error == EAGAIN);
+    libtask_atomic_add(&nyielded, 1);
+    if (error == 0) {
+      libtask_atomic_add(&nswitched, 1);
+    }
+  }
+
+  // Peers must not finish while others may still yield to them.
+  libtask_atomic_add(&nfinished, 1);
+  while (libtask_atomic_load(&nfinished) < num_yielders) {
+    libtask_yield();
+  }
+  return 0;
+}
+
+// A waiter blocks on the semaphore and a stopper wakes it up from a
+// thread that main has asked to stop meanwhile.
+static libtask_semaphore_t stop_semaphore;
+static int32_t waiter_blocked = 0;
+static int32_t stopper_ready = 0;
+static int32_t stopper_stopped = 0;
+static pthread_t stopper_thread;
+
+int
+waiter(void *arg_)
+{
+  libtask_atomic_store(&waiter_blocked, 1);
+  libtask_semaphore_down(&stop_semaphore);
+  return 0;
+}
+
+int
+stopper(void *arg_)
+{
+  while (!libtask_atomic_load(&waiter_blocked)) {
+    libtask_yield();
+  }
+  CHECK(libtask_sleep_usecs(10000) == 0);
+
+  // Keep the thread busy until it is asked to stop.
+  stopper_thread = pthread_self();
+  libtask_atomic_store(&stopper_ready, 1);
+  while (!libtask_atomic_load(&stopper_stopped)) {
+    libtask_cpu_relax();
+  }
+  libtask_semaphore_up(&stop_semaphore);
+  return 0;
+}
+
+static error_t
+parse_options(int key, char *arg, struct argp_state *state)
+{
+  switch(key) {
+  case 0: // num-threads
+    if (!str2pint32(arg, 10, &num_threads)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 1: // num-pairs
+    if (!str2pint32(arg, 10, &num_pairs)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 2: // num-rounds
+    if (!str2pint32(arg, 10, &num_rounds)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 3: // num-yielders
+    if (!str2pint32(arg, 10, &num_yielders)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 4: // num-yields
+    if (!str2pint32(arg, 10, &num_yields)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  default:
+    return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct argp_child children[2];
+  children[0] = libtask_argp_child;
+  children[1] = (struct argp_child){0};
+
+  libtask_option_handoff = true;
+  struct argp argp = { options, parse_options, 0, 0, children };
+  argp_parse(&argp, argc, argv, 0, 0, 0);
+
+  libtask_task_pool_t pool;
+  CHECK(libtask_task_pool_initialize(&pool) == 0);
+
+  pair_t pairs[num_pairs];
+  libtask_task_t pingers[num_pairs];
+  libtask_task_t pongers[num_pairs];
+  for (int i = 0; i < num_pairs; i++) {
+    libtask_semaphore_initialize(&pairs[i].ping, 0);
+    libtask_semaphore_initialize(&pairs[i].pong, 0);
+    pairs[i].nrounds = 0;
+    CHECK(libtask_task_initialize(&pongers[i], &pool, ponger, &pairs[i],
+				  TASK_STACK_SIZE) == 0);
+    CHECK(libtask_task_initialize(&pingers[i], &pool, pinger, &pairs[i],
+				  TASK_STACK_SIZE) == 0);
+  }
+
+  libtask_task_t yielder_tasks[num_yielders];
+  yielders = yielder_tasks;
+  for (int i = 0; i < num_yielders; i++) {
+    CHECK(libtask_task_initialize(&yielders[i], &pool, yielder, NULL,
+				  TASK_STACK_SIZE) == 0);
+  }
+
+  // Yields are possible only from tasks.
+  CHECK(libtask_yield_to(&yielders[0]) == EINVAL);
+
+  // Threads are started after all yielders exist.
+  pthread_t threads[num_threads];
+  for (int i = 0; i < num_threads; i++) {
+    CHECK(libtask_task_pool_start(&pool, &threads[i]) == 0);
+  }
+
+  for (int i = 0; i < num_pairs; i++) {
+    CHECK(libtask_task_wait(&pingers[i]) == 0);
+    CHECK(libtask_task_wait(&pongers[i]) == 0);
+    CHECK(pairs[i].nrounds == num_rounds);
+  }
+  for (int i = 0; i < num_yielders; i++) {
+    CHECK(libtask_task_wait(&yielders[i]) == 0);
+  }
+  DEBUG("%d of %d yields switched directly\n", nswitched, nyielded);
+  CHECK(nswitched <= nyielded);
+
+  // Stale run queue entries left by the yields are dropped by the
+  // time the threads leave.
+  for (int i = 0; i < num_threads; i++) {
+    CHECK(libtask_task_pool_stop(&pool, threads[i]) == 0);
+    CHECK(pthread_join(threads[i], NULL) == 0);
+  }
+
+  // Woken task is run by the stopping thread before it leaves.
+  libtask_task_pool_t stop_pool;
+  CHECK(libtask_task_pool_initialize(&stop_pool) == 0);
+  libtask_semaphore_initialize(&stop_semaphore, 0);
+  libtask_task_t waiter_task;
+  libtask_task_t stopper_task;
+  CHECK(libtask_task_initialize(&waiter_task, &stop_pool, waiter, NULL,
+				TASK_STACK_SIZE) == 0);
+  CHECK(libtask_task_initialize(&stopper_task, &stop_pool, stopper, NULL,
+				TASK_STACK_SIZE) == 0);
+  pthread_t stop_threads[2];
+  for (int i = 0; i < 2; i++) {
+    CHECK(libtask_task_pool_start(&stop_pool, &stop_threads[i]) == 0);
+  }
+  while (!libtask_atomic_load(&stopper_ready)) {
+    usleep(1000);
+  }
+  CHECK(libtask_task_pool_stop(&stop_pool, stopper_thread) == 0);
+  libtask_atomic_store(&stopper_stopped, 1);
+  int64_t deadline = libtask_clock_usecs() + 5 * 1000000;
+  CHECK(libtask_task_wait_timed(&waiter_task, deadline) == 0);
+  CHECK(libtask_task_wait_timed(&stopper_task, deadline) == 0);
+  for (int i = 0; i < 2; i++) {
+    if (!pthread_equal(stop_threads[i], stopper_thread)) {
+      CHECK(libtask_task_pool_stop(&stop_pool, stop_threads[i]) == 0);
+    }
+    CHECK(pthread_join(stop_threads[i], NULL) == 0);
+  }
+  CHECK(libtask_task_unref(&waiter_task) == 0);
+  CHECK(libtask_task_unref(&stopper_task) == 0);
+  libtask_semaphore_finalize(&stop_semaphore);
+  CHECK(libtask_task_pool_finalize(&stop_pool) == 0);
+
+  for (int i = 0; i < num_pairs; i++) {
+    CHECK(libtask_task_unref(&pingers[i]) == 0);
+    CHECK(libtask_task_unref(&pongers[i]) == 0);
+    libtask_semaphore_finalize(&pairs[i].ping);
+    libtask_semaphore_finalize(&pairs[i].pong);
+  }
+  for (int i = 0; i < num_yielders; i++) {
+    CHECK(libtask_task_unref(&yielders[i]) == 0);
+  }
+  CHECK(libtask_task_pool_finalize(&pool) == 0);
+  return 0;
+}
@@ -0,0 +1,275 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "libtask/io.h"
+#include "libtask/libtask.h"
+#include "libtask/log.h"
+
+#ifdef LIBTASK_IO_URING
+#include "libtask/uring.h"
+
+// Get the io_uring instance of current worker, creating it if
+// necessary. Returns NULL if io_uring cannot be used.
+static libtask_uring_t *
+libtask__io_get_uring(void)
+{
+  if (!libtask_option_io_uring) {
+    return NULL;
+  }
+
+  libtask_worker_t *worker = libtask__get_worker_current();
+  if (!worker) {
+    return NULL;
+  }
+  if (worker->uring || worker->uring_error) {
+    return worker->uring;
+  }
+
+  libtask_task_pool_t *task_pool = worker->task_pool;
+  error_t error = libtask__reactor_open(task_pool);
+  if (error) {
+    worker->uring_error = error;
+    return NULL;
+  }
+
+  libtask_uring_t *uring = NULL;
+  error = libtask__uring_create(&uring);
+  if (error) {
+    worker->uring_error = error;
+    return NULL;
+  }
+
+  // Thread polling the reactor reaps the ring when this worker is not
+  // around.
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = (void *)((uintptr_t)uring | LIBTASK_REACTOR_URING);
+  if (epoll_ctl(task_pool->reactor.epfd, EPOLL_CTL_ADD, uring->fd,
+		&event) != 0) {
+    worker->uring_error = errno;
+    libtask__uring_destroy(uring);
+    return NULL;
+  }
+
+  worker->uring = uring;
+  return uring;
+}
+
+// Suspend current task until the request queued in the uring is
+// complete. Returns the result of the operation.
+static int32_t
+libtask__io_wait(libtask_uring_request_t *request)
+{
+  libtask_task_pool_t *task_pool = request->task->owner;
+  libtask_atomic_add(&task_pool->reactor.nwaiters, 1);
+  libtask__reactor_kick(task_pool);
+  libtask__task_suspend();
+  return request->result;
+}
+
+// Convert an io_uring result into a system call result.
+static inline int32_t
+libtask__io_result(int32_t result)
+{
+  if (result < 0) {
+    errno = -result;
+    return -1;
+  }
+  return result;
+}
+
+// Prepare a submission entry for current task or return NULL.
+#define LIBTASK__IO_PREPARE(request)					\
+  ({									\
+    struct io_uring_sqe *sqe__ = NULL;					\
+    (request)->task = libtask_get_task_current();			\
+    libtask_uring_t *uring__ = (request)->task ?			\
+      libtask__io_get_uring() : NULL;					\
+    if (uring__) {							\
+      sqe__ = libtask__uring_get_sqe(uring__, (request));		\
+    }									\
+    sqe__;								\
+  })
+
+#endif // LIBTASK_IO_URING
+
+// Retry an operation on a non-blocking file descriptor after waiting
+// for the events in the reactor.
+#define LIBTASK__IO_RETRY(fd, events, expr)				\
+  ({									\
+    __typeof ((expr)) result__;						\
+    while (true) {							\
+      result__ = (expr);						\
+      if (result__ >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) { \
+	break;								\
+      }									\
+      if (!libtask_get_task_current()) {				\
+	break;								\
+      }									\
+      error_t error__ = libtask_fd_wait((fd), (events));		\
+      if (error__) {							\
+	errno = error__;						\
+	break;								\
+      }									\
+    }									\
+    result__;								\
+  })
+
+ssize_t
+libtask_read(int fd, void *buffer, size_t size)
+{
+#ifdef LIBTASK_IO_URING
+  libtask_uring_request_t request;
+  struct io_uring_sqe *sqe = LIBTASK__IO_PREPARE(&request);
+  if (sqe) {
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = size;
+    sqe->off = (uint64_t)-1;
+    int32_t result = libtask__io_wait(&request);
+    if (result != -EAGAIN) {
+      return libtask__io_result(result);
+    }
+  }
+#endif
+  return LIBTASK__IO_RETRY(fd, EPOLLIN, read(fd, buffer, size));
+}
+
+ssize_t
+libtask_write(int fd, const void *buffer, size_t size)
+{
+#ifdef LIBTASK_IO_URING
+  libtask_uring_request_t request;
+  struct io_uring_sqe *sqe = LIBTASK__IO_PREPARE(&request);
+  if (sqe) {
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = size;
+    sqe->off = (uint64_t)-1;
+    int32_t result = libtask__io_wait(&request);
+    if (result != -EAGAIN) {
+      return libtask__io_result(result);
+    }
+  }
+#endif
+  return LIBTASK__IO_RETRY(fd, EPOLLOUT, write(fd, buffer, size));
+}
+
+ssize_t
+libtask_pread(int fd, void *buffer, size_t size, off_t offset)
+{
+#ifdef LIBTASK_IO_URING
+  libtask_uring_request_t request;
+  struct io_uring_sqe *sqe = LIBTASK__IO_PREPARE(&request);
+  if (sqe) {
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = size;
+    sqe->off = offset;
+    return libtask__io_result(libtask__io_wait(&request));
+  }
+#endif
+  // Regular files are always ready for epoll, so there is nothing to
+  // wait for.
+  return pread(fd, buffer, size, offset);
+}
+
+int
+libtask_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+#ifdef LIBTASK_IO_URING
+  libtask_uring_request_t request;
+  struct io_uring_sqe *sqe = LIBTASK__IO_PREPARE(&request);
+  if (sqe) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->addr2 = (uint64_t)(uintptr_t)addrlen;
+    int32_t result = libtask__io_wait(&request);
+    if (result != -EAGAIN) {
+      return libtask__io_result(result);
+    }
+  }
+#endif
+  return LIBTASK__IO_RETRY(fd, EPOLLIN, accept(fd, addr, addrlen));
+}
+
+int
+libtask_connect(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+  // Set when io_uring has started the connection on a non-blocking
+  // socket, in which case we only wait for it.
+  bool started = false;
+
+#ifdef LIBTASK_IO_URING
+  libtask_uring_request_t request;
+  struct io_uring_sqe *sqe = LIBTASK__IO_PREPARE(&request);
+  if (sqe) {
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->off = addrlen;
+    int32_t result = libtask__io_wait(&request);
+    if (result != -EINPROGRESS) {
+      return libtask__io_result(result);
+    }
+    started = true;
+  }
+#endif
+  if (!libtask_get_task_current()) {
+    return connect(fd, addr, addrlen);
+  }
+
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0) {
+    return -1;
+  }
+  if (!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    return -1;
+  }
+
+  int result = -1;
+  errno = EINPROGRESS;
+  if (!started) {
+    result = connect(fd, addr, addrlen);
+  }
+  if (result < 0 && errno == EINPROGRESS) {
+    error_t error = libtask_fd_wait(fd, EPOLLOUT);
+    socklen_t len = sizeof(error);
+    if (!error &&
+	getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+      error = errno;
+    }
+    errno = error;
+    result = error ? -1 : 0;
+  }
+
+  if (!(flags & O_NONBLOCK)) {
+    error_t error = errno;
+    CHECK(fcntl(fd, F_SETFL, flags) == 0);
+    errno = error;
+  }
+  return result;
+}
@@ -0,0 +1,58 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _LIBTASK_IO_H_
+#define _LIBTASK_IO_H_
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "libtask/base.h"
+
+// Asynchronous io
+//
+// These functions are like their system call namesakes, but suspend
+// the current task, instead of blocking the thread, until the
+// operation is complete. Operations are submitted to the io_uring
+// instance of the worker thread (see uring.h) when the kernel supports
+// io_uring with all operations used here, and are retried after
+// waiting in the task-pool's reactor otherwise or when io_uring
+// reports EAGAIN for a non-blocking file descriptor. The epoll path
+// doesn't block the thread only for the non-blocking file descriptors,
+// except for connect which makes the socket non-blocking temporarily.
+//
+// Outside of task context these are plain system calls. All of them
+// return -1 and set errno on a failure.
+
+ssize_t
+libtask_read(int fd, void *buffer, size_t size);
+
+ssize_t
+libtask_write(int fd, const void *buffer, size_t size);
+
+ssize_t
+libtask_pread(int fd, void *buffer, size_t size, off_t offset);
+
+int
+libtask_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+
+int
+libtask_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+
+#endif // _LIBTASK_IO_H_
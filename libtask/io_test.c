@@ -0,0 +1,253 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+//
+// Testcase for the asynchronous io functions. Tasks talk over pipes
+// and loopback sockets and read a file with the io functions, first
+// with io_uring (when it is available) and then with epoll only.
+//
+
+#include <argp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "libtask/libtask.h"
+#include "libtask/log.h"
+
+#define TASK_STACK_SIZE (64*1024)
+
+static int32_t num_threads = 4;
+static int32_t num_pipes = 50;
+static int32_t num_clients = 50;
+static int32_t num_messages = 1000;
+
+static struct argp_option options[] = {
+  {"num-threads",  0, "PINT32", 0, "No. of threads in the task-pool."},
+  {"num-pipes",    1, "PINT32", 0, "No. of pipes with a reader and a writer."},
+  {"num-clients",  2, "PINT32", 0, "No. of socket clients."},
+  {"num-messages", 3, "PINT32", 0, "No. of messages per pipe and file."},
+  {0}
+};
+
+static libtask_task_pool_t pool;
+
+static int listen_fd = -1;
+static struct sockaddr_in listen_addr;
+
+static int file_fd = -1;
+
+int
+pipe_writer(void *arg_)
+{
+  int fd = (int)(uintptr_t)arg_;
+  for (int32_t i = 0; i < num_messages; i++) {
+    CHECK(libtask_write(fd, &i, sizeof(i)) == sizeof(i));
+  }
+  close(fd);
+  return 0;
+}
+
+int
+pipe_reader(void *arg_)
+{
+  int fd = (int)(uintptr_t)arg_;
+  for (int32_t i = 0; i < num_messages; i++) {
+    int32_t value = -1;
+    CHECK(libtask_read(fd, &value, sizeof(value)) == sizeof(value));
+    CHECK(value == i);
+  }
+  char byte;
+  CHECK(libtask_read(fd, &byte, 1) == 0);
+  close(fd);
+  return 0;
+}
+
+int
+server(void *arg_)
+{
+  for (int32_t i = 0; i < num_clients; i++) {
+    int fd = libtask_accept(listen_fd, NULL, NULL);
+    CHECK(fd >= 0);
+    CHECK(libtask_write(fd, &i, sizeof(i)) == sizeof(i));
+    close(fd);
+  }
+  return 0;
+}
+
+int
+client(void *arg_)
+{
+  // Connect on a blocking socket and read on a non-blocking one.
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  CHECK(fd >= 0);
+  CHECK(libtask_connect(fd, (struct sockaddr *)&listen_addr,
+			sizeof(listen_addr)) == 0);
+  CHECK(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == 0);
+
+  int32_t value = -1;
+  CHECK(libtask_read(fd, &value, sizeof(value)) == sizeof(value));
+  CHECK(value >= 0 && value < num_clients);
+  close(fd);
+  return 0;
+}
+
+int
+file_reader(void *arg_)
+{
+  for (int32_t i = 0; i < num_messages; i++) {
+    int32_t index = random() % num_messages;
+    int32_t value = -1;
+    CHECK(libtask_pread(file_fd, &value, sizeof(value),
+			index * sizeof(value)) == sizeof(value));
+    CHECK(value == index);
+  }
+  return 0;
+}
+
+static void
+run_tasks(void)
+{
+  int32_t ntasks = 2 * num_pipes + num_clients + 2;
+  libtask_task_t *tasks = malloc(sizeof(libtask_task_t) * ntasks);
+  CHECK(tasks);
+
+  int32_t n = 0;
+  for (int i = 0; i < num_pipes; i++) {
+    int fds[2];
+    CHECK(pipe2(fds, O_NONBLOCK) == 0);
+    CHECK(libtask_task_initialize(&tasks[n++], &pool, pipe_reader,
+				  (void *)(uintptr_t)fds[0],
+				  TASK_STACK_SIZE) == 0);
+    CHECK(libtask_task_initialize(&tasks[n++], &pool, pipe_writer,
+				  (void *)(uintptr_t)fds[1],
+				  TASK_STACK_SIZE) == 0);
+  }
+  CHECK(libtask_task_initialize(&tasks[n++], &pool, server, NULL,
+				TASK_STACK_SIZE) == 0);
+  for (int i = 0; i < num_clients; i++) {
+    CHECK(libtask_task_initialize(&tasks[n++], &pool, client, NULL,
+				  TASK_STACK_SIZE) == 0);
+  }
+  CHECK(libtask_task_initialize(&tasks[n++], &pool, file_reader, NULL,
+				TASK_STACK_SIZE) == 0);
+  CHECK(n == ntasks);
+
+  for (int i = 0; i < ntasks; i++) {
+    CHECK(libtask_task_wait(&tasks[i]) == 0);
+  }
+  for (int i = 0; i < ntasks; i++) {
+    CHECK(libtask_task_unref(&tasks[i]) == 0);
+  }
+  free(tasks);
+}
+
+static error_t
+parse_options(int key, char *arg, struct argp_state *state)
+{
+  switch(key) {
+  case 0: // num-threads
+    if (!str2pint32(arg, 10, &num_threads)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 1: // num-pipes
+    if (!str2pint32(arg, 10, &num_pipes)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 2: // num-clients
+    if (!str2pint32(arg, 10, &num_clients)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 3: // num-messages
+    if (!str2pint32(arg, 10, &num_messages)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  default:
+    return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct argp_child children[2];
+  children[0] = libtask_argp_child;
+  children[1] = (struct argp_child){0};
+
+  struct argp argp = { options, parse_options, 0, 0, children };
+  argp_parse(&argp, argc, argv, 0, 0, 0);
+
+  // Listening socket on a kernel chosen port.
+  listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  CHECK(listen_fd >= 0);
+  memset(&listen_addr, 0, sizeof(listen_addr));
+  listen_addr.sin_family = AF_INET;
+  CHECK(inet_aton("127.0.0.1", &listen_addr.sin_addr) != 0);
+  CHECK(bind(listen_fd, (struct sockaddr *)&listen_addr,
+	     sizeof(listen_addr)) == 0);
+  socklen_t addrlen = sizeof(listen_addr);
+  CHECK(getsockname(listen_fd, (struct sockaddr *)&listen_addr,
+		    &addrlen) == 0);
+  CHECK(listen(listen_fd, num_clients) == 0);
+
+  // File with the message indices.
+  char path[] = "/tmp/libtask_io_test.XXXXXX";
+  file_fd = mkstemp(path);
+  CHECK(file_fd >= 0);
+  CHECK(unlink(path) == 0);
+  for (int32_t i = 0; i < num_messages; i++) {
+    CHECK(write(file_fd, &i, sizeof(i)) == sizeof(i));
+  }
+
+  CHECK(libtask_task_pool_initialize(&pool) == 0);
+  pthread_t threads[num_threads];
+  for (int i = 0; i < num_threads; i++) {
+    CHECK(libtask_task_pool_start(&pool, &threads[i]) == 0);
+  }
+
+  bool io_uring = libtask_option_io_uring;
+  for (int round = 0; round < 2; round++) {
+    libtask_option_io_uring = io_uring && round == 0;
+    int64_t start_usecs = libtask_now_usecs();
+    run_tasks();
+    DEBUG("io_uring %d finished in %ld usecs\n", libtask_option_io_uring,
+	  libtask_now_usecs() - start_usecs);
+  }
+
+  for (int i = 0; i < num_threads; i++) {
+    CHECK(libtask_task_pool_stop(&pool, threads[i]) == 0);
+    CHECK(pthread_join(threads[i], NULL) == 0);
+  }
+  CHECK(libtask_task_pool_finalize(&pool) == 0);
+
+  close(file_fd);
+  close(listen_fd);
+  return 0;
+}
@@ -30,6 +30,12 @@
 #include "libtask/semaphore.h"
 #include "libtask/spinlock.h"
 #include "libtask/condition.h"
+#include "libtask/mutex.h"
+#include "libtask/channel.h"
+#include "libtask/reactor.h"
+#include "libtask/io.h"
+#include "libtask/timer.h"
+#include "libtask/options.h"
 
 // Command line options for configuring the library.
 extern struct argp libtask_argp;
@@ -0,0 +1,132 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "libtask/task.h"
+#include "libtask/task_pool.h"
+#include "libtask/mutex.h"
+#include "libtask/futex.h"
+#include "libtask/log.h"
+
+// A waiter lives on the stack of the waiting task or thread. Tasks
+// are suspended and threads wait until their futex word is set.
+typedef struct {
+  libtask_list_t link;
+  libtask_task_t *task;
+  uint32_t futex;
+} libtask_mutex_waiter_t;
+
+void
+libtask_mutex_initialize(libtask_mutex_t *mutex)
+{
+  mutex->state = 0;
+  libtask_spinlock_initialize(&mutex->spinlock);
+  libtask_list_initialize(&mutex->waiting_list);
+}
+
+void
+libtask_mutex_finalize(libtask_mutex_t *mutex)
+{
+  assert(mutex->state == 0);
+  assert(libtask_list_empty(&mutex->waiting_list));
+  libtask_spinlock_finalize(&mutex->spinlock);
+}
+
+bool
+libtask_mutex_trylock(libtask_mutex_t *mutex)
+{
+  return libtask_atomic_cmpxchg(&mutex->state, 0, 1) == 0;
+}
+
+void
+libtask_mutex_lock(libtask_mutex_t *mutex)
+{
+  if (libtask_mutex_trylock(mutex)) {
+    return;
+  }
+  for (int i = 0; i < LIBTASK_MUTEX_SPINS; i++) {
+    libtask_cpu_relax();
+    if (libtask_atomic_load_relaxed(&mutex->state) == 0 &&
+	libtask_mutex_trylock(mutex)) {
+      return;
+    }
+  }
+
+  // Mark the mutex contended, so that unlock looks for waiters, and
+  // take it if it has become free meanwhile.
+  libtask_spinlock_lock(&mutex->spinlock);
+  if (libtask_atomic_exchange_acq_rel(&mutex->state, 2) == 0) {
+    libtask_spinlock_unlock(&mutex->spinlock);
+    return;
+  }
+
+  libtask_mutex_waiter_t waiter;
+  libtask_list_initialize(&waiter.link);
+  waiter.task = libtask_get_task_current();
+  waiter.futex = 0;
+  libtask_list_push_back(&mutex->waiting_list, &waiter.link);
+  libtask_spinlock_unlock(&mutex->spinlock);
+
+  if (waiter.task) {
+    // Task context!
+    libtask__task_suspend();
+  } else {
+    // Pthread context!
+    while (libtask_atomic_load_acquire(&waiter.futex) == 0) {
+      libtask_futex_wait(&waiter.futex, 0, NULL);
+    }
+  }
+  // Mutex is handed over by the unlock.
+  assert(mutex->state != 0);
+}
+
+void
+libtask_mutex_unlock(libtask_mutex_t *mutex)
+{
+  assert(mutex->state != 0);
+  if (libtask_atomic_cmpxchg_release(&mutex->state, 1, 0) == 1) {
+    return;
+  }
+
+  libtask_spinlock_lock(&mutex->spinlock);
+  libtask_list_t *link = libtask_list_pop_front(&mutex->waiting_list);
+  if (!link) {
+    libtask_atomic_store_release(&mutex->state, 0);
+    libtask_spinlock_unlock(&mutex->spinlock);
+    return;
+  }
+  // Mutex stays locked for the waiter, contended only if more waiters
+  // are left.
+  if (libtask_list_empty(&mutex->waiting_list)) {
+    libtask_atomic_store_relaxed(&mutex->state, 1);
+  }
+  libtask_mutex_waiter_t *waiter =
+    libtask_list_entry(link, libtask_mutex_waiter_t, link);
+  libtask_task_t *task = waiter->task;
+  if (!task) {
+    // Waiter may return and release its stack as soon as the word is
+    // set, which makes the wake up spurious at worst.
+    libtask_atomic_store_release(&waiter->futex, 1);
+    libtask_futex_wake((uint32_t *)&waiter->futex, 1);
+  }
+  libtask_spinlock_unlock(&mutex->spinlock);
+
+  if (task) {
+    libtask__task_pool_wakeup(task->owner, task);
+  }
+}
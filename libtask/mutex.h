@@ -0,0 +1,83 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _LIBTASK_MUTEX_H_
+#define _LIBTASK_MUTEX_H_
+
+#include "libtask/list.h"
+#include "libtask/spinlock.h"
+
+// A sleeping mutex that can be held across context switches. Lockers
+// spin briefly and then wait in a queue, where tasks are suspended
+// and normal threads sleep on a futex word of their own, so waiters
+// don't burn the processor while a slow holder keeps the mutex.
+// Unlock hands the mutex over to the first waiter directly, so a
+// waiter that is woken up already owns the mutex and newcomers cannot
+// cut in line. It can be used from task and normal thread contexts.
+
+// Number of times a locker polls the mutex before it waits.
+#define LIBTASK_MUTEX_SPINS 100
+
+typedef struct {
+  // Zero when the mutex is free, one when it is locked and two when
+  // it is locked and there may be waiters. Only the holder or the
+  // unlock path changes it from non-zero.
+  volatile uint32_t state;
+
+  // Spinlock protecting the waiting list, where the waiters are
+  // queued in FIFO order.
+  libtask_spinlock_t spinlock;
+  libtask_list_t waiting_list;
+} libtask_mutex_t;
+
+// Initialize a mutex.
+//
+// mutex: The mutex.
+void
+libtask_mutex_initialize(libtask_mutex_t *mutex);
+
+// Destroy a mutex. The mutex must be unlocked.
+//
+// mutex: The mutex.
+void
+libtask_mutex_finalize(libtask_mutex_t *mutex);
+
+// Lock a mutex and wait if necessary.
+//
+// mutex: The mutex.
+void
+libtask_mutex_lock(libtask_mutex_t *mutex);
+
+// Lock a mutex if it is free.
+//
+// mutex: The mutex.
+//
+// Returns true if the mutex is locked.
+bool
+libtask_mutex_trylock(libtask_mutex_t *mutex);
+
+// Unlock a mutex and hand it over to the first waiter, if any. The
+// mutex need not be unlocked by the same task or thread that locked
+// it.
+//
+// mutex: The mutex.
+void
+libtask_mutex_unlock(libtask_mutex_t *mutex);
+
+#endif // _LIBTASK_MUTEX_H_
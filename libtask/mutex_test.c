@@ -0,0 +1,170 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+//
+// Testcase for the mutex. Tasks and normal threads increment a
+// counter under the mutex and tasks yield while holding it, so the
+// waiters have to sleep; no increment may be lost.
+//
+
+#include <argp.h>
+#include <pthread.h>
+
+#include "libtask/libtask.h"
+#include "libtask/log.h"
+
+#define TASK_STACK_SIZE (64*1024)
+
+static int32_t num_threads = 4;
+static int32_t num_tasks = 20;
+static int32_t num_pthreads = 4;
+static int32_t num_iterations = 1000;
+
+static struct argp_option options[] = {
+  {"num-threads",    0, "PINT32", 0, "No. of threads in the task-pool."},
+  {"num-tasks",      1, "PINT32", 0, "No. of tasks locking the mutex."},
+  {"num-pthreads",   2, "PINT32", 0, "No. of threads locking the mutex."},
+  {"num-iterations", 3, "PINT32", 0, "No. of locks per task or thread."},
+  {0}
+};
+
+static libtask_mutex_t mutex;
+static int32_t counter = 0;
+static bool locked = false;
+
+// Increment the counter in a critical section.
+static void
+increment(bool yield)
+{
+  libtask_mutex_lock(&mutex);
+  CHECK(locked == false);
+  locked = true;
+  int32_t value = counter;
+  if (yield) {
+    libtask_yield();
+  }
+  counter = value + 1;
+  locked = false;
+  libtask_mutex_unlock(&mutex);
+}
+
+int
+locker(void *arg_)
+{
+  for (int i = 0; i < num_iterations; i++) {
+    increment(random() % 4 == 0);
+  }
+  return 0;
+}
+
+void *
+tmain(void *arg_)
+{
+  for (int i = 0; i < num_iterations; i++) {
+    increment(false);
+  }
+  return NULL;
+}
+
+static error_t
+parse_options(int key, char *arg, struct argp_state *state)
+{
+  switch(key) {
+  case 0: // num-threads
+    if (!str2pint32(arg, 10, &num_threads)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 1: // num-tasks
+    if (!str2pint32(arg, 10, &num_tasks)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 2: // num-pthreads
+    if (!str2pint32(arg, 10, &num_pthreads)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 3: // num-iterations
+    if (!str2pint32(arg, 10, &num_iterations)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  default:
+    return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct argp_child children[2];
+  children[0] = libtask_argp_child;
+  children[1] = (struct argp_child){0};
+
+  struct argp argp = { options, parse_options, 0, 0, children };
+  argp_parse(&argp, argc, argv, 0, 0, 0);
+
+  libtask_mutex_initialize(&mutex);
+  CHECK(libtask_mutex_trylock(&mutex) == true);
+  CHECK(libtask_mutex_trylock(&mutex) == false);
+  libtask_mutex_unlock(&mutex);
+
+  libtask_task_pool_t pool;
+  CHECK(libtask_task_pool_initialize(&pool) == 0);
+  pthread_t threads[num_threads];
+  for (int i = 0; i < num_threads; i++) {
+    CHECK(libtask_task_pool_start(&pool, &threads[i]) == 0);
+  }
+
+  libtask_task_t tasks[num_tasks];
+  for (int i = 0; i < num_tasks; i++) {
+    CHECK(libtask_task_initialize(&tasks[i], &pool, locker, NULL,
+				  TASK_STACK_SIZE) == 0);
+  }
+  pthread_t pthreads[num_pthreads];
+  for (int i = 0; i < num_pthreads; i++) {
+    CHECK(pthread_create(&pthreads[i], NULL, tmain, NULL) == 0);
+  }
+
+  for (int i = 0; i < num_tasks; i++) {
+    CHECK(libtask_task_wait(&tasks[i]) == 0);
+  }
+  for (int i = 0; i < num_pthreads; i++) {
+    CHECK(pthread_join(pthreads[i], NULL) == 0);
+  }
+  CHECK(counter == (num_tasks + num_pthreads) * num_iterations);
+
+  for (int i = 0; i < num_threads; i++) {
+    CHECK(libtask_task_pool_stop(&pool, threads[i]) == 0);
+    CHECK(pthread_join(threads[i], NULL) == 0);
+  }
+  for (int i = 0; i < num_tasks; i++) {
+    CHECK(libtask_task_unref(&tasks[i]) == 0);
+  }
+  CHECK(libtask_task_pool_finalize(&pool) == 0);
+  libtask_mutex_finalize(&mutex);
+  return 0;
+}
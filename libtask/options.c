@@ -23,9 +23,33 @@
 #include "libtask/string_util.h"
 
 bool libtask_option_debug = false;
+int32_t libtask_option_stack_cache_low_watermark = 16;
+int32_t libtask_option_stack_cache_high_watermark = 64;
+bool libtask_option_stack_mmap = false;
+bool libtask_option_io_uring = true;
+int32_t libtask_option_max_spin_usecs = 100;
+bool libtask_option_handoff = false;
+bool libtask_option_stack_watermark = false;
+int32_t libtask_option_stack_reclaim_msecs = 0;
 
 static struct argp_option options[] = {
   {"libtask-debug", 0, "BOOL", 0, "Print debug messages."},
+  {"libtask-stack-cache-low-watermark", 1, "UINT32", 0,
+   "No. of free stacks per size kept after trimming a stack cache."},
+  {"libtask-stack-cache-high-watermark", 2, "UINT32", 0,
+   "No. of free stacks per size that triggers a stack cache trim."},
+  {"libtask-stack-mmap", 3, "BOOL", 0,
+   "Allocate task stacks with mmap and guard pages."},
+  {"libtask-io-uring", 4, "BOOL", 0,
+   "Use io_uring for asynchronous io when available."},
+  {"libtask-max-spin-usecs", 5, "UINT32", 0,
+   "Max. time idle threads spin for tasks before sleeping."},
+  {"libtask-handoff", 6, "BOOL", 0,
+   "Switch to the tasks woken up by semaphore ups directly."},
+  {"libtask-stack-watermark", 7, "BOOL", 0,
+   "Measure stack usage of tasks and size new stacks by it."},
+  {"libtask-stack-reclaim-msecs", 8, "UINT32", 0,
+   "Time after which unused stack of a suspended task is released."},
   {0}
 };
 
@@ -39,6 +63,54 @@ libtask_options_parse(int key, char *arg, struct argp_state *state)
     }
     break;
 
+  case 1: // libtask-stack-cache-low-watermark
+    if (!str2uint32(arg, 10, &libtask_option_stack_cache_low_watermark)) {
+      argp_error(state, "invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 2: // libtask-stack-cache-high-watermark
+    if (!str2uint32(arg, 10, &libtask_option_stack_cache_high_watermark)) {
+      argp_error(state, "invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 3: // libtask-stack-mmap
+    if (!str2bool(arg, &libtask_option_stack_mmap)) {
+      argp_error(state, "invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 4: // libtask-io-uring
+    if (!str2bool(arg, &libtask_option_io_uring)) {
+      argp_error(state, "invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 5: // libtask-max-spin-usecs
+    if (!str2uint32(arg, 10, &libtask_option_max_spin_usecs)) {
+      argp_error(state, "invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 6: // libtask-handoff
+    if (!str2bool(arg, &libtask_option_handoff)) {
+      argp_error(state, "invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 7: // libtask-stack-watermark
+    if (!str2bool(arg, &libtask_option_stack_watermark)) {
+      argp_error(state, "invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 8: // libtask-stack-reclaim-msecs
+    if (!str2uint32(arg, 10, &libtask_option_stack_reclaim_msecs)) {
+      argp_error(state, "invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
   default:
     return ARGP_ERR_UNKNOWN;
   }
@@ -25,4 +25,42 @@
 // Flag that enables printing libtask debug messages to stdout.
 extern bool libtask_option_debug; // default: false
 
+// Number of free stacks of each size that a task-pool keeps for new
+// tasks. A size with more than the high watermark free stacks is
+// trimmed down to the low watermark.
+extern int32_t libtask_option_stack_cache_low_watermark; // default: 16
+extern int32_t libtask_option_stack_cache_high_watermark; // default: 64
+
+// Flag that allocates task stacks with mmap, with a guard page and
+// lazily committed memory (see stack.h). It must not be changed after
+// the first task is created.
+extern bool libtask_option_stack_mmap; // default: false
+
+// Flag that paints the stacks of new tasks to measure their peak
+// stack usage and sizes the stacks of new tasks by the peaks of
+// earlier tasks of the same function (see stack.h). It must not be
+// changed after the first task is created.
+extern bool libtask_option_stack_watermark; // default: false
+
+// Time in milliseconds after which the unused part of the stack of a
+// suspended task is given back to the system (see task_pool.h). Zero
+// disables it and so does allocating stacks with malloc, because only
+// mmap'ed stacks are reclaimed. It is read when a task-pool is
+// initialized.
+extern int32_t libtask_option_stack_reclaim_msecs; // default: 0
+
+// Flag that lets the asynchronous io functions use io_uring when it
+// is available (see io.h). When it is false, they use only epoll.
+extern bool libtask_option_io_uring; // default: true
+
+// Maximum time an idle thread spins looking for tasks before it
+// sleeps. Actual spin time adapts to how often spinning finds tasks.
+// Zero disables spinning, which is also the case on uniprocessors.
+extern int32_t libtask_option_max_spin_usecs; // default: 100
+
+// Flag that makes libtask_semaphore_up switch the thread directly to
+// the task it wakes up, when the caller is a task of the same
+// task-pool, instead of queueing the task behind the others.
+extern bool libtask_option_handoff; // default: false
+
 #endif // _LIBTASK_OPTIONS_H_
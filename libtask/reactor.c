@@ -0,0 +1,205 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "libtask/reactor.h"
+#include "libtask/task_pool.h"
+#include "libtask/log.h"
+
+#ifdef LIBTASK_IO_URING
+#include "libtask/uring.h"
+#endif
+
+// A task waiting for an event. It lives on the task's stack while the
+// task is suspended.
+typedef struct {
+  libtask_task_t *task;
+} libtask_fd_waiter_t;
+
+void
+libtask__reactor_initialize(libtask_reactor_t *reactor)
+{
+  reactor->epfd = -1;
+  reactor->eventfd = -1;
+  reactor->nwaiters = 0;
+  reactor->polling = false;
+  reactor->blocked = false;
+}
+
+void
+libtask__reactor_finalize(libtask_reactor_t *reactor)
+{
+  assert(reactor->nwaiters == 0);
+  assert(reactor->polling == false);
+
+  if (reactor->epfd >= 0) {
+    close(reactor->eventfd);
+    close(reactor->epfd);
+  }
+}
+
+// Create the epoll instance. Task-pool spinlock must be held.
+static error_t
+libtask__reactor_create(libtask_reactor_t *reactor)
+{
+  if (reactor->epfd >= 0) {
+    return 0;
+  }
+
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0) {
+    return errno;
+  }
+
+  int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (efd < 0) {
+    error_t error = errno;
+    close(epfd);
+    return error;
+  }
+
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, efd, &event) != 0) {
+    error_t error = errno;
+    close(efd);
+    close(epfd);
+    return error;
+  }
+
+  reactor->eventfd = efd;
+  libtask_atomic_store(&reactor->epfd, epfd);
+  return 0;
+}
+
+error_t
+libtask__reactor_open(libtask_task_pool_t *task_pool)
+{
+  libtask_reactor_t *reactor = &task_pool->reactor;
+  if (libtask_atomic_load(&reactor->epfd) >= 0) {
+    return 0;
+  }
+  libtask_spinlock_lock(&task_pool->spinlock);
+  error_t error = libtask__reactor_create(reactor);
+  libtask_spinlock_unlock(&task_pool->spinlock);
+  return error;
+}
+
+void
+libtask__reactor_kick(libtask_task_pool_t *task_pool)
+{
+  // Pairs with the idle check in libtask__task_pool_main.
+  libtask_atomic_fence();
+  if (libtask_atomic_load(&task_pool->nidle) > 0) {
+    libtask_spinlock_lock(&task_pool->spinlock);
+    if (!task_pool->reactor.polling && task_pool->nidle > 0) {
+      libtask_condition_signal(&task_pool->waiting_condition);
+    }
+    libtask_spinlock_unlock(&task_pool->spinlock);
+  }
+}
+
+void
+libtask__reactor_interrupt(libtask_reactor_t *reactor)
+{
+  uint64_t one = 1;
+  CHECK(write(reactor->eventfd, &one, sizeof(one)) == sizeof(one));
+}
+
+int
+libtask__reactor_poll(libtask_reactor_t *reactor, int timeout,
+		      libtask_task_t **tasks)
+{
+  struct epoll_event events[LIBTASK_REACTOR_BATCH];
+  int nevents = epoll_wait(reactor->epfd, events, LIBTASK_REACTOR_BATCH,
+			   timeout);
+  if (nevents < 0) {
+    CHECK(errno == EINTR);
+    return 0;
+  }
+
+  int ntasks = 0;
+  for (int i = 0; i < nevents; i++) {
+    uintptr_t data = (uintptr_t)events[i].data.ptr;
+#ifdef LIBTASK_IO_URING
+    if (data & LIBTASK_REACTOR_URING) {
+      libtask_uring_t *uring = (libtask_uring_t *)(data & ~LIBTASK_REACTOR_URING);
+      // Leave room for the tasks of the remaining events.
+      int max = LIBTASK_REACTOR_BATCH - ntasks - (nevents - i - 1);
+      ntasks += libtask__uring_reap(uring, tasks + ntasks, max);
+      continue;
+    }
+#endif
+    libtask_fd_waiter_t *waiter = (libtask_fd_waiter_t *)data;
+    if (!waiter) {
+      uint64_t count;
+      if (read(reactor->eventfd, &count, sizeof(count)) < 0) {
+	CHECK(errno == EAGAIN);
+      }
+      continue;
+    }
+    tasks[ntasks++] = waiter->task;
+  }
+  libtask_atomic_sub(&reactor->nwaiters, ntasks);
+  return ntasks;
+}
+
+error_t
+libtask_fd_wait(int fd, uint32_t events)
+{
+  libtask_task_t *task = libtask_get_task_current();
+  if (!task) {
+    return EINVAL;
+  }
+
+  libtask_task_pool_t *task_pool = task->owner;
+  libtask_reactor_t *reactor = &task_pool->reactor;
+  error_t error = libtask__reactor_open(task_pool);
+  if (error) {
+    return error;
+  }
+
+  // The registration is one-shot, so it is disarmed after an event
+  // and the stale waiter address is never reported again.
+  libtask_fd_waiter_t waiter;
+  waiter.task = task;
+
+  struct epoll_event event;
+  event.events = events | EPOLLONESHOT;
+  event.data.ptr = &waiter;
+
+  libtask_atomic_add(&reactor->nwaiters, 1);
+  if (epoll_ctl(reactor->epfd, EPOLL_CTL_MOD, fd, &event) != 0) {
+    if (errno != ENOENT ||
+	epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, fd, &event) != 0) {
+      error_t error = errno;
+      libtask_atomic_sub(&reactor->nwaiters, 1);
+      return error;
+    }
+  }
+
+  // The event may have already woken up the task, but that is fine
+  // because task cannot be resumed before it is suspended.
+  libtask__reactor_kick(task_pool);
+  libtask__task_suspend();
+  return 0;
+}
@@ -0,0 +1,121 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _LIBTASK_REACTOR_H_
+#define _LIBTASK_REACTOR_H_
+
+#include <sys/epoll.h>
+
+#include "libtask/base.h"
+
+// Reactor
+//
+// Every task-pool has a reactor, an epoll instance, where tasks can
+// wait for file descriptor events.  A task waiting for an event is
+// suspended and is made runnable in its task-pool when the event
+// arrives.  There is no dedicated thread for the reactor: a worker
+// thread that runs out of tasks polls the reactor instead of sleeping,
+// and busy worker threads poll it without blocking every now and
+// then.  Only one thread polls a reactor at a time.
+//
+// The epoll instance is created when a task waits for an event in the
+// task-pool for the first time.
+
+// Maximum number of events processed in one poll.
+#define LIBTASK_REACTOR_BATCH 64
+
+// Tag for the epoll data of io_uring file descriptors (see uring.h)
+// registered in a reactor. Other registrations point to the waiters,
+// which are word aligned.
+#define LIBTASK_REACTOR_URING ((uintptr_t)1)
+
+struct libtask_task;
+struct libtask_task_pool;
+
+typedef struct {
+  // The epoll descriptor or -1.
+  int epfd;
+
+  // An eventfd registered in the epoll instance to interrupt the
+  // thread blocked in epoll_wait.
+  int eventfd;
+
+  // Number of tasks waiting for events, including the tasks waiting
+  // for io_uring completions.
+  int32_t nwaiters;
+
+  // These flags are protected by the task-pool spinlock. The polling
+  // flag is set while a thread is polling the reactor and the blocked
+  // flag is set when that thread is an idle thread blocked in
+  // epoll_wait.
+  bool polling;
+  bool blocked;
+} libtask_reactor_t;
+
+// Wait for events on a file descriptor. Current task is suspended
+// until one of the events (or an error or hang up) is reported on
+// the file descriptor.  Only one task may wait on a file descriptor at
+// a time.  This function should be called only from task context.
+//
+// fd: The file descriptor.
+//
+// events: Events to wait for, e.g. EPOLLIN and EPOLLOUT.
+//
+// Returns zero on success, EINVAL outside of task context or an error
+// number from epoll (e.g. EPERM for regular files).
+error_t
+libtask_fd_wait(int fd, uint32_t events);
+
+//
+// Private interfaces
+//
+
+void
+libtask__reactor_initialize(libtask_reactor_t *reactor);
+
+void
+libtask__reactor_finalize(libtask_reactor_t *reactor);
+
+// Create the epoll instance of a task-pool's reactor if necessary.
+// Returns zero on success or an error number.
+error_t
+libtask__reactor_open(struct libtask_task_pool *task_pool);
+
+// Make sure an idle thread of the task-pool polls the reactor after
+// the number of waiters is incremented.
+void
+libtask__reactor_kick(struct libtask_task_pool *task_pool);
+
+// Wait for events in the reactor and collect the tasks that have
+// become runnable. Caller must own the polling flag.
+//
+// timeout: Timeout for epoll_wait in milliseconds.
+//
+// tasks: Output array of at least LIBTASK_REACTOR_BATCH entries.
+//
+// Returns the number of tasks collected.
+int
+libtask__reactor_poll(libtask_reactor_t *reactor, int timeout,
+		      struct libtask_task **tasks);
+
+// Wake up the thread blocked in epoll_wait.
+void
+libtask__reactor_interrupt(libtask_reactor_t *reactor);
+
+#endif // _LIBTASK_REACTOR_H_
@@ -0,0 +1,181 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+//
+// Testcase for stack reclaims. Tasks go deep into their stacks once
+// and then wait on a semaphore for longer than the reclaim age, so
+// the pages below their stack pointers must be given back to the
+// system without losing the live frames above them. Only mmap'ed
+// stacks that are not painted may be reclaimed.
+//
+
+#include <argp.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "libtask/libtask.h"
+#include "libtask/log.h"
+
+#define TASK_STACK_SIZE (256*1024)
+
+static int32_t num_threads = 2;
+static int32_t num_tasks = 8;
+
+static struct argp_option options[] = {
+  {"num-threads", 0, "PINT32", 0, "No. of threads in the task-pool."},
+  {"num-tasks", 1, "PINT32", 0, "No. of tasks."},
+  {0}
+};
+
+static libtask_task_pool_t task_pool;
+static libtask_semaphore_t semaphore;
+
+// Touch a deep frame, so that its pages are resident after return.
+static __attribute__((noinline)) int
+touch(int32_t nbytes)
+{
+  volatile char frame[nbytes];
+  for (int32_t i = 0; i < nbytes; i++) {
+    frame[i] = (char)i;
+  }
+  return frame[nbytes - 1];
+}
+
+int
+park(void *arg_)
+{
+  volatile char live[1024];
+  for (int i = 0; i < (int)sizeof(live); i++) {
+    live[i] = (char)(i ^ (intptr_t)arg_);
+  }
+  touch(64 * 1024);
+  libtask_semaphore_down(&semaphore);
+  for (int i = 0; i < (int)sizeof(live); i++) {
+    CHECK(live[i] == (char)(i ^ (intptr_t)arg_));
+  }
+  return touch(64 * 1024) == (char)(64 * 1024 - 1) ? 0 : 1;
+}
+
+static error_t
+parse_options(int key, char *arg, struct argp_state *state)
+{
+  switch(key) {
+  case 0: // num-threads
+    if (!str2pint32(arg, 10, &num_threads)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 1: // num-tasks
+    if (!str2pint32(arg, 10, &num_tasks)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  default:
+    return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct argp_child children[2];
+  children[0] = libtask_argp_child;
+  children[1] = (struct argp_child){0};
+
+  libtask_option_stack_reclaim_msecs = 10;
+  libtask_option_stack_mmap = true;
+  struct argp argp = { options, parse_options, 0, 0, children };
+  argp_parse(&argp, argc, argv, 0, 0, 0);
+  CHECK(libtask_option_stack_reclaim_msecs > 0);
+
+  // Reclaim timer needs the reactor, so initialization fails without
+  // file descriptors and must unwind the task-pool cleanly.
+  if (libtask_option_stack_mmap) {
+    struct rlimit limit;
+    CHECK(getrlimit(RLIMIT_NOFILE, &limit) == 0);
+    struct rlimit no_files = { 0, limit.rlim_max };
+    CHECK(setrlimit(RLIMIT_NOFILE, &no_files) == 0);
+    libtask_task_pool_t failed_pool;
+    CHECK(libtask_task_pool_initialize(&failed_pool) == EMFILE);
+    CHECK(setrlimit(RLIMIT_NOFILE, &limit) == 0);
+  }
+
+  libtask_semaphore_initialize(&semaphore, 0);
+  CHECK(libtask_task_pool_initialize(&task_pool) == 0);
+  pthread_t threads[num_threads];
+  for (int i = 0; i < num_threads; i++) {
+    CHECK(libtask_task_pool_start(&task_pool, &threads[i]) == 0);
+  }
+
+  libtask_task_t *tasks[num_tasks];
+  for (int i = 0; i < num_tasks; i++) {
+    CHECK(libtask_task_create(&tasks[i], &task_pool, park,
+			      (void *)(intptr_t)i, TASK_STACK_SIZE) == 0);
+  }
+
+  // Unless stacks are mmap'ed, these are inside the allocation.
+  libtask_task_t *many[num_tasks];
+  CHECK(libtask_task_create_many(many, num_tasks, &task_pool, park, NULL,
+				 TASK_STACK_SIZE) == 0);
+
+  // Wait until the stacks of all tasks are reclaimed.
+  uint64_t nreclaims = 0;
+  if (libtask_option_stack_mmap && !libtask_option_stack_watermark) {
+    nreclaims = 2 * num_tasks;
+  }
+  libtask_task_pool_stats_t stats;
+  int64_t deadline = libtask_clock_usecs() + 10 * 1000000;
+  do {
+    usleep(10 * 1000);
+    libtask_task_pool_get_stats(&task_pool, &stats);
+  } while (stats.nreclaims < nreclaims && libtask_clock_usecs() < deadline);
+  DEBUG("reclaims %lu bytes %lu\n", (unsigned long)stats.nreclaims,
+	(unsigned long)stats.nreclaimed_bytes);
+  CHECK(stats.nreclaims >= nreclaims);
+  CHECK(stats.nreclaimed_bytes >= nreclaims * 48 * 1024);
+
+  // Reclaimed stacks are not reclaimed again until tasks run.
+  usleep(200 * 1000);
+  libtask_task_pool_get_stats(&task_pool, &stats);
+  CHECK(stats.nreclaims == nreclaims);
+
+  for (int i = 0; i < 2 * num_tasks; i++) {
+    libtask_semaphore_up(&semaphore);
+  }
+  for (int i = 0; i < num_tasks; i++) {
+    CHECK(libtask_task_wait(tasks[i]) == 0);
+    CHECK(tasks[i]->result == 0);
+    libtask_task_unref(tasks[i]);
+    CHECK(libtask_task_wait(many[i]) == 0);
+    CHECK(many[i]->result == 0);
+    libtask_task_unref(many[i]);
+  }
+
+  for (int i = 0; i < num_threads; i++) {
+    CHECK(libtask_task_pool_stop(&task_pool, threads[i]) == 0);
+    CHECK(pthread_join(threads[i], NULL) == 0);
+  }
+  CHECK(libtask_task_pool_finalize(&task_pool) == 0);
+  libtask_semaphore_finalize(&semaphore);
+  return 0;
+}
@@ -73,4 +73,22 @@ typedef struct {
     }							\
   } while (0)
 
+// Decrement an object's reference count unless it is the last
+// reference. Returns true if the reference is dropped and false if the
+// caller holds the last reference.
+#define libtask_refcount_dec_unless_last(x)				\
+  ({									\
+    bool dropped = false;						\
+    int32_t count = libtask_atomic_load(&(x)->count);			\
+    while (count / 2 > 1) {						\
+      int32_t old = libtask_atomic_cmpxchg(&(x)->count, count, count - 2); \
+      if (old == count) {						\
+	dropped = true;							\
+	break;								\
+      }									\
+      count = old;							\
+    }									\
+    dropped;								\
+  })
+
 #endif // _LIBTASK_REFCOUNT_H_
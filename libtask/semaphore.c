@@ -18,31 +18,39 @@
 //
 
 #include "libtask/semaphore.h"
+#include "libtask/options.h"
 
 void
 libtask_semaphore_initialize(libtask_semaphore_t *sem, int32_t count)
 {
-  libtask_spinlock_initialize(&sem->spinlock);
   sem->count = count;
+  libtask_spinlock_initialize(&sem->spinlock);
   libtask_list_initialize(&sem->waiting_list);
+  sem->nwakeups = 0;
 }
 
 void
 libtask_semaphore_finalize(libtask_semaphore_t *sem)
 {
   assert(libtask_list_empty(&sem->waiting_list));
+  assert(sem->nwakeups == 0);
+  assert(sem->count >= 0);
   libtask_spinlock_finalize(&sem->spinlock);
 }
 
 void
 libtask_semaphore_up(libtask_semaphore_t *sem)
 {
-  libtask_task_t *task = NULL;
+  if (libtask_atomic_add(&sem->count, 1) > 0) {
+    return;
+  }
 
+  // Count was negative, so some task has taken its decrement and is
+  // owed a wakeup.
+  libtask_task_t *task = NULL;
   libtask_spinlock_lock(&sem->spinlock);
-  if (libtask_list_empty(&sem->waiting_list)) {
-    sem->count++;
-  } else {
+  if (sem->nwakeups++ >= 0 && !libtask_list_empty(&sem->waiting_list)) {
+    sem->nwakeups--;
     libtask_list_t *link = libtask_list_pop_front(&sem->waiting_list);
     task = libtask_list_entry(link, libtask_task_t, waiting_link);
   }
@@ -50,11 +58,48 @@ libtask_semaphore_up(libtask_semaphore_t *sem)
   if (!task) {
     return;
   }
-  libtask_task_pool_t *task_pool = task->owner;
-  libtask_spinlock_lock(&task_pool->spinlock);
-  libtask_list_push_back(&task_pool->waiting_list, &task->waiting_link);
-  libtask_condition_signal(&task_pool->waiting_condition);
-  libtask_spinlock_unlock(&task_pool->spinlock);
+  if (libtask_option_handoff) {
+    libtask__task_pool_handoff(task);
+  } else {
+    libtask__task_pool_wakeup(task->owner, task);
+  }
+}
+
+// Take a wakeup left by an up for a task that wasn't in the waiting
+// list yet. Spinlock must be held.
+//
+// Returns true if a wakeup is taken.
+static bool
+libtask__semaphore_take_wakeup(libtask_semaphore_t *sem)
+{
+  assert(libtask_spinlock_status(&sem->spinlock) == false);
+  if (sem->nwakeups > 0) {
+    sem->nwakeups--;
+    return true;
+  }
+  return false;
+}
+
+// Give up the decrement of a task that is no longer in the waiting
+// list. When the count is not negative, an up has already counted
+// this task and its wakeup is taken instead. Spinlock must be held.
+//
+// Returns true if the task has taken a wakeup, which means it owns
+// the decrement.
+static bool
+libtask__semaphore_cancel(libtask_semaphore_t *sem)
+{
+  assert(libtask_spinlock_status(&sem->spinlock) == false);
+  int64_t count = libtask_atomic_load(&sem->count);
+  while (count < 0) {
+    int64_t old = libtask_atomic_cmpxchg(&sem->count, count, count + 1);
+    if (old == count) {
+      return false;
+    }
+    count = old;
+  }
+  sem->nwakeups--;
+  return true;
 }
 
 void
@@ -63,13 +108,71 @@ libtask_semaphore_down(libtask_semaphore_t *sem)
   libtask_task_t *task = libtask_get_task_current();
   assert(task);
 
+  if (libtask_atomic_sub(&sem->count, 1) >= 0) {
+    return;
+  }
+
+  libtask_spinlock_lock(&sem->spinlock);
+  if (libtask__semaphore_take_wakeup(sem)) {
+    libtask_spinlock_unlock(&sem->spinlock);
+    return;
+  }
+  libtask_list_push_back(&sem->waiting_list, &task->waiting_link);
+  libtask_spinlock_unlock(&sem->spinlock);
+  libtask__task_suspend_unpinned();
+}
+
+error_t
+libtask_semaphore_down_timed(libtask_semaphore_t *sem, int64_t deadline_usecs)
+{
+  libtask_task_t *task = libtask_get_task_current();
+  assert(task);
+
+  // Expired deadlines must not take a decrement that cannot be
+  // satisfied immediately.
+  int64_t count = libtask_atomic_load(&sem->count);
+  while (count > 0) {
+    int64_t old = libtask_atomic_cmpxchg(&sem->count, count, count - 1);
+    if (old == count) {
+      return 0;
+    }
+    count = old;
+  }
+  if (deadline_usecs <= libtask_clock_usecs()) {
+    return ETIMEDOUT;
+  }
+  if (libtask_atomic_sub(&sem->count, 1) >= 0) {
+    return 0;
+  }
+
   libtask_spinlock_lock(&sem->spinlock);
-  if (sem->count > 0) {
-    sem->count--;
+  if (libtask__semaphore_take_wakeup(sem)) {
     libtask_spinlock_unlock(&sem->spinlock);
-  } else {
-    libtask_list_push_back(&sem->waiting_list, &task->waiting_link);
+    return 0;
+  }
+
+  libtask_timed_wait_t wait;
+  libtask_list_push_back(&sem->waiting_list, &task->waiting_link);
+  error_t error = libtask__timed_wait_start(&wait, task, &sem->spinlock,
+					    deadline_usecs);
+  if (error) {
+    libtask_list_erase(&task->waiting_link);
+    if (libtask__semaphore_cancel(sem)) {
+      error = 0;
+    }
+    libtask_spinlock_unlock(&sem->spinlock);
+    return error;
+  }
+  libtask_spinlock_unlock(&sem->spinlock);
+  libtask__task_suspend();
+
+  error = libtask__timed_wait_finish(&wait);
+  if (error == ETIMEDOUT) {
+    libtask_spinlock_lock(&sem->spinlock);
+    if (libtask__semaphore_cancel(sem)) {
+      error = 0;
+    }
     libtask_spinlock_unlock(&sem->spinlock);
-    libtask__task_suspend();
   }
+  return error;
 }
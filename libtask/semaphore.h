@@ -28,10 +28,21 @@
 #include "libtask/log.h"
 #include "libtask/spinlock.h"
 
+// Semaphore count is updated with atomic operations and the spinlock
+// is taken only when a task has to wait or has to be woken up.
 typedef struct {
+  // Semaphore value minus the number of waiters. Negative values mean
+  // there are tasks waiting, or about to wait, for an up.
+  volatile int64_t count;
+
+  // Spinlock protects the waiting list and the number of wakeups
+  // handed out by ups that found no task in the waiting list, because
+  // the waiter is yet to link itself. Wakeups are negative when timed
+  // out waiters took the wakeups of ups that are yet to take the
+  // spinlock.
   libtask_spinlock_t spinlock;
-  int64_t count;
   libtask_list_t waiting_list;
+  int64_t nwakeups;
 } libtask_semaphore_t;
 
 // Initialize a semaphore.
@@ -61,4 +72,17 @@ libtask_semaphore_up(libtask_semaphore_t *sem);
 void
 libtask_semaphore_down(libtask_semaphore_t *sem);
 
+// Down a semaphore and wait until a deadline if necessary. This
+// function should be called only from task context.
+//
+// sem: The semaphore.
+//
+// deadline_usecs: Absolute deadline in libtask_clock_usecs time.
+//
+// Returns zero on success, ETIMEDOUT if deadline has passed or an
+// error number if the deadline cannot be set.
+error_t
+libtask_semaphore_down_timed(libtask_semaphore_t *sem,
+			     int64_t deadline_usecs);
+
 #endif // _LIBTASK_SEMAPHORE_H_
@@ -0,0 +1,227 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+//
+// Testcase for tasks on shared stacks. Tasks keep data at different
+// depths of their stacks and check it after they block on a semaphore,
+// yield, sleep or hop between task-pools, so that other tasks use the
+// shared stacks meanwhile. Tasks that share a stack with a sleeping,
+// and thus pinned, task must wait for it without burning the CPU.
+//
+
+#include <argp.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libtask/libtask.h"
+#include "libtask/log.h"
+
+static int32_t num_threads = 2;
+static int32_t num_tasks = 1000;
+static int32_t num_rounds = 20;
+
+static struct argp_option options[] = {
+  {"num-threads", 0, "PINT32", 0, "No. of threads in each task-pool."},
+  {"num-tasks",   1, "PINT32", 0, "No. of tasks."},
+  {"num-rounds",  2, "PINT32", 0, "No. of blocking calls by each task."},
+  {0}
+};
+
+static libtask_task_pool_t pools[2];
+static libtask_semaphore_t semaphore;
+static int32_t nfinished = 0;
+
+// Block the current task in one of the ways that let other tasks run.
+static void
+block(int32_t id, int32_t round)
+{
+  switch ((id + round) % 4) {
+  case 0:
+    libtask_semaphore_down(&semaphore);
+    libtask_yield();
+    libtask_semaphore_up(&semaphore);
+    break;
+
+  case 1:
+    CHECK(libtask_yield() == 0);
+    break;
+
+  case 2:
+    CHECK(libtask_task_pool_schedule(&pools[random() % 2]) == 0);
+    break;
+
+  case 3:
+    CHECK(libtask_sleep_usecs(100) == 0);
+    break;
+  }
+}
+
+// Fill a frame with a pattern, block at the bottom of the recursion
+// and check the pattern on the way back.
+static void
+recurse(int32_t id, int32_t round, int32_t depth)
+{
+  volatile int32_t frame[64 + (id % 7) * 16];
+  int32_t n = sizeof(frame) / sizeof(frame[0]);
+  for (int32_t i = 0; i < n; i++) {
+    frame[i] = id ^ (round << 20) ^ (depth << 12) ^ i;
+  }
+  if (depth > 0) {
+    recurse(id, round, depth - 1);
+  } else {
+    block(id, round);
+  }
+  for (int32_t i = 0; i < n; i++) {
+    CHECK(frame[i] == (id ^ (round << 20) ^ (depth << 12) ^ i));
+  }
+}
+
+int
+work(void *arg_)
+{
+  int32_t id = (int32_t)(intptr_t)arg_;
+  for (int32_t round = 0; round < num_rounds; round++) {
+    recurse(id, round, (id + round) % 5);
+  }
+  libtask_atomic_add(&nfinished, 1);
+  return id;
+}
+
+// Sleeps on a shared stack, which keeps the stack pinned.
+static int32_t sleeping = 0;
+
+int
+sleeper(void *arg_)
+{
+  libtask_atomic_store(&sleeping, 1);
+  CHECK(libtask_sleep_usecs(300 * 1000) == 0);
+  return 0;
+}
+
+int
+nop(void *arg_)
+{
+  return 0;
+}
+
+static error_t
+parse_options(int key, char *arg, struct argp_state *state)
+{
+  switch(key) {
+  case 0: // num-threads
+    if (!str2pint32(arg, 10, &num_threads)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 1: // num-tasks
+    if (!str2pint32(arg, 10, &num_tasks)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 2: // num-rounds
+    if (!str2pint32(arg, 10, &num_rounds)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  default:
+    return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct argp_child children[2];
+  children[0] = libtask_argp_child;
+  children[1] = (struct argp_child){0};
+
+  struct argp argp = { options, parse_options, 0, 0, children };
+  argp_parse(&argp, argc, argv, 0, 0, 0);
+
+  libtask_semaphore_initialize(&semaphore, 4);
+
+  pthread_t threads[2][num_threads];
+  for (int i = 0; i < 2; i++) {
+    CHECK(libtask_task_pool_initialize(&pools[i]) == 0);
+    for (int j = 0; j < num_threads; j++) {
+      CHECK(libtask_task_pool_start(&pools[i], &threads[i][j]) == 0);
+    }
+  }
+
+  int64_t start_usecs = libtask_now_usecs();
+  libtask_task_t **tasks = malloc(num_tasks * sizeof(libtask_task_t *));
+  CHECK(tasks);
+  for (int i = 0; i < num_tasks; i++) {
+    CHECK(libtask_task_create_shared(&tasks[i], &pools[i % 2], work,
+				     (void *)(intptr_t)i) == 0);
+  }
+  for (int i = 0; i < num_tasks; i++) {
+    CHECK(libtask_task_wait(tasks[i]) == 0);
+    CHECK(tasks[i]->result == i);
+    libtask_task_unref(tasks[i]);
+  }
+  free(tasks);
+  DEBUG("%d tasks finished in %ld usecs\n", num_tasks,
+	libtask_now_usecs() - start_usecs);
+  CHECK(nfinished == num_tasks);
+
+  // One of the tasks lands on the stack of the sleeper and is parked
+  // until the sleeper finishes.
+  libtask_task_t *sleeper_task;
+  CHECK(libtask_task_create_shared(&sleeper_task, &pools[0], sleeper,
+				   NULL) == 0);
+  while (!libtask_atomic_load(&sleeping)) {
+    usleep(1000);
+  }
+  usleep(10 * 1000);
+  struct timespec cpu_start, cpu_end;
+  CHECK(clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start) == 0);
+  libtask_task_t *nops[LIBTASK_SHARED_STACKS];
+  for (int i = 0; i < LIBTASK_SHARED_STACKS; i++) {
+    CHECK(libtask_task_create_shared(&nops[i], &pools[0], nop, NULL) == 0);
+  }
+  for (int i = 0; i < LIBTASK_SHARED_STACKS; i++) {
+    CHECK(libtask_task_wait(nops[i]) == 0);
+    CHECK(libtask_task_unref(nops[i]) == 0);
+  }
+  CHECK(clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end) == 0);
+  CHECK(libtask_task_wait(sleeper_task) == 0);
+  CHECK(libtask_task_unref(sleeper_task) == 0);
+  int64_t cpu_usecs = (cpu_end.tv_sec - cpu_start.tv_sec) * 1000000 +
+    (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1000;
+  DEBUG("parked tasks used %ld usecs of cpu\n", cpu_usecs);
+  CHECK(cpu_usecs < 100 * 1000);
+
+  for (int i = 0; i < 2; i++) {
+    for (int j = 0; j < num_threads; j++) {
+      CHECK(libtask_task_pool_stop(&pools[i], threads[i][j]) == 0);
+      CHECK(pthread_join(threads[i][j], NULL) == 0);
+    }
+  }
+  for (int i = 0; i < 2; i++) {
+    CHECK(libtask_task_pool_finalize(&pools[i]) == 0);
+  }
+  libtask_semaphore_finalize(&semaphore);
+  return 0;
+}
@@ -0,0 +1,167 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+//
+// Testcase for the adaptive spinning of idle threads. Tasks are
+// created one at a time with short pauses in between, so that threads
+// go idle just before every new task, first with spinning disabled and
+// then with it enabled. Without spinning no thread may spin. With
+// spinning, on multiprocessors, spinning threads must pick up most of
+// the tasks without waking up sleeping threads, and spin budgets must
+// shrink once the task-pool goes idle. A spinning thread that finds a
+// task wakes up a sleeping one, so one thread is used by default.
+//
+
+#include <argp.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "libtask/libtask.h"
+#include "libtask/log.h"
+
+#define TASK_STACK_SIZE (64*1024)
+
+// Spin budget of the run with spinning enabled and pause between the
+// tasks, which is well within the budget.
+#define MAX_SPIN_USECS 2000
+#define PAUSE_USECS 50
+
+static int32_t num_threads = 1;
+static int32_t num_tasks = 1000;
+
+static struct argp_option options[] = {
+  {"num-threads", 0, "PINT32", 0, "No. of threads in the task-pool."},
+  {"num-tasks",   1, "PINT32", 0, "No. of tasks."},
+  {0}
+};
+
+int
+nop(void *arg_)
+{
+  return 0;
+}
+
+// Run the tasks in a new task-pool with a spin budget and let the
+// task-pool go idle for a while. Returns the statistics of the
+// task-pool and the smallest spin budget of its threads.
+static void
+run(int32_t max_spin_usecs, libtask_task_pool_stats_t *stats,
+    int32_t *min_spin_usecs)
+{
+  libtask_option_max_spin_usecs = max_spin_usecs;
+
+  libtask_task_pool_t task_pool;
+  CHECK(libtask_task_pool_initialize(&task_pool) == 0);
+  pthread_t threads[num_threads];
+  for (int i = 0; i < num_threads; i++) {
+    CHECK(libtask_task_pool_start(&task_pool, &threads[i]) == 0);
+  }
+
+  for (int i = 0; i < num_tasks; i++) {
+    libtask_task_t task;
+    CHECK(libtask_task_initialize(&task, &task_pool, nop, NULL,
+				  TASK_STACK_SIZE) == 0);
+    CHECK(libtask_task_wait(&task) == 0);
+    CHECK(libtask_task_unref(&task) == 0);
+    usleep(PAUSE_USECS);
+  }
+
+  // Threads that go idle now spin without finding tasks.
+  usleep(100 * 1000);
+  libtask_task_pool_get_stats(&task_pool, stats);
+
+  for (int i = 0; i < num_threads; i++) {
+    CHECK(libtask_task_pool_stop(&task_pool, threads[i]) == 0);
+    CHECK(pthread_join(threads[i], NULL) == 0);
+  }
+  *min_spin_usecs = INT32_MAX;
+  for (libtask_worker_t *worker = task_pool.workers; worker;
+       worker = worker->next) {
+    if (worker->spin_usecs < *min_spin_usecs) {
+      *min_spin_usecs = worker->spin_usecs;
+    }
+  }
+  CHECK(libtask_task_pool_finalize(&task_pool) == 0);
+
+  DEBUG("max-spin %d: spins %lu found %lu spin-usecs %lu parks %lu "
+	"wakes %lu min-budget %d\n", max_spin_usecs,
+	(unsigned long)stats->nspins, (unsigned long)stats->nspins_found,
+	(unsigned long)stats->spin_usecs, (unsigned long)stats->nparks,
+	(unsigned long)stats->nwakes, *min_spin_usecs);
+}
+
+static error_t
+parse_options(int key, char *arg, struct argp_state *state)
+{
+  switch(key) {
+  case 0: // num-threads
+    if (!str2pint32(arg, 10, &num_threads)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 1: // num-tasks
+    if (!str2pint32(arg, 10, &num_tasks)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  default:
+    return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct argp_child children[2];
+  children[0] = libtask_argp_child;
+  children[1] = (struct argp_child){0};
+
+  struct argp argp = { options, parse_options, 0, 0, children };
+  argp_parse(&argp, argc, argv, 0, 0, 0);
+
+  // Threads never spin when spinning is disabled, so sleeping threads
+  // are woken up for most of the tasks.
+  libtask_task_pool_stats_t off;
+  int32_t off_budget;
+  run(0, &off, &off_budget);
+  CHECK(off.nspins == 0);
+  CHECK(off.nspins_found == 0);
+  CHECK(off.spin_usecs == 0);
+  CHECK(off.nwakes >= (uint64_t)num_tasks / 2);
+
+  // Nor do they spin on uniprocessors, so there is nothing more to
+  // check there.
+  if (sysconf(_SC_NPROCESSORS_ONLN) <= 1) {
+    return 0;
+  }
+
+  // Spinning threads pick up most of the tasks, which saves the wake
+  // ups of sleeping threads, and budgets of threads whose spins ran out
+  // are smaller than the maximum.
+  libtask_task_pool_stats_t on;
+  int32_t on_budget;
+  run(MAX_SPIN_USECS, &on, &on_budget);
+  CHECK(on.nspins_found >= (uint64_t)num_tasks / 2);
+  CHECK(on.nwakes < (uint64_t)num_tasks / 2);
+  CHECK(on_budget < MAX_SPIN_USECS);
+  return 0;
+}
@@ -20,38 +20,216 @@
 #ifndef _LIBTASK_SPINLOCK_H_
 #define _LIBTASK_SPINLOCK_H_
 
+#include <sched.h>
+
 #include "libtask/atomic.h"
 #include "libtask/log.h"
 
+//
+// Spinlocks are fair and queue their waiters in the order they
+// arrive. By default they are ticket locks, where every waiter spins
+// on the lock itself with a backoff proportional to its position in
+// the queue. With LIBTASK_SPINLOCK_MCS they are MCS locks, where every
+// waiter spins on a node of its own, which keeps the lock's cache line
+// quiet under heavy contention at the cost of an extra atomic on
+// unlock. The nodes are on the stacks of the waiters and are not used
+// after the lock is taken, so a spinlock can be unlocked by a thread
+// other than the one that locked it, as happens when a task migrates.
+//
+// With LIBTASK_SPINLOCK_STATS every lock counts its acquisitions and
+// the number of times waiters had to spin for it, which helps to find
+// hot locks.
+//
+
+// Number of pause instructions a ticket lock waiter spins for, per
+// waiter ahead of it, between polls of the lock.
+#define LIBTASK_SPINLOCK_BACKOFF 32
+
+// Number of polls after which waiters yield the processor between
+// polls, because the holder (or, for ticket locks, the next waiter in
+// line) may have been preempted.
+#define LIBTASK_SPINLOCK_YIELD 64
+
+#ifdef LIBTASK_SPINLOCK_MCS
+
+// Queue node of an MCS lock waiter. Waiters link a node on their own
+// stack only while they wait; the holder moves its successor into the
+// lock's own node before the lock returns, so no node outlives a
+// lock call.
+typedef struct libtask_spinlock_node {
+  struct libtask_spinlock_node *volatile next;
+  volatile int32_t locked;
+} libtask_spinlock_node_t;
+
+#endif // LIBTASK_SPINLOCK_MCS
+
 typedef struct {
-  volatile int32_t value;
+#ifdef LIBTASK_SPINLOCK_MCS
+  // Last waiter in the queue, the lock's own node when it is held
+  // without waiters, or NULL when it is free. The lock's own node
+  // stands for the holder and links to the first waiter.
+  libtask_spinlock_node_t *volatile tail;
+  libtask_spinlock_node_t head;
+#else
+  // Next ticket to hand out and the ticket that owns the lock.
+  volatile uint32_t next;
+  volatile uint32_t owner;
+#endif
+
+#ifdef LIBTASK_SPINLOCK_STATS
+  // Statistics, updated by the lock holder.
+  uint64_t nacquires;
+  uint64_t ncontended;
+  uint64_t nspins;
+#endif
 } libtask_spinlock_t;
 
+// Spinlock statistics. All counters are zero without
+// LIBTASK_SPINLOCK_STATS.
+typedef struct {
+  // Number of times the lock is taken, number of times it was taken
+  // after a wait and total number of polls made while waiting.
+  uint64_t nacquires;
+  uint64_t ncontended;
+  uint64_t nspins;
+} libtask_spinlock_stats_t;
+
 static inline void
 libtask_spinlock_initialize(libtask_spinlock_t *lock) {
-  libtask_atomic_store(&lock->value, 1);
+#ifdef LIBTASK_SPINLOCK_MCS
+  lock->tail = NULL;
+  lock->head.next = NULL;
+  lock->head.locked = 0;
+#else
+  lock->next = 0;
+  lock->owner = 0;
+#endif
+#ifdef LIBTASK_SPINLOCK_STATS
+  lock->nacquires = 0;
+  lock->ncontended = 0;
+  lock->nspins = 0;
+#endif
+}
+
+// Returns true if the spinlock is free.
+static inline bool
+libtask_spinlock_status(libtask_spinlock_t *lock) {
+#ifdef LIBTASK_SPINLOCK_MCS
+  return libtask_atomic_load(&lock->tail) == NULL;
+#else
+  return libtask_atomic_load(&lock->owner) == libtask_atomic_load(&lock->next);
+#endif
 }
 
 static inline void
 libtask_spinlock_finalize(libtask_spinlock_t *lock) {
-  assert(libtask_atomic_load(&lock->value) == 1);
+  assert(libtask_spinlock_status(lock) == true);
 }
 
 static inline void
 libtask_spinlock_lock(libtask_spinlock_t *lock) {
-  while (libtask_atomic_cmpxchg(&lock->value, 1, 0) != 1) {
-    continue;
+  uint64_t nspins = 0;
+#ifdef LIBTASK_SPINLOCK_MCS
+  while (true) {
+    libtask_spinlock_node_t *prev = libtask_atomic_load_acquire(&lock->tail);
+    if (!prev) {
+      if (libtask_atomic_cmpxchg(&lock->tail, prev, &lock->head) == NULL) {
+	break;
+      }
+      continue;
+    }
+
+    libtask_spinlock_node_t node = { NULL, 1 };
+    if (libtask_atomic_cmpxchg(&lock->tail, prev, &node) != prev) {
+      continue;
+    }
+    libtask_atomic_store_release(&prev->next, &node);
+    while (libtask_atomic_load_acquire(&node.locked)) {
+      if (++nspins < LIBTASK_SPINLOCK_YIELD) {
+	libtask_cpu_relax();
+      } else {
+	sched_yield();
+      }
+    }
+
+    // Take the successor over into the lock's node, or make the lock's
+    // node the tail again, before the node goes out of scope.
+    libtask_spinlock_node_t *next = libtask_atomic_load_acquire(&node.next);
+    if (!next) {
+      lock->head.next = NULL;
+      if (libtask_atomic_cmpxchg(&lock->tail, &node, &lock->head) == &node) {
+	break;
+      }
+      // A new waiter has swapped the tail, but is yet to link itself.
+      while (!(next = libtask_atomic_load_acquire(&node.next))) {
+	libtask_cpu_relax();
+      }
+    }
+    lock->head.next = next;
+    break;
   }
+#else
+  uint32_t ticket = libtask_atomic_fetch_add_relaxed(&lock->next, 1);
+  while (true) {
+    uint32_t owner = libtask_atomic_load_acquire(&lock->owner);
+    if (owner == ticket) {
+      break;
+    }
+    if (++nspins < LIBTASK_SPINLOCK_YIELD) {
+      uint32_t npauses = (ticket - owner) * LIBTASK_SPINLOCK_BACKOFF;
+      for (uint32_t i = 0; i < npauses; i++) {
+	libtask_cpu_relax();
+      }
+    } else {
+      sched_yield();
+    }
+  }
+#endif
+
+#ifdef LIBTASK_SPINLOCK_STATS
+  lock->nacquires++;
+  lock->ncontended += nspins ? 1 : 0;
+  lock->nspins += nspins;
+#else
+  (void)nspins;
+#endif
 }
 
 static inline void
 libtask_spinlock_unlock(libtask_spinlock_t *lock) {
-  libtask_atomic_store(&lock->value, 1);
+#ifdef LIBTASK_SPINLOCK_MCS
+  libtask_spinlock_node_t *next = libtask_atomic_load_acquire(&lock->head.next);
+  if (!next) {
+    if (libtask_atomic_cmpxchg_release(&lock->tail, &lock->head, NULL) ==
+	&lock->head) {
+      return;
+    }
+    // A new waiter has swapped the tail, but is yet to link itself.
+    while (!(next = libtask_atomic_load_acquire(&lock->head.next))) {
+      libtask_cpu_relax();
+    }
+  }
+  libtask_atomic_store_release(&next->locked, 0);
+#else
+  uint32_t owner = libtask_atomic_load_relaxed(&lock->owner);
+  libtask_atomic_store_release(&lock->owner, owner + 1);
+#endif
 }
 
-static inline bool
-libtask_spinlock_status(libtask_spinlock_t *lock) {
-  return libtask_atomic_load(&lock->value) == 1;
+// Get the statistics of a spinlock. Spinlock must be held for exact
+// values.
+static inline void
+libtask_spinlock_get_stats(libtask_spinlock_t *lock,
+			   libtask_spinlock_stats_t *stats) {
+#ifdef LIBTASK_SPINLOCK_STATS
+  stats->nacquires = lock->nacquires;
+  stats->ncontended = lock->ncontended;
+  stats->nspins = lock->nspins;
+#else
+  stats->nacquires = 0;
+  stats->ncontended = 0;
+  stats->nspins = 0;
+#endif
 }
 
 #endif // _LIBTASK_SPINLOCK_H_
@@ -0,0 +1,132 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+//
+// Testcase for the spinlocks. Threads hammer one lock and increment a
+// counter it protects, which must come out exact, as must the number
+// of acquisitions with spinlock statistics. Then a lock is taken by a
+// thread that exits and released by another one, as happens when a
+// task migrates between threads.
+//
+
+#include <argp.h>
+#include <pthread.h>
+
+#include "libtask/libtask.h"
+#include "libtask/log.h"
+
+static int32_t num_threads = 4;
+static int32_t num_locks = 20000;
+
+static struct argp_option options[] = {
+  {"num-threads", 0, "PINT32", 0, "No. of threads taking the lock."},
+  {"num-locks",   1, "PINT32", 0, "No. of times every thread takes it."},
+  {0}
+};
+
+static libtask_spinlock_t spinlock;
+static uint64_t counter = 0;
+
+static void *
+hammer(void *arg_)
+{
+  for (int i = 0; i < num_locks; i++) {
+    libtask_spinlock_lock(&spinlock);
+    counter++;
+    libtask_spinlock_unlock(&spinlock);
+  }
+  return NULL;
+}
+
+static void *
+lock_and_exit(void *arg_)
+{
+  libtask_spinlock_lock(&spinlock);
+  return NULL;
+}
+
+static error_t
+parse_options(int key, char *arg, struct argp_state *state)
+{
+  switch(key) {
+  case 0: // num-threads
+    if (!str2pint32(arg, 10, &num_threads)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 1: // num-locks
+    if (!str2pint32(arg, 10, &num_locks)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  default:
+    return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct argp_child children[2];
+  children[0] = libtask_argp_child;
+  children[1] = (struct argp_child){0};
+
+  struct argp argp = { options, parse_options, 0, 0, children };
+  argp_parse(&argp, argc, argv, 0, 0, 0);
+
+  libtask_spinlock_initialize(&spinlock);
+  pthread_t threads[num_threads];
+  for (int i = 0; i < num_threads; i++) {
+    CHECK(pthread_create(&threads[i], NULL, hammer, NULL) == 0);
+  }
+  for (int i = 0; i < num_threads; i++) {
+    CHECK(pthread_join(threads[i], NULL) == 0);
+  }
+  uint64_t nlocks = (uint64_t)num_threads * num_locks;
+  CHECK(counter == nlocks);
+
+  libtask_spinlock_stats_t stats;
+  libtask_spinlock_get_stats(&spinlock, &stats);
+  DEBUG("acquires %lu contended %lu spins %lu\n",
+	(unsigned long)stats.nacquires, (unsigned long)stats.ncontended,
+	(unsigned long)stats.nspins);
+#ifdef LIBTASK_SPINLOCK_STATS
+  CHECK(stats.nacquires == nlocks);
+  CHECK(stats.ncontended <= stats.nacquires);
+  CHECK(stats.ncontended == 0 || stats.nspins >= stats.ncontended);
+#else
+  CHECK(stats.nacquires == 0);
+#endif
+
+  // Lock must be usable after its holder thread is gone.
+  pthread_t thread;
+  CHECK(pthread_create(&thread, NULL, lock_and_exit, NULL) == 0);
+  CHECK(pthread_join(thread, NULL) == 0);
+  CHECK(libtask_spinlock_status(&spinlock) == false);
+  libtask_spinlock_unlock(&spinlock);
+  CHECK(libtask_spinlock_status(&spinlock) == true);
+  hammer(NULL);
+  CHECK(counter == nlocks + num_locks);
+
+  libtask_spinlock_finalize(&spinlock);
+  return 0;
+}
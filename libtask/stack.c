@@ -0,0 +1,367 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "libtask/stack.h"
+#include "libtask/options.h"
+#include "libtask/log.h"
+
+// Bytes below the stack pointer that leaf functions may use without
+// moving it.
+#define LIBTASK_STACK_RED_ZONE 128
+
+// Size of the guard page below mmap'ed stacks.
+static inline int32_t
+libtask__stack_guard_size(void)
+{
+  return (int32_t) sysconf(_SC_PAGESIZE);
+}
+
+char *
+libtask__stack_allocate(int32_t nbytes)
+{
+  if (!libtask_option_stack_mmap) {
+    return (char *)malloc(nbytes);
+  }
+
+  // Reserve the address space without committing memory or swap, so
+  // that pages are allocated only when the task touches them, and
+  // make the lowest page inaccessible to catch stack overflows.
+  int32_t guard = libtask__stack_guard_size();
+  char *base = (char *)mmap(NULL, (size_t) nbytes + guard,
+			    PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS |
+			    MAP_NORESERVE | MAP_STACK,
+			    -1, 0);
+  if (base == MAP_FAILED) {
+    return NULL;
+  }
+  if (mprotect(base, guard, PROT_NONE) != 0) {
+    munmap(base, (size_t) nbytes + guard);
+    return NULL;
+  }
+  return base + guard;
+}
+
+void
+libtask__stack_free(char *stack, int32_t nbytes)
+{
+  if (!libtask_option_stack_mmap) {
+    free(stack);
+    return;
+  }
+
+  int32_t guard = libtask__stack_guard_size();
+  CHECK(munmap(stack - guard, (size_t) nbytes + guard) == 0);
+}
+
+// Free stacks are linked through their last word, because the pages at
+// the top of a stack are the ones already in use.
+static inline void **
+libtask__stack_link(void *stack, int index)
+{
+  int32_t nbytes = 1 << (index + LIBTASK_STACK_MIN_SHIFT);
+  return (void **)((char *)stack + nbytes) - 1;
+}
+
+// Returns the size class for a stack size or -1 if the size is too
+// large to be cached.
+static inline int
+libtask__stack_class(int32_t size)
+{
+  int shift = LIBTASK_STACK_MIN_SHIFT;
+  while (shift <= LIBTASK_STACK_MAX_SHIFT && (1 << shift) < size) {
+    shift++;
+  }
+  return shift > LIBTASK_STACK_MAX_SHIFT ? -1 : shift - LIBTASK_STACK_MIN_SHIFT;
+}
+
+// Unlink free stacks of a size class until only count stacks are
+// left. Returns the unlinked stacks as a chain, which should be
+// released with libtask__stack_release after unlocking the
+// cache. Cache spinlock must be held.
+static void *
+libtask__stack_cache_trim(libtask_stack_cache_t *cache, int index,
+			  int32_t count)
+{
+  void *chain = NULL;
+  while (cache->nfree[index] > count) {
+    void *stack = cache->free_list[index];
+    cache->free_list[index] = *libtask__stack_link(stack, index);
+    cache->nfree[index]--;
+    *libtask__stack_link(stack, index) = chain;
+    chain = stack;
+  }
+  return chain;
+}
+
+// Free a chain of stacks of a size class.
+static void
+libtask__stack_release(void *chain, int index)
+{
+  int32_t nbytes = 1 << (index + LIBTASK_STACK_MIN_SHIFT);
+  while (chain) {
+    char *stack = (char *)chain;
+    chain = *libtask__stack_link(stack, index);
+    libtask__stack_free(stack, nbytes);
+  }
+}
+
+void
+libtask_stack_cache_initialize(libtask_stack_cache_t *cache)
+{
+  libtask_spinlock_initialize(&cache->spinlock);
+  for (int i = 0; i < LIBTASK_STACK_NCLASSES; i++) {
+    cache->free_list[i] = NULL;
+    cache->nfree[i] = 0;
+  }
+  cache->low_watermark = libtask_option_stack_cache_low_watermark;
+  cache->high_watermark = libtask_option_stack_cache_high_watermark;
+  if (cache->low_watermark > cache->high_watermark) {
+    cache->low_watermark = cache->high_watermark;
+  }
+  cache->nhits = 0;
+  cache->nmisses = 0;
+}
+
+void
+libtask_stack_cache_finalize(libtask_stack_cache_t *cache)
+{
+  for (int i = 0; i < LIBTASK_STACK_NCLASSES; i++) {
+    libtask__stack_release(libtask__stack_cache_trim(cache, i, 0), i);
+  }
+  libtask_spinlock_finalize(&cache->spinlock);
+}
+
+error_t
+libtask_stack_cache_set_watermarks(libtask_stack_cache_t *cache,
+				   int32_t low_watermark,
+				   int32_t high_watermark)
+{
+  if (low_watermark < 0 || low_watermark > high_watermark) {
+    return EINVAL;
+  }
+
+  void *chains[LIBTASK_STACK_NCLASSES] = { NULL };
+  libtask_spinlock_lock(&cache->spinlock);
+  cache->low_watermark = low_watermark;
+  cache->high_watermark = high_watermark;
+  for (int i = 0; i < LIBTASK_STACK_NCLASSES; i++) {
+    if (cache->nfree[i] > high_watermark) {
+      chains[i] = libtask__stack_cache_trim(cache, i, low_watermark);
+    }
+  }
+  libtask_spinlock_unlock(&cache->spinlock);
+
+  for (int i = 0; i < LIBTASK_STACK_NCLASSES; i++) {
+    libtask__stack_release(chains[i], i);
+  }
+  return 0;
+}
+
+void
+libtask_stack_cache_get_stats(libtask_stack_cache_t *cache,
+			      libtask_stack_cache_stats_t *stats)
+{
+  libtask_spinlock_lock(&cache->spinlock);
+  stats->nhits = cache->nhits;
+  stats->nmisses = cache->nmisses;
+  stats->nfree = 0;
+  stats->nbytes = 0;
+  for (int i = 0; i < LIBTASK_STACK_NCLASSES; i++) {
+    stats->nfree += cache->nfree[i];
+    stats->nbytes += (int64_t) cache->nfree[i] <<
+      (i + LIBTASK_STACK_MIN_SHIFT);
+  }
+  libtask_spinlock_unlock(&cache->spinlock);
+}
+
+error_t
+libtask__stack_cache_allocate(libtask_stack_cache_t *cache, int32_t size,
+			      char **stackp, int32_t *nbytesp)
+{
+  int index = libtask__stack_class(size);
+  int32_t nbytes = index < 0 ? size : 1 << (index + LIBTASK_STACK_MIN_SHIFT);
+
+  char *stack = NULL;
+  libtask_spinlock_lock(&cache->spinlock);
+  if (index >= 0 && cache->free_list[index]) {
+    stack = (char *)cache->free_list[index];
+    cache->free_list[index] = *libtask__stack_link(stack, index);
+    cache->nfree[index]--;
+    cache->nhits++;
+  } else {
+    cache->nmisses++;
+  }
+  libtask_spinlock_unlock(&cache->spinlock);
+
+  if (!stack && !(stack = libtask__stack_allocate(nbytes))) {
+    return ENOMEM;
+  }
+  *stackp = stack;
+  *nbytesp = nbytes;
+  return 0;
+}
+
+void
+libtask__stack_cache_free(libtask_stack_cache_t *cache,
+			  char *stack, int32_t nbytes)
+{
+  int index = libtask__stack_class(nbytes);
+  if (index < 0) {
+    libtask__stack_free(stack, nbytes);
+    return;
+  }
+  assert(nbytes == 1 << (index + LIBTASK_STACK_MIN_SHIFT));
+
+  void *chain = NULL;
+  libtask_spinlock_lock(&cache->spinlock);
+  *libtask__stack_link(stack, index) = cache->free_list[index];
+  cache->free_list[index] = stack;
+  cache->nfree[index]++;
+  if (cache->nfree[index] > cache->high_watermark) {
+    chain = libtask__stack_cache_trim(cache, index, cache->low_watermark);
+  }
+  libtask_spinlock_unlock(&cache->spinlock);
+  libtask__stack_release(chain, index);
+}
+
+// Canary pattern of painted stacks.
+#define LIBTASK_STACK_CANARY 0x5a5a5a5a5a5a5a5aULL
+
+typedef struct {
+  int (*function)(void *);
+  libtask_stack_watermark_t watermark;
+} libtask_stack_watermark_entry_t;
+
+// Histograms of the task functions in an open addressing table. A
+// zeroed spinlock is unlocked.
+static libtask_spinlock_t watermark_spinlock;
+static libtask_stack_watermark_entry_t
+watermark_entries[LIBTASK_STACK_WATERMARK_FUNCTIONS];
+
+// Find the entry of a function or the free entry for it, or NULL when
+// the table is full. Spinlock must be held.
+static libtask_stack_watermark_entry_t *
+libtask__stack_watermark_find(int (*function)(void *))
+{
+  uintptr_t hash = (uintptr_t)function >> 4;
+  for (int i = 0; i < LIBTASK_STACK_WATERMARK_FUNCTIONS; i++) {
+    libtask_stack_watermark_entry_t *entry =
+      &watermark_entries[(hash + i) % LIBTASK_STACK_WATERMARK_FUNCTIONS];
+    if (entry->function == function || entry->function == NULL) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+void
+libtask__stack_paint(char *stack, int32_t nbytes)
+{
+  uint64_t *words = (uint64_t *)stack;
+  for (int32_t i = 0; i < nbytes / (int32_t)sizeof(uint64_t); i++) {
+    words[i] = LIBTASK_STACK_CANARY;
+  }
+}
+
+int32_t
+libtask__stack_peak(const char *stack, int32_t nbytes)
+{
+  // Stacks grow down, so the untouched words are at the bottom.
+  const uint64_t *words = (const uint64_t *)stack;
+  int32_t nwords = nbytes / (int32_t)sizeof(uint64_t);
+  int32_t i = 0;
+  while (i < nwords && words[i] == LIBTASK_STACK_CANARY) {
+    i++;
+  }
+  return nbytes - i * (int32_t)sizeof(uint64_t);
+}
+
+void
+libtask__stack_watermark_record(int (*function)(void *), int32_t peak)
+{
+  int index = libtask__stack_class(peak);
+  if (index < 0) {
+    index = LIBTASK_STACK_NCLASSES - 1;
+  }
+
+  libtask_spinlock_lock(&watermark_spinlock);
+  libtask_stack_watermark_entry_t *entry =
+    libtask__stack_watermark_find(function);
+  if (entry) {
+    entry->function = function;
+    entry->watermark.nsamples++;
+    entry->watermark.histogram[index]++;
+    if (peak > entry->watermark.peak) {
+      entry->watermark.peak = peak;
+    }
+  }
+  libtask_spinlock_unlock(&watermark_spinlock);
+}
+
+int32_t
+libtask__stack_watermark_size(int (*function)(void *), int32_t size)
+{
+  libtask_stack_watermark_t watermark;
+  if (libtask_stack_watermark_get(function, &watermark) != 0 ||
+      watermark.nsamples < LIBTASK_STACK_WATERMARK_SAMPLES) {
+    return size;
+  }
+
+  int index = libtask__stack_class(watermark.peak);
+  if (index < 0 || index + 1 >= LIBTASK_STACK_NCLASSES) {
+    return size;
+  }
+  int32_t tuned = 1 << (index + 1 + LIBTASK_STACK_MIN_SHIFT);
+  return tuned < size ? tuned : size;
+}
+
+error_t
+libtask_stack_watermark_get(int (*function)(void *),
+			    libtask_stack_watermark_t *watermark)
+{
+  error_t error = ENOENT;
+  libtask_spinlock_lock(&watermark_spinlock);
+  libtask_stack_watermark_entry_t *entry =
+    libtask__stack_watermark_find(function);
+  if (entry && entry->function) {
+    *watermark = entry->watermark;
+    error = 0;
+  }
+  libtask_spinlock_unlock(&watermark_spinlock);
+  return error;
+}
+
+int64_t
+libtask__stack_reclaim(char *stack, char *sp)
+{
+  uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+  uintptr_t low = ((uintptr_t)stack + page - 1) & ~(page - 1);
+  uintptr_t high = ((uintptr_t)sp - LIBTASK_STACK_RED_ZONE) & ~(page - 1);
+  if (!sp || high <= low) {
+    return 0;
+  }
+  if (madvise((void *)low, high - low, MADV_DONTNEED) != 0) {
+    return 0;
+  }
+  return (int64_t)(high - low);
+}
@@ -0,0 +1,209 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _LIBTASK_STACK_H_
+#define _LIBTASK_STACK_H_
+
+#include "libtask/base.h"
+#include "libtask/spinlock.h"
+
+// Stack Cache
+//
+// Every task needs a stack and most tasks are short lived, so stacks
+// of finished tasks are kept in a cache for reuse by new tasks.
+// Stack sizes are rounded up to a power of two and every power of two
+// is a size class with its own list of free stacks.  Stacks larger
+// than the largest size class are not cached.
+//
+// When a size class collects more than high_watermark free stacks,
+// it is trimmed down to low_watermark stacks, so that a burst of
+// finished tasks doesn't hold on to the memory for ever.
+//
+// Stacks are normally allocated with malloc.  With the stack-mmap
+// option, every stack is a separate mapping that is reserved without
+// committing memory (MAP_NORESERVE) and has an inaccessible guard page
+// below it, so a stack overflow crashes the process instead of
+// corrupting the heap.  Physical pages are committed only when a task
+// touches them, so stacks can be sized for the worst case without
+// being charged to RSS.  Note that every such stack takes two entries
+// of vm.max_map_count, which may need to be raised for very large
+// numbers of tasks.
+
+#define LIBTASK_STACK_MIN_SHIFT 12 // 4KB
+#define LIBTASK_STACK_MAX_SHIFT 23 // 8MB
+#define LIBTASK_STACK_NCLASSES					\
+  (LIBTASK_STACK_MAX_SHIFT - LIBTASK_STACK_MIN_SHIFT + 1)
+
+typedef struct {
+  libtask_spinlock_t spinlock;
+
+  // Free stacks of each size class. Free stacks are linked through
+  // their last word.
+  void *free_list[LIBTASK_STACK_NCLASSES];
+  int32_t nfree[LIBTASK_STACK_NCLASSES];
+
+  // Number of free stacks to keep in each size class.
+  int32_t low_watermark;
+  int32_t high_watermark;
+
+  // Number of allocations served from the cache and otherwise.
+  int64_t nhits;
+  int64_t nmisses;
+} libtask_stack_cache_t;
+
+typedef struct {
+  int64_t nhits;
+  int64_t nmisses;
+
+  // Number of free stacks in the cache and their total size.
+  int64_t nfree;
+  int64_t nbytes;
+} libtask_stack_cache_stats_t;
+
+// Initialize a stack cache. Watermarks are initialized from the
+// library options.
+//
+// cache: The stack cache.
+void
+libtask_stack_cache_initialize(libtask_stack_cache_t *cache);
+
+// Destroy a stack cache and release all free stacks.
+//
+// cache: The stack cache.
+void
+libtask_stack_cache_finalize(libtask_stack_cache_t *cache);
+
+// Update the watermarks of a stack cache. Size classes holding more
+// than the high watermark stacks are trimmed immediately.
+//
+// cache: The stack cache.
+//
+// low_watermark: Number of free stacks to keep after a trim.
+//
+// high_watermark: Number of free stacks that triggers a trim.
+//
+// Returns zero on success or EINVAL if watermarks are invalid.
+error_t
+libtask_stack_cache_set_watermarks(libtask_stack_cache_t *cache,
+				   int32_t low_watermark,
+				   int32_t high_watermark);
+
+// Get the statistics of a stack cache.
+//
+// cache: The stack cache.
+//
+// stats: Output parameter where the statistics are returned.
+void
+libtask_stack_cache_get_stats(libtask_stack_cache_t *cache,
+			      libtask_stack_cache_stats_t *stats);
+
+// Stack Watermarks
+//
+// With the stack-watermark option, stacks of new tasks are painted
+// with a canary pattern and the peak stack usage of a task is found
+// when it finishes, from the lowest word of its stack that no longer
+// holds the canary. Peaks are collected in a histogram of size classes
+// per task function. Once a function has
+// LIBTASK_STACK_WATERMARK_SAMPLES peaks, its new tasks get stacks of
+// twice the size class of the largest peak, unless they ask for less.
+//
+// Painting commits every page of a stack, so the option is meant for
+// finding the right stack sizes rather than for production.
+
+#define LIBTASK_STACK_WATERMARK_SAMPLES 16
+#define LIBTASK_STACK_WATERMARK_FUNCTIONS 256
+
+typedef struct {
+  // Number of finished tasks measured and their largest peak usage in
+  // bytes.
+  int64_t nsamples;
+  int32_t peak;
+
+  // Number of peaks that fall in each stack size class.
+  int64_t histogram[LIBTASK_STACK_NCLASSES];
+} libtask_stack_watermark_t;
+
+// Get the stack usage of the finished tasks of a function.
+//
+// function: The task function.
+//
+// watermark: Output parameter where the usage is returned.
+//
+// Returns zero on success or ENOENT if no task of the function is
+// measured.
+error_t
+libtask_stack_watermark_get(int (*function)(void *),
+			    libtask_stack_watermark_t *watermark);
+
+//
+// Private interfaces
+//
+
+// Allocate a stack from the cache. Size is rounded up to its size
+// class.
+//
+// stackp: Output parameter for the lowest address of the stack.
+//
+// nbytesp: Output parameter for the actual size of the stack.
+//
+// Returns zero on success and ENOMEM on out of memory.
+error_t
+libtask__stack_cache_allocate(libtask_stack_cache_t *cache, int32_t size,
+			      char **stackp, int32_t *nbytesp);
+
+// Return a stack allocated from a stack cache.
+void
+libtask__stack_cache_free(libtask_stack_cache_t *cache,
+			  char *stack, int32_t nbytes);
+
+// Fill a stack with the canary pattern.
+void
+libtask__stack_paint(char *stack, int32_t nbytes);
+
+// Find the peak usage of a painted stack in bytes.
+int32_t
+libtask__stack_peak(const char *stack, int32_t nbytes);
+
+// Add the peak stack usage of a finished task to the histogram of its
+// function. Peaks of functions beyond the first
+// LIBTASK_STACK_WATERMARK_FUNCTIONS are dropped.
+void
+libtask__stack_watermark_record(int (*function)(void *), int32_t peak);
+
+// Get the stack size for a new task of a function, which is the
+// requested size until enough peaks are known for the function.
+int32_t
+libtask__stack_watermark_size(int (*function)(void *), int32_t size);
+
+// Give the pages of a stack below a stack pointer back to the system,
+// except for the red zone that the code running on the stack may use.
+//
+// Returns the number of bytes given back.
+int64_t
+libtask__stack_reclaim(char *stack, char *sp);
+
+// Allocate and free a stack without the cache. Stacks are allocated
+// with malloc, or with mmap when libtask_option_stack_mmap is set.
+char *
+libtask__stack_allocate(int32_t nbytes);
+
+void
+libtask__stack_free(char *stack, int32_t nbytes);
+
+#endif // _LIBTASK_STACK_H_
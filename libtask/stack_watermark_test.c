@@ -0,0 +1,164 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+//
+// Testcase for stack watermarks. Tasks of two functions with known
+// stack usage are measured and then new tasks of the functions must
+// get stacks that are smaller than requested but still fit.
+//
+
+#include <argp.h>
+#include <pthread.h>
+
+#include "libtask/libtask.h"
+#include "libtask/log.h"
+
+#define TASK_STACK_SIZE (256*1024)
+
+static int32_t num_threads = 2;
+
+static struct argp_option options[] = {
+  {"num-threads", 0, "PINT32", 0, "No. of threads in the task-pool."},
+  {0}
+};
+
+static libtask_task_pool_t task_pool;
+
+// Touch a frame of some size, so that the stack usage is known.
+static int
+touch(int32_t nbytes)
+{
+  volatile char frame[nbytes];
+  for (int32_t i = 0; i < nbytes; i++) {
+    frame[i] = (char)i;
+  }
+  libtask_yield();
+  return frame[nbytes - 1];
+}
+
+int
+shallow(void *arg_)
+{
+  touch(1024);
+  return 0;
+}
+
+int
+deep(void *arg_)
+{
+  touch(40 * 1024);
+  return 0;
+}
+
+int
+unused(void *arg_)
+{
+  return 0;
+}
+
+// Run a batch of tasks of a function and return the stack size of
+// the last one.
+static int32_t
+run(int (*function)(void *), int32_t ntasks)
+{
+  int32_t nbytes = 0;
+  libtask_task_t *tasks[ntasks];
+  for (int i = 0; i < ntasks; i++) {
+    CHECK(libtask_task_create(&tasks[i], &task_pool, function, NULL,
+			      TASK_STACK_SIZE) == 0);
+    nbytes = tasks[i]->nbytes;
+  }
+  for (int i = 0; i < ntasks; i++) {
+    CHECK(libtask_task_wait(tasks[i]) == 0);
+    libtask_task_unref(tasks[i]);
+  }
+  return nbytes;
+}
+
+static error_t
+parse_options(int key, char *arg, struct argp_state *state)
+{
+  switch(key) {
+  case 0: // num-threads
+    if (!str2pint32(arg, 10, &num_threads)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  default:
+    return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct argp_child children[2];
+  children[0] = libtask_argp_child;
+  children[1] = (struct argp_child){0};
+
+  libtask_option_stack_watermark = true;
+  struct argp argp = { options, parse_options, 0, 0, children };
+  argp_parse(&argp, argc, argv, 0, 0, 0);
+  CHECK(libtask_option_stack_watermark);
+
+  CHECK(libtask_task_pool_initialize(&task_pool) == 0);
+  pthread_t threads[num_threads];
+  for (int i = 0; i < num_threads; i++) {
+    CHECK(libtask_task_pool_start(&task_pool, &threads[i]) == 0);
+  }
+
+  // Stacks are as requested until enough tasks are measured.
+  CHECK(run(shallow, LIBTASK_STACK_WATERMARK_SAMPLES) == TASK_STACK_SIZE);
+  CHECK(run(deep, LIBTASK_STACK_WATERMARK_SAMPLES) == TASK_STACK_SIZE);
+
+  libtask_stack_watermark_t watermark;
+  CHECK(libtask_stack_watermark_get(unused, &watermark) == ENOENT);
+
+  CHECK(libtask_stack_watermark_get(shallow, &watermark) == 0);
+  CHECK(watermark.nsamples == LIBTASK_STACK_WATERMARK_SAMPLES);
+  CHECK(watermark.peak >= 1024 && watermark.peak < 16 * 1024);
+  int32_t shallow_peak = watermark.peak;
+
+  CHECK(libtask_stack_watermark_get(deep, &watermark) == 0);
+  CHECK(watermark.nsamples == LIBTASK_STACK_WATERMARK_SAMPLES);
+  CHECK(watermark.peak >= 40 * 1024 && watermark.peak < 64 * 1024);
+  int64_t nsamples = 0;
+  for (int i = 0; i < LIBTASK_STACK_NCLASSES; i++) {
+    nsamples += watermark.histogram[i];
+  }
+  CHECK(nsamples == watermark.nsamples);
+  int32_t deep_peak = watermark.peak;
+
+  // New tasks get stacks sized by the peaks.
+  int32_t nbytes = run(shallow, 4);
+  DEBUG("shallow peak %d stack %d\n", shallow_peak, nbytes);
+  CHECK(nbytes >= 2 * shallow_peak && nbytes < TASK_STACK_SIZE);
+  nbytes = run(deep, 4);
+  DEBUG("deep peak %d stack %d\n", deep_peak, nbytes);
+  CHECK(nbytes >= 2 * deep_peak && nbytes < TASK_STACK_SIZE);
+
+  for (int i = 0; i < num_threads; i++) {
+    CHECK(libtask_task_pool_stop(&task_pool, threads[i]) == 0);
+    CHECK(pthread_join(threads[i], NULL) == 0);
+  }
+  CHECK(libtask_task_pool_finalize(&task_pool) == 0);
+  return 0;
+}
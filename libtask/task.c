@@ -18,79 +18,219 @@
 //
 
 #include "libtask/task_pool.h"
+#include "libtask/options.h"
 #include "libtask/log.h"
 
-// Pthread key that keeps track of current task.
-static pthread_key_t current_task_key;
+__thread libtask_thread_t libtask__thread
+  __attribute__((tls_model("initial-exec")));
 
-// Pthread once initializations for this module.
-static error_t pthread_once_error = 0;
-static pthread_once_t pthread_once_control = PTHREAD_ONCE_INIT;
+// Number of task-local storage keys created and their destructors.
+static volatile int32_t nkeys = 0;
+static void (*key_destructors[LIBTASK_TASK_KEYS])(void *);
 
-void libtask_task_once()
+error_t
+libtask_task_key_create(libtask_task_key_t *keyp, void (*destructor)(void *))
 {
-  if ((pthread_once_error = pthread_key_create(&current_task_key, NULL))) {
-    return;
+  int32_t key = libtask_atomic_load(&nkeys);
+  while (key < LIBTASK_TASK_KEYS) {
+    int32_t old = libtask_atomic_cmpxchg(&nkeys, key, key + 1);
+    if (old == key) {
+      // Tasks don't have values for the key before it is returned, so
+      // they don't need its destructor before that either.
+      key_destructors[key] = destructor;
+      *keyp = key;
+      return 0;
+    }
+    key = old;
   }
-
-  return;
+  return EAGAIN;
 }
 
-static inline error_t
-libtask__set_task_current(libtask_task_t *task)
+void *
+libtask_task_getspecific(libtask_task_key_t key)
 {
-  int result;
-  result = pthread_setspecific(current_task_key, task);
-  assert(result == 0);
+  libtask_task_t *task = libtask_get_task_current();
+  if (!task || key < 0 || key >= LIBTASK_TASK_KEYS) {
+    return NULL;
+  }
+  return task->specific[key];
+}
 
+error_t
+libtask_task_setspecific(libtask_task_key_t key, const void *value)
+{
+  libtask_task_t *task = libtask_get_task_current();
+  if (!task || key < 0 || key >= libtask_atomic_load(&nkeys)) {
+    return EINVAL;
+  }
+  task->specific[key] = (void *)value;
   return 0;
 }
 
-libtask_task_t *
-libtask_get_task_current(void)
+// Destroy the task-local storage values of a finishing task.
+static void
+libtask__task_destroy_specific(libtask_task_t *task)
 {
-  return (libtask_task_t *)pthread_getspecific(current_task_key);
+  int32_t n = libtask_atomic_load(&nkeys);
+  for (int pass = 0; pass < LIBTASK_TASK_KEY_DESTRUCTOR_PASSES; pass++) {
+    bool found = false;
+    for (int32_t key = 0; key < n; key++) {
+      void *value = task->specific[key];
+      if (value && key_destructors[key]) {
+	task->specific[key] = NULL;
+	key_destructors[key](value);
+	found = true;
+      }
+    }
+    if (!found) {
+      break;
+    }
+  }
 }
 
-static error_t
-initialize(libtask_task_t *task,
-	   struct libtask_task_pool *task_pool,
-	   int (*function)(void *),
-	   void *argument,
-	   int32_t stack_size)
+// Tasks created by libtask_task_create_many share one allocation,
+// which starts with this header and is freed when the last of its
+// tasks is destroyed. Stacks are part of the allocation unless they
+// need guard pages, in which case they come from the stack cache as
+// usual.
+typedef struct libtask_task_slab {
+  volatile int32_t ntasks;
+  bool stacks;
+} libtask_task_slab_t;
+
+// Round up a size to a multiple of the cache line size.
+static inline size_t
+libtask__task_slab_align(size_t size)
+{
+  return (size + LIBTASK_CACHE_LINE_SIZE - 1) &
+    ~(size_t)(LIBTASK_CACHE_LINE_SIZE - 1);
+}
+
+// Condition variable of a task that somebody waits for.
+typedef struct libtask_task_join {
+  libtask_spinlock_t spinlock;
+  libtask_condition_t condition;
+} libtask_task_join_t;
+
+// Get the condition variable of a task, allocating it on first use.
+static libtask_task_join_t *
+libtask__task_join(libtask_task_t *task)
 {
-  CHECK(pthread_once(&pthread_once_control, libtask_task_once) == 0);
-  if (pthread_once_error) {
-    return pthread_once_error;
+  libtask_task_join_t *join = libtask_atomic_load(&task->join);
+  if (join) {
+    return join;
   }
 
-  char *stack = (char *)malloc(stack_size);
-  if (!stack) {
-    return ENOMEM;
+  join = (libtask_task_join_t *)malloc(sizeof(libtask_task_join_t));
+  if (!join) {
+    return NULL;
+  }
+  libtask_spinlock_initialize(&join->spinlock);
+  libtask_condition_initialize(&join->condition, &join->spinlock);
+
+  libtask_task_join_t *none = NULL;
+  libtask_task_join_t *old = libtask_atomic_cmpxchg(&task->join, none, join);
+  if (old) {
+    libtask_condition_finalize(&join->condition);
+    libtask_spinlock_finalize(&join->spinlock);
+    free(join);
+    return old;
+  }
+  return join;
+}
+
+// Drop a task of a slab and free the slab with the last one.
+static void
+libtask__task_slab_release(libtask_task_slab_t *slab)
+{
+  if (libtask_atomic_sub(&slab->ntasks, 1) == 0) {
+    free(slab);
   }
+}
+
+// Put the control block of a destroyed detached task in its
+// task-pool's task cache or free it when the cache is full.
+static void
+libtask__task_recycle(libtask_task_t *task)
+{
+  libtask_task_pool_t *task_pool = task->recycler;
+  libtask_spinlock_lock(&task_pool->task_cache_spinlock);
+  if (task_pool->ntask_cache < LIBTASK_TASK_CACHE_SIZE) {
+    libtask_list_push_back(&task_pool->task_cache,
+			   &task->originating_pool_link);
+    task_pool->ntask_cache++;
+    task = NULL;
+  }
+  libtask_spinlock_unlock(&task_pool->task_cache_spinlock);
+  free(task);
+  libtask_task_pool_unref(task_pool);
+}
 
-  task->stack = stack;
-  task->nbytes = stack_size;
+void *libtask__task_main(libtask_task_t *task);
+
+// Initialize the members of a task whose stack is set already. Context
+// of a task on a shared stack is initialized when it runs first.
+static void
+setup(libtask_task_t *task, int (*function)(void *), void *argument)
+{
   task->argument = argument;
   task->function = function;
-  libtask_spinlock_initialize(&task->stack_spinlock);
+  task->state = LIBTASK_TASK_SUSPENDED;
 
   task->result = 0;
   task->complete = false;
-  libtask_spinlock_initialize(&task->completed_spinlock);
-  libtask_condition_initialize(&task->completed, &task->completed_spinlock);
-
-  CHECK(getcontext(&task->uct_self) == 0);
-  task->uct_self.uc_stack.ss_sp = task->stack;
-  task->uct_self.uc_stack.ss_size = task->nbytes;
-  task->uct_self.uc_link = NULL;
+  task->join = NULL;
 
-  void *libtask__task_main(libtask_task_t *task);
-  makecontext(&task->uct_self, (void(*)())libtask__task_main, 1, task);
+  if (task->stack) {
+    libtask__context_initialize(&task->context_self, task->stack,
+				task->nbytes,
+				(void (*)(void *))libtask__task_main, task);
+  }
 
   task->owner = NULL;
   libtask_list_initialize(&task->waiting_link);
+  libtask_list_initialize(&task->runnable_link);
+  task->runnable = 0;
+  task->inbox_link.next = NULL;
+  task->inboxed = 0;
   libtask_list_initialize(&task->originating_pool_link);
+  memset(task->specific, 0, sizeof(task->specific));
+  task->slab = NULL;
+  task->recycler = NULL;
+  task->shared = NULL;
+  task->shared_low = NULL;
+  task->saved = NULL;
+  task->saved_size = 0;
+  task->pinned = false;
+  task->reclaimed = false;
+  task->reclaimable = false;
+  task->painted = false;
+  task->suspended_usecs = 0;
+}
+
+static error_t
+initialize(libtask_task_t *task,
+	   struct libtask_task_pool *task_pool,
+	   int (*function)(void *),
+	   void *argument,
+	   int32_t stack_size)
+{
+  bool painted = libtask_option_stack_watermark;
+  if (painted) {
+    stack_size = libtask__stack_watermark_size(function, stack_size);
+  }
+  error_t error = libtask__stack_cache_allocate(&task_pool->stack_cache,
+					       stack_size,
+					       &task->stack, &task->nbytes);
+  if (error) {
+    return error;
+  }
+  if (painted) {
+    libtask__stack_paint(task->stack, task->nbytes);
+  }
+  setup(task, function, argument);
+  task->painted = painted;
+  task->reclaimable = task_pool->reclaim_usecs > 0 && !task->painted;
   return 0;
 }
 
@@ -111,22 +251,50 @@ libtask_task_initialize(libtask_task_t *task,
   return 0;
 }
 
+// Wait for the thread that finished a task to release it.
+static void
+libtask__task_wait_released(libtask_task_t *task)
+{
+  for (int nspins = 0;
+       libtask_atomic_load_acquire(&task->state) == LIBTASK_TASK_RUNNING;) {
+    if (++nspins < LIBTASK_SPINLOCK_YIELD) {
+      libtask_cpu_relax();
+    } else {
+      sched_yield();
+    }
+  }
+}
+
 error_t
 libtask_task_finalize(libtask_task_t *task)
 {
   assert(libtask_get_task_current() != task);
   assert(libtask_refcount_count(&task->refcount) <= 1);
 
+  // Thread that finished the task may still be completing it.
+  libtask__task_wait_released(task);
+
   CHECK(task->owner == NULL);
   CHECK(libtask_list_empty(&task->waiting_link));
+  CHECK(libtask_list_empty(&task->runnable_link));
+  CHECK(task->inboxed == 0);
   CHECK(libtask_list_empty(&task->originating_pool_link));
 
-  libtask_condition_finalize(&task->completed);
-  libtask_spinlock_finalize(&task->completed_spinlock);
-  libtask_spinlock_finalize(&task->stack_spinlock);
+  if (task->join) {
+    libtask_condition_finalize(&task->join->condition);
+    libtask_spinlock_finalize(&task->join->spinlock);
+    free(task->join);
+  }
 
-  free(task->stack);
-  task->stack = NULL;
+  // Stack is returned to the task-pool's cache when the task finishes.
+  assert(task->stack == NULL);
+
+  // Memory of the task may be gone after these.
+  if (task->slab) {
+    libtask__task_slab_release(task->slab);
+  } else if (task->recycler) {
+    libtask__task_recycle(task);
+  }
   return 0;
 }
 
@@ -137,7 +305,8 @@ libtask_task_create(libtask_task_t **taskp,
 		    void *argument,
 		    int32_t stack_size)
 {
-  libtask_task_t *task = (libtask_task_t *)malloc(sizeof(libtask_task_t));
+  libtask_task_t *task =
+    (libtask_task_t *)libtask__cache_aligned_malloc(sizeof(libtask_task_t));
   if (!task) {
     return ENOMEM;
   }
@@ -154,25 +323,223 @@ libtask_task_create(libtask_task_t **taskp,
   return 0;
 }
 
+error_t
+libtask_task_create_many(libtask_task_t **tasks,
+			 int32_t ntasks,
+			 libtask_task_pool_t *task_pool,
+			 int (*function)(void *),
+			 void **arguments,
+			 int32_t stack_size)
+{
+  if (ntasks <= 0 || stack_size <= 0) {
+    return EINVAL;
+  }
+  bool painted = libtask_option_stack_watermark;
+  if (painted) {
+    stack_size = libtask__stack_watermark_size(function, stack_size);
+  }
+
+  // Tasks and, unless stacks need guard pages, their stacks are
+  // carved out of one allocation.
+  bool stacks = !libtask_option_stack_mmap;
+  size_t tasks_size = libtask__task_slab_align(sizeof(libtask_task_slab_t)) +
+    libtask__task_slab_align(sizeof(libtask_task_t) * ntasks);
+  size_t nbytes = libtask__task_slab_align(stack_size);
+  if (nbytes > INT32_MAX) {
+    return EINVAL;
+  }
+  size_t size = tasks_size + (stacks ? nbytes * ntasks : 0);
+  libtask_task_slab_t *slab =
+    (libtask_task_slab_t *)libtask__cache_aligned_malloc(size);
+  if (!slab) {
+    return ENOMEM;
+  }
+  slab->ntasks = ntasks;
+  slab->stacks = stacks;
+
+  libtask_task_t *array = (libtask_task_t *)
+    ((char *)slab + libtask__task_slab_align(sizeof(libtask_task_slab_t)));
+  for (int32_t i = 0; i < ntasks; i++) {
+    libtask_task_t *task = &array[i];
+    if (stacks) {
+      task->stack = (char *)slab + tasks_size + nbytes * i;
+      task->nbytes = (int32_t)nbytes;
+    } else {
+      error_t error = libtask__stack_cache_allocate(&task_pool->stack_cache,
+						    stack_size, &task->stack,
+						    &task->nbytes);
+      if (error) {
+	while (i-- > 0) {
+	  libtask__stack_cache_free(&task_pool->stack_cache, array[i].stack,
+				    array[i].nbytes);
+	}
+	free(slab);
+	return error;
+      }
+    }
+    if (painted) {
+      libtask__stack_paint(task->stack, task->nbytes);
+    }
+    setup(task, function, arguments ? arguments[i] : NULL);
+    task->painted = painted;
+    // Stacks inside the slab are never mmap'ed.
+    task->reclaimable =
+      task_pool->reclaim_usecs > 0 && !stacks && !task->painted;
+    task->slab = slab;
+    // Memory is released with the slab, so tasks are counted like
+    // stack objects.
+    libtask_refcount_initialize(&task->refcount);
+    tasks[i] = task;
+  }
+
+  libtask__task_pool_insert_many(task_pool, tasks, ntasks);
+  return 0;
+}
+
+error_t
+libtask_task_create_shared(libtask_task_t **taskp,
+			   libtask_task_pool_t *task_pool,
+			   int (*function)(void *),
+			   void *argument)
+{
+  libtask_shared_stack_t *shared;
+  error_t error = libtask__task_pool_shared_stack(task_pool, &shared);
+  if (error) {
+    return error;
+  }
+
+  libtask_task_t *task =
+    (libtask_task_t *)libtask__cache_aligned_malloc(sizeof(libtask_task_t));
+  if (!task) {
+    return ENOMEM;
+  }
+  task->stack = NULL;
+  task->nbytes = 0;
+  setup(task, function, argument);
+  task->shared = shared;
+
+  libtask_refcount_create(&task->refcount);
+  libtask__task_pool_insert(task_pool, task);
+  *taskp = task;
+  return 0;
+}
+
+error_t
+libtask_task_spawn_detached(libtask_task_pool_t *task_pool,
+			    int (*function)(void *),
+			    void *argument,
+			    int32_t stack_size)
+{
+  libtask_task_t *task = NULL;
+  libtask_spinlock_lock(&task_pool->task_cache_spinlock);
+  libtask_list_t *link = libtask_list_pop_front(&task_pool->task_cache);
+  if (link) {
+    task_pool->ntask_cache--;
+    task = libtask_list_entry(link, libtask_task_t, originating_pool_link);
+  }
+  libtask_spinlock_unlock(&task_pool->task_cache_spinlock);
+
+  if (!task) {
+    task = (libtask_task_t *)libtask__cache_aligned_malloc(sizeof(*task));
+    if (!task) {
+      return ENOMEM;
+    }
+  }
+  error_t error = initialize(task, task_pool, function, argument, stack_size);
+  if (error != 0) {
+    free(task);
+    return error;
+  }
+
+  // Memory is recycled by the finalizer, so the task is counted like a
+  // stack object. Its initial reference is handed over to the
+  // task-pool.
+  task->recycler = libtask_task_pool_ref(task_pool);
+  libtask_refcount_initialize(&task->refcount);
+  libtask__task_pool_insert(task_pool, task);
+  return 0;
+}
+
+// Publishing the condition variable and checking the complete flag
+// pairs with setting the flag and checking for the condition variable
+// in libtask__task_execute, so either the waiter sees the task
+// finished or the finishing thread sees the waiter.
+
 error_t
 libtask_task_wait(libtask_task_t *task)
 {
-  libtask_spinlock_lock(&task->completed_spinlock);
-  while (task->complete == false) {
-    libtask_condition_wait(&task->completed);
+  if (libtask_atomic_load(&task->complete)) {
+    libtask__task_wait_released(task);
+    return 0;
+  }
+  libtask_task_join_t *join = libtask__task_join(task);
+  if (!join) {
+    return ENOMEM;
   }
-  libtask_spinlock_unlock(&task->completed_spinlock);
+
+  libtask_spinlock_lock(&join->spinlock);
+  while (libtask_atomic_load(&task->complete) == false) {
+    libtask_condition_wait(&join->condition);
+  }
+  libtask_spinlock_unlock(&join->spinlock);
+  libtask__task_wait_released(task);
   return 0;
 }
 
 error_t
-libtask__task_suspend()
+libtask_task_wait_timed(libtask_task_t *task, int64_t deadline_usecs)
+{
+  if (libtask_atomic_load(&task->complete)) {
+    libtask__task_wait_released(task);
+    return 0;
+  }
+  libtask_task_join_t *join = libtask__task_join(task);
+  if (!join) {
+    return ENOMEM;
+  }
+
+  error_t error = 0;
+  libtask_spinlock_lock(&join->spinlock);
+  while (libtask_atomic_load(&task->complete) == false && error == 0) {
+    error = libtask_condition_wait_timed(&join->condition, deadline_usecs);
+  }
+  if (libtask_atomic_load(&task->complete)) {
+    error = 0;
+  }
+  libtask_spinlock_unlock(&join->spinlock);
+  if (error == 0) {
+    libtask__task_wait_released(task);
+  }
+  return error;
+}
+
+static error_t
+suspend(bool pinned)
 {
   libtask_task_t *task = libtask_get_task_current();
   if (!task) {
     return EINVAL;
   }
-  return swapcontext(&task->uct_self, &task->uct_thread) == -1 ? errno : 0;
+  if (task->shared) {
+    char *low = (char *)__builtin_frame_address(0) - LIBTASK_SHARED_STACK_SLACK;
+    task->shared_low = low < task->shared->memory ? task->shared->memory : low;
+    task->pinned = pinned;
+  }
+  libtask__context_switch(&task->context_self,
+			  &libtask__get_worker_current()->context);
+  return 0;
+}
+
+error_t
+libtask__task_suspend()
+{
+  return suspend(true);
+}
+
+error_t
+libtask__task_suspend_unpinned()
+{
+  return suspend(false);
 }
 
 void *
@@ -180,41 +547,234 @@ libtask__task_main(libtask_task_t *task)
 {
   libtask_task_pool_t *originating_pool = libtask_get_task_pool_current();
 
-  int result = task->function(task->argument);
-
-  libtask_spinlock_lock(&task->completed_spinlock);
-  task->complete = true;
-  task->result = result;
-  libtask_condition_broadcast(&task->completed);
-  libtask_spinlock_unlock(&task->completed_spinlock);
+  task->result = task->function(task->argument);
+  libtask__task_destroy_specific(task);
 
+  // Waiters are woken up by libtask__task_execute after the task has
+  // left the task-pool for good.
   libtask__task_pool_erase(originating_pool);
   // No task should ever reach here!
   CHECK(0);
   return NULL;
 }
 
+// Copy the used part of a shared stack to the saved buffer of the
+// suspended task that occupies it. Returns false on out of memory.
+static bool
+libtask__shared_stack_save(libtask_shared_stack_t *shared,
+			   libtask_task_t *task)
+{
+  assert(!task->pinned);
+  int32_t nbytes = (int32_t)(shared->memory + shared->nbytes -
+			     task->shared_low);
+  if (nbytes > task->saved_size) {
+    char *saved = (char *)malloc(nbytes);
+    if (!saved) {
+      return false;
+    }
+    free(task->saved);
+    task->saved = saved;
+    task->saved_size = nbytes;
+  }
+  memcpy(task->saved, task->shared_low, nbytes);
+  return true;
+}
+
+// Returns true if a task can take a shared stack, which is when the
+// stack is not busy and its occupant, if it is another task, is not
+// pinned to it. Spinlock of the stack must be held.
+static inline bool
+libtask__shared_stack_available(libtask_shared_stack_t *shared,
+				libtask_task_t *task)
+{
+  libtask_task_t *occupant = shared->occupant;
+  return !shared->busy &&
+    (!occupant || occupant == task || !occupant->pinned);
+}
+
+// Release a shared stack taken by the current thread and wake up the
+// first parked task if it can take the stack now. An occupant pinned
+// to the stack is never parked, because nobody else can take it, so
+// parked tasks wait for the occupant to release it again.
+static void
+libtask__shared_stack_release(libtask_shared_stack_t *shared)
+{
+  libtask_task_t *task = NULL;
+  libtask_spinlock_lock(&shared->spinlock);
+  shared->busy = false;
+  if (shared->parked_head &&
+      libtask__shared_stack_available(shared, shared->parked_head)) {
+    task = shared->parked_head;
+    shared->parked_head = libtask_list_entry(task->inbox_link.next,
+					     libtask_task_t, inbox_link);
+    if (!shared->parked_head) {
+      shared->parked_tail = NULL;
+    }
+    task->inbox_link.next = NULL;
+  }
+  libtask_spinlock_unlock(&shared->spinlock);
+
+  if (task) {
+    libtask__task_pool_wakeup(task->owner, task);
+  }
+}
+
+// Take the shared stack of a task for executing it and bring the
+// task's data back to the stack if another task has used it since.
+//
+// Returns zero on success, EBUSY if the task is parked until the stack
+// is released or ENOMEM if the data of the occupant cannot be saved.
+static error_t
+libtask__shared_stack_enter(libtask_shared_stack_t *shared,
+			    libtask_task_t *task)
+{
+  libtask_spinlock_lock(&shared->spinlock);
+  if (!libtask__shared_stack_available(shared, task)) {
+    assert(task->inboxed == 0);
+    task->inbox_link.next = NULL;
+    if (shared->parked_tail) {
+      shared->parked_tail->inbox_link.next = &task->inbox_link;
+    } else {
+      shared->parked_head = task;
+    }
+    shared->parked_tail = task;
+    libtask_spinlock_unlock(&shared->spinlock);
+    return EBUSY;
+  }
+  shared->busy = true;
+  libtask_task_t *occupant = shared->occupant;
+  libtask_spinlock_unlock(&shared->spinlock);
+
+  if (occupant == task) {
+    return 0;
+  }
+  if (occupant && !libtask__shared_stack_save(shared, occupant)) {
+    libtask__shared_stack_release(shared);
+    return ENOMEM;
+  }
+
+  if (task->shared_low) {
+    memcpy(task->shared_low, task->saved,
+	   shared->memory + shared->nbytes - task->shared_low);
+  } else {
+    libtask__context_initialize(&task->context_self, shared->memory,
+				shared->nbytes,
+				(void (*)(void *))libtask__task_main, task);
+  }
+  shared->occupant = task;
+  return 0;
+}
+
+// Take the stack of a suspended task for executing it. Stack reclaims
+// take the stack with a compare-and-swap too, so resuming needs one
+// only when the stack is reclaimable.
+static inline bool
+libtask__task_acquire(libtask_task_t *task)
+{
+  if (libtask_atomic_load_acquire(&task->state) != LIBTASK_TASK_SUSPENDED) {
+    return false;
+  }
+  if (!task->reclaimable) {
+    task->state = LIBTASK_TASK_RUNNING;
+    return true;
+  }
+  return libtask_atomic_cmpxchg(&task->state, LIBTASK_TASK_SUSPENDED,
+				LIBTASK_TASK_RUNNING) ==
+    LIBTASK_TASK_SUSPENDED;
+}
+
 error_t
 libtask__task_execute(libtask_task_t *task)
 {
   assert(libtask_list_empty(&task->waiting_link));
 
-  // Take a reference to the task and its owner so that they cannot be
-  // destroyed when the task is running.
+  // Task cannot be destroyed before it finishes and its owner cannot
+  // be destroyed while a worker thread of the owner is alive, so
+  // resuming a task takes no references. But, the thread that
+  // executed the task last may still be on its stack or the stack may
+  // be being reclaimed.
+  for (int nspins = 0; !libtask__task_acquire(task);) {
+    if (++nspins < LIBTASK_SPINLOCK_YIELD) {
+      libtask_cpu_relax();
+    } else {
+      sched_yield();
+    }
+  }
   libtask_task_pool_t *owner = task->owner;
-  libtask_task_ref(task);
-  libtask_task_pool_ref(owner);
 
-  // Lock the task's stack.
-  libtask_spinlock_lock(&task->stack_spinlock);
-  CHECK(libtask__set_task_current(task) == 0);
+  // Tasks sharing a stack take turns, so a task whose stack is in use
+  // is parked until the stack is released. On out of memory, it goes
+  // back to the run queue.
+  if (task->shared) {
+    error_t error = libtask__shared_stack_enter(task->shared, task);
+    if (error) {
+      libtask_atomic_store_release(&task->state, LIBTASK_TASK_SUSPENDED);
+      if (error == ENOMEM) {
+	libtask__task_pool_wakeup(owner, task);
+      }
+      return 0;
+    }
+  }
 
-  CHECK(swapcontext(&task->uct_thread, &task->uct_self) == 0);
+  libtask_worker_t *worker = libtask__get_worker_current();
+  assert(worker);
+  libtask__thread.task = task;
+
+  libtask__context_switch(&worker->context, &task->context_self);
+
+  libtask__thread.task = NULL;
+
+  // Task may be resumed by another thread and destroyed as soon as the
+  // stack is released, so it must be the last access to the task.
+  if (task->owner != NULL) {
+    if (task->reclaimable) {
+      task->suspended_usecs = libtask_clock_usecs();
+      task->reclaimed = false;
+    }
+    if (task->shared) {
+      libtask__shared_stack_release(task->shared);
+    }
+    libtask_atomic_store_release(&task->state, LIBTASK_TASK_SUSPENDED);
+    return 0;
+  }
 
-  CHECK(libtask__set_task_current(NULL) == 0);
-  libtask_spinlock_unlock(&task->stack_spinlock);
+  // A task without an owner has finished, so release its stack to the
+  // originating task-pool and wake up the waiters.
+  if (task->painted) {
+    libtask__stack_watermark_record(task->function,
+				    libtask__stack_peak(task->stack,
+							task->nbytes));
+  }
+  if (task->shared) {
+    task->shared->occupant = NULL;
+    libtask__shared_stack_release(task->shared);
+    free(task->saved);
+    task->saved = NULL;
+  } else if (!task->slab || !task->slab->stacks) {
+    libtask__stack_cache_free(&owner->stack_cache, task->stack, task->nbytes);
+  }
+  task->stack = NULL;
 
-  libtask_task_unref(task);
-  libtask_task_pool_unref(owner);
+  // Drop the reference of the task-pool's task list, which is left to
+  // us by libtask__task_pool_erase, before the waiters can see the
+  // task complete. When it is the last one, nobody can wait for the
+  // task and it is destroyed here.
+  if (!libtask_refcount_dec_unless_last(&task->refcount)) {
+    task->state = LIBTASK_TASK_DONE;
+    task->complete = true;
+    libtask_task_unref(task);
+    return 0;
+  }
+
+  // Waiters and the destructor wait for the state, so releasing it is
+  // the last access to the task.
+  libtask_atomic_store(&task->complete, true);
+  libtask_task_join_t *join = libtask_atomic_load(&task->join);
+  if (join) {
+    libtask_spinlock_lock(&join->spinlock);
+    libtask_condition_broadcast(&join->condition);
+    libtask_spinlock_unlock(&join->spinlock);
+  }
+  libtask_atomic_store_release(&task->state, LIBTASK_TASK_DONE);
   return 0;
 }
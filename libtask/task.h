@@ -21,9 +21,9 @@
 #define _LIBTASK_TASK_H_
 
 #include <pthread.h>
-#include <ucontext.h>
 
 #include "libtask/condition.h"
+#include "libtask/context.h"
 #include "libtask/list.h"
 #include "libtask/refcount.h"
 
@@ -49,60 +49,172 @@
 // can switch to another task and return back to the this task when an
 // io thread has finished the "read" operation asynchronously.
 
+// Max. number of task-local storage keys. Every task has a slot for
+// every key, so keys are a scarce resource like pthread keys.
+#define LIBTASK_TASK_KEYS 8
+
+// Max. number of passes over the keys that run the destructors at
+// task completion. A destructor can set a value again, which is
+// destroyed in the next pass.
+#define LIBTASK_TASK_KEY_DESTRUCTOR_PASSES 4
+
+// Values of the state member of a task.
+#define LIBTASK_TASK_SUSPENDED 0
+#define LIBTASK_TASK_RUNNING 1
+#define LIBTASK_TASK_DONE 2
+#define LIBTASK_TASK_RECLAIMING 3
+
+// Shared stacks of a task-pool, their size and the distance below the
+// frame of a suspending task that covers everything the context switch
+// puts on the stack.
+#define LIBTASK_SHARED_STACKS 8
+#define LIBTASK_SHARED_STACK_SIZE (256 * 1024)
+#define LIBTASK_SHARED_STACK_SLACK 512
+
+// A stack that tasks created by libtask_task_create_shared take turns
+// to run on. Busy flag is held by the thread that is executing a task
+// on the stack and the occupant is the suspended task whose data is
+// still on the stack, if any. Tasks that cannot take the stack are
+// parked in FIFO order and are woken up one at a time as the stack is
+// released. A parked task is in no run queue, so it is linked through
+// its inbox_link. Spinlock protects these members.
+typedef struct libtask_shared_stack {
+  libtask_spinlock_t spinlock;
+  bool busy;
+  struct libtask_task *occupant;
+  struct libtask_task *parked_head;
+  struct libtask_task *parked_tail;
+  char *memory;
+  int32_t nbytes;
+} LIBTASK_CACHE_ALIGNED libtask_shared_stack_t;
+
+// Key of a task-local storage slot.
+typedef int32_t libtask_task_key_t;
+
+// Link of a task in the inbox of a task-pool (see task_pool.h).
+typedef struct libtask_inbox_link {
+  struct libtask_inbox_link *volatile next;
+} libtask_inbox_link_t;
+
+// Task control block. Members used on every task switch are packed
+// into the first cache line and the rest are touched only when a task
+// starts, waits, finishes or is inspected. Tasks are cache line
+// aligned, so that tasks of a libtask_task_create_many call don't
+// share the lines.
 typedef struct libtask_task {
-  // Number of references to the task.
+  // Number of references to the task. Heap allocated tasks are freed
+  // through the address of the refcount, so it comes first.
   libtask_refcount_t refcount;
 
-  // Memory for saving and restoring stack contexts. The uct_self
-  // member contains the latest context of the task and the uct_thread
-  // contains the context of the current thread that is executing this
-  // task.  So, a swapcontext(self, thread) returns control back to
-  // the thread where as a swapcontext(thread, self) resumes the task.
-  ucontext_t uct_self;
-  ucontext_t uct_thread;
+  // A task is made runnable before it switches out of its stack, so a
+  // thread in another task-pool may pick the task for execution while
+  // it is still on the stack. State member tells if the stack is in
+  // use; it is set to LIBTASK_TASK_RUNNING by the thread that resumes
+  // the task and is released, as the last access to the task, by the
+  // same thread after the task switches out, so that the next thread
+  // only waits for the release without any locks or references. Stack
+  // reclaims hold the stack in LIBTASK_TASK_RECLAIMING the same way.
+  // Thread that finishes the task releases it as LIBTASK_TASK_DONE
+  // after waking up the waiters, who wait for the release too.
+  volatile int32_t state;
+
+  // Latest context of the task. Switching to it resumes the task and
+  // a suspending task switches back to the context of the worker
+  // thread that is executing it.
+  libtask_context_t context_self;
+
+  // A task is always owned by a task-pool, so that when task yields
+  // the thread, it can be put back in a task-pool for later
+  // execution.
+  struct libtask_task_pool *owner;
+
+  // Runnable tasks are linked into the waiting_list of a task-pool
+  // through the runnable_link. Runnable flag is set when the task is
+  // put in a run queue and is cleared by the thread that claims the
+  // task for execution. A task claimed by libtask_yield_to leaves a
+  // stale entry behind in its run queue, which holds a reference to
+  // the task and is skipped when the flag is already clear.
+  libtask_list_t runnable_link;
+  volatile int32_t runnable;
+
+  // Threads outside of a task-pool put runnable tasks in its inbox
+  // through the inbox_link. Inboxed flag is set while the task is
+  // linked there, so that the task is never linked twice; a second
+  // entry is dropped like a duplicate in the waiting_list.
+  volatile int32_t inboxed;
+  libtask_inbox_link_t inbox_link;
 
   // Every task is created with its own stack. These two members refer
   // to the stack location and the size. Note that different tasks can
-  // have different stack sizes.
-  //
-  // When a task is moved from one task-pool to another, it is
-  // possible that a thread in the destination task-pool may
-  // immediately pick the task for execution. So, we need a lock to
-  // protect concurrent access to the stack.
+  // have different stack sizes. Stacks come from the stack cache of
+  // the originating task-pool and go back to it when task finishes.
   char *stack;
   int32_t nbytes;
-  libtask_spinlock_t stack_spinlock;
+
+  // Task status and the flag that is set when it finishes. Condition
+  // variable to wait for the task to finish is allocated by the first
+  // waiter, because most tasks are never waited for.
+  int result;
+  volatile bool complete;
+  struct libtask_task_join *join;
 
   // These members refer to the task's function definition, its
   // argument.
   void *argument;
   int (*function)(void *);
 
-  // Task status, flags and the condition variable to wait for the
-  // task to finish.
-  int result;
-  bool complete;
-  libtask_condition_t completed;
-  libtask_spinlock_t completed_spinlock;
-
   // Normally, runnable tasks wait in the task-pools and one or more
   // threads pick up tasks from the task-pools for execution. Below
   // two members contain the current task-pool where task is currently
   // waiting.
   libtask_list_t waiting_link;
 
-  // A task is always owned by a task-pool, so that when task yields
-  // the thread, it can be put back in a task-pool for later
-  // execution.
-  struct libtask_task_pool *owner;
-
   // Even though a task migrates between different task-pools during
   // its life time, it is still associated with an originating
   // task-pool for its entire life time. This task-pool is where tasks
   // can be inspected and analyzed for reporting or debugging.
   libtask_list_t originating_pool_link;
 
-} libtask_task_t;
+  // Allocation shared with the other tasks of a
+  // libtask_task_create_many call or NULL.
+  struct libtask_task_slab *slab;
+
+  // Task-pool whose task cache takes the task back when a detached
+  // task is destroyed, or NULL for other tasks. Detached tasks hold a
+  // reference to it.
+  struct libtask_task_pool *recycler;
+
+  // Shared stack of a task created by libtask_task_create_shared or
+  // NULL. When the task suspends, the used part of the stack starts
+  // at shared_low, which is NULL until the task runs for the first
+  // time. It is copied to the saved buffer when another task needs the
+  // stack and back when the task resumes, unless the task is pinned to
+  // the stack because other threads may access data on it while the
+  // task is suspended.
+  libtask_shared_stack_t *shared;
+  char *shared_low;
+  char *saved;
+  int32_t saved_size;
+  bool pinned;
+
+  // Set when unused part of the stack is given back to the system and
+  // cleared when the task runs again. A stack is reclaimable when the
+  // originating task-pool reclaims stacks and the stack is not painted
+  // (see Stack Reclaim in task_pool.h).
+  bool reclaimed;
+  bool reclaimable;
+  bool painted;
+
+  // Task-local storage, which is indexed by the keys. Tasks migrate
+  // between threads, so values that belong to a task cannot be kept in
+  // thread-local variables.
+  void *specific[LIBTASK_TASK_KEYS];
+
+  // Time the task last suspended at, when its stack is reclaimable,
+  // or zero if it has never run.
+  int64_t suspended_usecs;
+
+} LIBTASK_CACHE_ALIGNED libtask_task_t;
 
 // Initialize a task variable (on stack).
 //
@@ -148,6 +260,70 @@ libtask_task_create(libtask_task_t **taskp,
 		    void *argument,
 		    int32_t stack_size);
 
+// Create a batch of tasks on heap. Tasks and their stacks are
+// allocated together and all of them are made runnable with a single
+// hold of the task-pool's spinlock. Memory of the batch is released
+// when the last of its tasks is destroyed, so finished tasks keep
+// their share until then.
+//
+// tasks: Array where pointers to the new tasks are returned.
+//
+// ntasks: Number of tasks to create.
+//
+// arguments: Array of arguments for the function, one for each task,
+// or NULL.
+//
+// Returns zero on success, EINVAL if ntasks or stack_size is not
+// positive and ENOMEM on out of memory.
+error_t
+libtask_task_create_many(libtask_task_t **tasks,
+			 int32_t ntasks,
+			 struct libtask_task_pool *task_pool,
+			 int (*function)(void *),
+			 void **arguments,
+			 int32_t stack_size);
+
+// Create a task that runs on one of the shared stacks of a task-pool
+// instead of a stack of its own. Only the part of the stack it uses is
+// copied out when another task needs the shared stack and copied back
+// when it resumes, so a suspended task costs memory in proportion to
+// its stack usage, which suits large numbers of mostly idle tasks. A
+// task must not use more than LIBTASK_SHARED_STACK_SIZE bytes of stack.
+//
+// Tasks that block in libtask_semaphore_down, libtask_condition_wait,
+// libtask_yield, libtask_yield_to or libtask_task_pool_schedule, and in
+// libtask_semaphore_up when libtask_option_handoff is set, give up the
+// shared stack while they are suspended. Their stack data is copied
+// out and back, so pointers to their local variables must not be used
+// by other tasks or threads across these calls.
+//
+// Other blocking operations keep data on the stack for other threads,
+// so the task holds on to the stack until it resumes. Tasks of a
+// task-pool are spread over its LIBTASK_SHARED_STACKS stacks in
+// creation order, so tasks that happen to share the stack with such a
+// task, about 1/LIBTASK_SHARED_STACKS of all shared tasks of the
+// task-pool, stay parked meanwhile; a task must not wait for them while
+// it holds on to the stack.
+//
+// Returns zero on success and ENOMEM on out of memory.
+error_t
+libtask_task_create_shared(libtask_task_t **taskp,
+			   struct libtask_task_pool *task_pool,
+			   int (*function)(void *),
+			   void *argument);
+
+// Create a detached task, which runs without any reference held by
+// the caller. Its control block and stack go back to the caches of
+// the task-pool as soon as the task finishes, so it cannot be waited
+// for.
+//
+// Returns zero on success and ENOMEM on out of memory.
+error_t
+libtask_task_spawn_detached(struct libtask_task_pool *task_pool,
+			    int (*function)(void *),
+			    void *argument,
+			    int32_t stack_size);
+
 // Take a reference.
 //
 // task: Task whose reference count is incremented.
@@ -171,30 +347,98 @@ libtask_task_unref(libtask_task_t *task) {
   return nref;
 }
 
-// Wait for a task to finish.
+// Wait for a task to finish. When it returns zero, no thread of the
+// library touches the task anymore, so the last reference can be
+// dropped right away.
 //
 // task: Task to wait for.
 //
-// Returns zero.
+// Returns zero when task is finished or ENOMEM on out of memory.
 error_t
 libtask_task_wait(libtask_task_t *task);
 
+// Wait for a task to finish until a deadline.
+//
+// task: Task to wait for.
+//
+// deadline_usecs: Absolute deadline in libtask_clock_usecs time.
+//
+// Returns zero when task is finished, ETIMEDOUT if deadline has
+// passed, ENOMEM on out of memory or an error number if the deadline
+// cannot be set.
+error_t
+libtask_task_wait_timed(libtask_task_t *task, int64_t deadline_usecs);
+
+// Per-thread state of the library, which is private. Initial-exec
+// model makes every access a load relative to the thread pointer, so
+// the current task is found without a call to pthread_getspecific.
+//
+// A task can resume on a different thread after it suspends, so the
+// worker must not be kept across a suspension.
+typedef struct {
+  // Task executed by the thread or NULL.
+  libtask_task_t *task;
+
+  // Worker of the task-pool whose tasks the thread executes or NULL.
+  struct libtask_worker *worker;
+} libtask_thread_t;
+
+extern __thread libtask_thread_t libtask__thread
+  __attribute__((tls_model("initial-exec")));
+
 // Get the current task. Returns NULL when called from outside the
 // task context. Note that if task address has to be stored then, a
 // reference should be taken.
-libtask_task_t *
-libtask_get_task_current(void);
+static inline libtask_task_t *
+libtask_get_task_current(void)
+{
+  return libtask__thread.task;
+}
+
+// Create a task-local storage key. Every task has a NULL value for
+// the new key.
+//
+// keyp: Address where the new key has to be returned.
+//
+// destructor: Function called with the non-NULL value of the key when
+// a task finishes or NULL.
+//
+// Returns zero on success and EAGAIN when all keys are in use.
+error_t
+libtask_task_key_create(libtask_task_key_t *keyp,
+			void (*destructor)(void *));
+
+// Get the value of a key for the current task.
+//
+// Returns the value or NULL when called from outside the task context.
+void *
+libtask_task_getspecific(libtask_task_key_t key);
+
+// Set the value of a key for the current task.
+//
+// Returns zero on success and EINVAL when key is invalid or when
+// called from outside the task context.
+error_t
+libtask_task_setspecific(libtask_task_key_t key, const void *value);
 
 //
 // Private interfaces
 //
 
-// Resume a task.
+// Resume a task. Caller must be a worker thread of the task's owner,
+// which keeps the owner alive while the task runs.
 error_t
 libtask__task_execute(libtask_task_t *task);
 
-// Suspend current task.
+// Suspend current task. A task on a shared stack stays pinned to its
+// stack until it is resumed.
 error_t
 libtask__task_suspend(void);
 
+// Same as above, but for tasks that keep no data on their stack that
+// other threads may access before they are resumed, so the stack of a
+// task on a shared stack can be copied out.
+error_t
+libtask__task_suspend_unpinned(void);
+
 #endif // _LIBTASK_TASK_H_
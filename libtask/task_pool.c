@@ -17,20 +17,127 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //
 
+#include <unistd.h>
+
 #include "libtask/libtask.h"
 #include "libtask/log.h"
 
+#ifdef LIBTASK_IO_URING
+#include "libtask/uring.h"
+#endif
+
+// Number of online processors. Idle threads don't spin on
+// uniprocessors.
+static long num_cpus = 1;
+
+// Pthread once initializations for this module.
+static pthread_once_t pthread_once_control = PTHREAD_ONCE_INIT;
+
+static void
+libtask_task_pool_once()
+{
+  num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+// Reclaim the stacks of the tasks in a window of the task list that
+// are suspended for long enough (see Stack Reclaim in task_pool.h).
+static void
+libtask__task_pool_reclaim(libtask_timer_t *timer)
+{
+  libtask_task_pool_t *task_pool = (libtask_task_pool_t *)timer->argument;
+  int64_t now = libtask_clock_usecs();
+  int64_t cutoff = now - task_pool->reclaim_usecs;
+
+  // Tasks on the list cannot finish while their stacks are held.
+  libtask_task_t *batch[LIBTASK_TASK_POOL_RECLAIM_BATCH];
+  int32_t n = 0;
+  libtask_spinlock_lock(&task_pool->spinlock);
+  for (int32_t i = 0; i < task_pool->ntasks &&
+	 i < LIBTASK_TASK_POOL_RECLAIM_SCAN &&
+	 n < LIBTASK_TASK_POOL_RECLAIM_BATCH; i++) {
+    libtask_list_t *link = libtask_list_pop_front(&task_pool->task_list);
+    libtask_list_push_back(&task_pool->task_list, link);
+    libtask_task_t *task = libtask_list_entry(link, libtask_task_t,
+					      originating_pool_link);
+    if (!task->reclaimable ||
+	libtask_atomic_cmpxchg(&task->state, LIBTASK_TASK_SUSPENDED,
+			       LIBTASK_TASK_RECLAIMING) !=
+	LIBTASK_TASK_SUSPENDED) {
+      continue;
+    }
+    if (!task->reclaimed && task->suspended_usecs != 0 &&
+	task->suspended_usecs <= cutoff) {
+      batch[n++] = task;
+    } else {
+      libtask_atomic_store_release(&task->state, LIBTASK_TASK_SUSPENDED);
+    }
+  }
+  libtask_spinlock_unlock(&task_pool->spinlock);
+
+  for (int32_t i = 0; i < n; i++) {
+    libtask_task_t *task = batch[i];
+    char *sp = libtask__context_stack_pointer(&task->context_self);
+    task_pool->nreclaimed_bytes += libtask__stack_reclaim(task->stack, sp);
+    task->reclaimed = true;
+    libtask_atomic_store_release(&task->state, LIBTASK_TASK_SUSPENDED);
+  }
+  task_pool->nreclaims += n;
+
+  libtask_timer_start(timer, task_pool, now + LIBTASK_TASK_POOL_RECLAIM_USECS);
+}
+
 error_t
 libtask_task_pool_initialize(libtask_task_pool_t *pool)
 {
+  CHECK(pthread_once(&pthread_once_control, libtask_task_pool_once) == 0);
+
   pool->ntasks = 0;
+  pool->nwaiting = 0;
+  pool->nthreads = 0;
+  pool->nidle = 0;
+  pool->nspinning = 0;
+  pool->nwakes = 0;
+  pool->workers = NULL;
   libtask_spinlock_initialize(&pool->spinlock);
   libtask_list_initialize(&pool->task_list);
   libtask_list_initialize(&pool->thread_list);
   libtask_list_initialize(&pool->waiting_list);
+  pool->inbox_stub.next = NULL;
+  pool->inbox_tail = &pool->inbox_stub;
+  pool->inbox_head = &pool->inbox_stub;
+  pool->inbox_draining = 0;
   libtask_condition_initialize(&pool->waiting_condition, &pool->spinlock);
+  libtask_stack_cache_initialize(&pool->stack_cache);
+  libtask_spinlock_initialize(&pool->task_cache_spinlock);
+  libtask_list_initialize(&pool->task_cache);
+  pool->ntask_cache = 0;
+  memset(pool->shared_stacks, 0, sizeof(pool->shared_stacks));
+  for (int i = 0; i < LIBTASK_SHARED_STACKS; i++) {
+    libtask_spinlock_initialize(&pool->shared_stacks[i].spinlock);
+  }
+  pool->nshared = 0;
+  libtask__reactor_initialize(&pool->reactor);
+  libtask__timer_wheel_initialize(&pool->timer_wheel);
 
+  pool->reclaim_usecs = libtask_option_stack_mmap ?
+    (int64_t)libtask_option_stack_reclaim_msecs * 1000 : 0;
+  pool->nreclaims = 0;
+  pool->nreclaimed_bytes = 0;
+  libtask_timer_initialize(&pool->reclaim_timer, libtask__task_pool_reclaim,
+			   pool);
   libtask_refcount_initialize(&pool->refcount);
+
+  // Reclaim timer is started last, so that the task-pool is complete
+  // when it has to be finalized because the reactor cannot be opened.
+  if (pool->reclaim_usecs > 0) {
+    error_t error = libtask_timer_start(&pool->reclaim_timer, pool,
+					libtask_clock_usecs() +
+					LIBTASK_TASK_POOL_RECLAIM_USECS);
+    if (error) {
+      libtask_task_pool_finalize(pool);
+      return error;
+    }
+  }
   return 0;
 }
 
@@ -41,7 +148,42 @@ libtask_task_pool_finalize(libtask_task_pool_t *pool)
   assert(libtask_list_empty(&pool->task_list));
   assert(libtask_list_empty(&pool->waiting_list));
   assert(libtask_list_empty(&pool->thread_list));
+  assert(pool->inbox_tail == &pool->inbox_stub);
+  assert(pool->inbox_head == &pool->inbox_stub);
 
+  while (pool->workers) {
+    libtask_worker_t *worker = pool->workers;
+    assert(worker->active == false);
+    assert(worker->head == worker->tail);
+    pool->workers = worker->next;
+#ifdef LIBTASK_IO_URING
+    if (worker->uring) {
+      libtask__uring_destroy(worker->uring);
+    }
+#endif
+    free(worker);
+  }
+
+  libtask_timer_cancel(&pool->reclaim_timer);
+  libtask_timer_finalize(&pool->reclaim_timer);
+  libtask__timer_wheel_finalize(&pool->timer_wheel);
+  libtask__reactor_finalize(&pool->reactor);
+  libtask_list_t *link;
+  while ((link = libtask_list_pop_front(&pool->task_cache))) {
+    free(libtask_list_entry(link, libtask_task_t, originating_pool_link));
+  }
+  libtask_spinlock_finalize(&pool->task_cache_spinlock);
+  for (int i = 0; i < LIBTASK_SHARED_STACKS; i++) {
+    libtask_shared_stack_t *shared = &pool->shared_stacks[i];
+    assert(shared->occupant == NULL);
+    assert(shared->parked_head == NULL);
+    if (shared->memory) {
+      libtask__stack_cache_free(&pool->stack_cache, shared->memory,
+				shared->nbytes);
+    }
+    libtask_spinlock_finalize(&shared->spinlock);
+  }
+  libtask_stack_cache_finalize(&pool->stack_cache);
   libtask_condition_finalize(&pool->waiting_condition);
   libtask_spinlock_finalize(&pool->spinlock);
   return 0;
@@ -50,11 +192,12 @@ libtask_task_pool_finalize(libtask_task_pool_t *pool)
 error_t
 libtask_task_pool_create(libtask_task_pool_t **new_poolp)
 {
-  libtask_task_pool_t *pool =
-    (libtask_task_pool_t *) calloc(sizeof(libtask_task_pool_t), 1);
+  libtask_task_pool_t *pool = (libtask_task_pool_t *)
+    libtask__cache_aligned_malloc(sizeof(libtask_task_pool_t));
   if (!pool) {
     return ENOMEM;
   }
+  memset(pool, 0, sizeof(*pool));
 
   error_t error = libtask_task_pool_initialize(pool);
   if (error) {
@@ -67,6 +210,339 @@ libtask_task_pool_create(libtask_task_pool_t **new_poolp)
   return 0;
 }
 
+//
+// Local run queues.
+//
+
+// Push a task at the tail of a worker's local queue. Must be called
+// only by the owner thread. Returns false if the queue is full.
+static inline bool
+libtask__worker_push(libtask_worker_t *worker, libtask_task_t *task)
+{
+  uint32_t head = libtask_atomic_load_acquire(&worker->head);
+  uint32_t tail = worker->tail;
+  if (tail - head >= LIBTASK_WORKER_QUEUE_SIZE) {
+    return false;
+  }
+  libtask_atomic_store_relaxed(
+    &worker->queue[tail % LIBTASK_WORKER_QUEUE_SIZE], task);
+  libtask_atomic_store_release(&worker->tail, tail + 1);
+  return true;
+}
+
+// Pop a task from the head of a worker's local queue. Must be called
+// only by the owner thread. Returns NULL if the queue is empty.
+static inline libtask_task_t *
+libtask__worker_pop(libtask_worker_t *worker)
+{
+  while (true) {
+    uint32_t head = libtask_atomic_load_acquire(&worker->head);
+    uint32_t tail = worker->tail;
+    if (head == tail) {
+      return NULL;
+    }
+    libtask_task_t *task = libtask_atomic_load_relaxed(
+      &worker->queue[head % LIBTASK_WORKER_QUEUE_SIZE]);
+    if (libtask_atomic_cmpxchg(&worker->head, head, head + 1) == head) {
+      return task;
+    }
+  }
+}
+
+// Grab half of the tasks from the head of a victim's local queue into
+// the batch. Returns the number of tasks taken.
+static uint32_t
+libtask__worker_grab(libtask_worker_t *victim, libtask_task_t **batch)
+{
+  while (true) {
+    uint32_t head = libtask_atomic_load_acquire(&victim->head);
+    uint32_t tail = libtask_atomic_load_acquire(&victim->tail);
+    uint32_t n = tail - head;
+    n = n - n / 2;
+    if (n == 0) {
+      return 0;
+    }
+    if (n > LIBTASK_WORKER_QUEUE_SIZE / 2) {
+      // Head and tail were read at different times.
+      continue;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+      batch[i] = libtask_atomic_load_relaxed(
+	&victim->queue[(head + i) % LIBTASK_WORKER_QUEUE_SIZE]);
+    }
+    if (libtask_atomic_cmpxchg(&victim->head, head, head + n) == head) {
+      return n;
+    }
+  }
+}
+
+// Steal half of the tasks from a victim into the thief's local queue,
+// which must be empty. Returns one of the stolen tasks or NULL.
+static libtask_task_t *
+libtask__worker_steal(libtask_worker_t *thief, libtask_worker_t *victim)
+{
+  libtask_task_t *batch[LIBTASK_WORKER_QUEUE_SIZE / 2];
+  uint32_t n = libtask__worker_grab(victim, batch);
+  if (n == 0) {
+    return NULL;
+  }
+  for (uint32_t i = 1; i < n; i++) {
+    CHECK(libtask__worker_push(thief, batch[i]));
+  }
+  return batch[0];
+}
+
+//
+// Inbox.
+//
+
+// Append a link at the tail of the inbox. Safe to call from any
+// thread.
+static inline void
+libtask__inbox_append(libtask_task_pool_t *task_pool,
+		      libtask_inbox_link_t *link)
+{
+  libtask_atomic_store_relaxed(&link->next, NULL);
+  libtask_inbox_link_t *prev =
+    libtask_atomic_exchange_acq_rel(&task_pool->inbox_tail, link);
+  // Consumer cannot see the link until this store, so it treats the
+  // inbox as busy in between.
+  libtask_atomic_store_release(&prev->next, link);
+}
+
+// Take the task at the head of the inbox. Caller must have set the
+// draining flag. Returns NULL when inbox is empty or a producer is
+// yet to finish linking the next task.
+static libtask_task_t *
+libtask__inbox_take(libtask_task_pool_t *task_pool)
+{
+  libtask_inbox_link_t *stub = &task_pool->inbox_stub;
+  libtask_inbox_link_t *head = task_pool->inbox_head;
+  libtask_inbox_link_t *next = libtask_atomic_load_acquire(&head->next);
+  if (head == stub) {
+    if (!next) {
+      return NULL;
+    }
+    task_pool->inbox_head = head = next;
+    next = libtask_atomic_load_acquire(&head->next);
+  }
+  if (!next) {
+    // Head is the last link, which can be taken only after the stub
+    // is put behind it.
+    if (libtask_atomic_load_acquire(&task_pool->inbox_tail) != head) {
+      return NULL;
+    }
+    libtask__inbox_append(task_pool, stub);
+    next = libtask_atomic_load_acquire(&head->next);
+    if (!next) {
+      return NULL;
+    }
+  }
+  task_pool->inbox_head = next;
+  libtask_task_t *task = libtask_list_entry(head, libtask_task_t, inbox_link);
+  // A new entry for the task is allowed from now on.
+  libtask_atomic_store(&task->inboxed, 0);
+  return task;
+}
+
+// Returns true if the inbox may have tasks.
+static inline bool
+libtask__inbox_busy(libtask_task_pool_t *task_pool)
+{
+  return libtask_atomic_load(&task_pool->inbox_tail) !=
+    &task_pool->inbox_stub ||
+    libtask_atomic_load(&task_pool->inbox_head) != &task_pool->inbox_stub;
+}
+
+// Put a runnable task in the inbox. A task that is in the inbox
+// already is not linked again and the reference of the new entry is
+// dropped as in libtask__task_pool_push_locked.
+static void
+libtask__inbox_push(libtask_task_pool_t *task_pool, libtask_task_t *task)
+{
+  if (libtask_atomic_cmpxchg(&task->inboxed, 0, 1) != 0) {
+    libtask_task_unref(task);
+    return;
+  }
+  libtask__inbox_append(task_pool, &task->inbox_link);
+}
+
+// Move a batch of tasks from the inbox into the worker's local queue,
+// which must be empty. Returns the first task of the batch or NULL if
+// inbox is empty or another worker is draining it.
+static libtask_task_t *
+libtask__worker_drain(libtask_worker_t *worker)
+{
+  libtask_task_pool_t *task_pool = worker->task_pool;
+  if (!libtask__inbox_busy(task_pool) ||
+      libtask_atomic_cmpxchg(&task_pool->inbox_draining, 0, 1) != 0) {
+    return NULL;
+  }
+
+  libtask_task_t *first = libtask__inbox_take(task_pool);
+  if (first) {
+    libtask_task_t *task;
+    for (int32_t i = 1; i < LIBTASK_WORKER_QUEUE_SIZE / 2 &&
+	   (task = libtask__inbox_take(task_pool)); i++) {
+      CHECK(libtask__worker_push(worker, task));
+    }
+  }
+  libtask_atomic_store_release(&task_pool->inbox_draining, 0);
+  return first;
+}
+
+// Wake up one thread sleeping on the task-pool or, when there is no
+// such thread, the idle thread blocked in the reactor. Task-pool
+// spinlock must be held.
+static inline void
+libtask__task_pool_signal(libtask_task_pool_t *task_pool)
+{
+  libtask_reactor_t *reactor = &task_pool->reactor;
+  if (task_pool->nidle > (reactor->blocked ? 1 : 0)) {
+    libtask_condition_signal(&task_pool->waiting_condition);
+    task_pool->nwakes++;
+  } else if (reactor->blocked) {
+    libtask__reactor_interrupt(reactor);
+    task_pool->nwakes++;
+  }
+}
+
+// Wake up one idle thread of the task-pool, if any and if no thread
+// is spinning for tasks.
+static inline void
+libtask__task_pool_notify(libtask_task_pool_t *task_pool)
+{
+  // Order the queue updates before reading the idle counts; pairs
+  // with the idle checks in libtask__worker_spin and
+  // libtask__task_pool_main.
+  libtask_atomic_fence();
+  if (libtask_atomic_load(&task_pool->nspinning) > 0) {
+    return;
+  }
+  if (libtask_atomic_load(&task_pool->nidle) > 0) {
+    libtask_spinlock_lock(&task_pool->spinlock);
+    libtask__task_pool_signal(task_pool);
+    libtask_spinlock_unlock(&task_pool->spinlock);
+  }
+}
+
+// Link a run queue entry of a task into the task-pool's waiting_list.
+// Stale entries and entries of tasks that are linked already are
+// dropped along with their reference. Task-pool spinlock must be
+// held.
+static void
+libtask__task_pool_push_locked(libtask_task_pool_t *task_pool,
+			       libtask_task_t *task)
+{
+  if (!libtask_atomic_load(&task->runnable) ||
+      !libtask_list_empty(&task->runnable_link)) {
+    libtask_task_unref(task);
+    return;
+  }
+  libtask_list_push_back(&task_pool->waiting_list, &task->runnable_link);
+  task_pool->nwaiting++;
+  if (task_pool->nidle > 0 && libtask_atomic_load(&task_pool->nspinning) == 0) {
+    libtask__task_pool_signal(task_pool);
+  }
+}
+
+void
+libtask__task_pool_wakeup_locked(libtask_task_pool_t *task_pool,
+				 libtask_task_t *task)
+{
+  assert(libtask_spinlock_status(&task_pool->spinlock) == false);
+  libtask_atomic_store(&task->runnable, 1);
+  libtask__task_pool_push_locked(task_pool, task);
+}
+
+// Local queue is full, so move half of it along with the task into
+// the task-pool's waiting_list.
+static void
+libtask__worker_overflow(libtask_worker_t *worker, libtask_task_t *task)
+{
+  libtask_task_pool_t *task_pool = worker->task_pool;
+  libtask_task_t *batch[LIBTASK_WORKER_QUEUE_SIZE / 2];
+  uint32_t n = libtask__worker_grab(worker, batch);
+
+  libtask_spinlock_lock(&task_pool->spinlock);
+  for (uint32_t i = 0; i < n; i++) {
+    libtask__task_pool_push_locked(task_pool, batch[i]);
+  }
+  libtask__task_pool_push_locked(task_pool, task);
+  libtask_spinlock_unlock(&task_pool->spinlock);
+}
+
+void
+libtask__task_pool_wakeup(libtask_task_pool_t *task_pool,
+			  libtask_task_t *task)
+{
+  libtask_atomic_store(&task->runnable, 1);
+  libtask_worker_t *worker = libtask__get_worker_current();
+  if (worker && worker->task_pool == task_pool) {
+    if (libtask__worker_push(worker, task)) {
+      libtask__task_pool_notify(task_pool);
+    } else {
+      libtask__worker_overflow(worker, task);
+    }
+    return;
+  }
+
+  libtask__inbox_push(task_pool, task);
+  libtask__task_pool_notify(task_pool);
+}
+
+// Switch the current thread from the current task to a task that is
+// in no run queue. Current task is put back in the local queue.
+static void
+libtask__worker_handoff(libtask_worker_t *worker,
+			libtask_task_t *current,
+			libtask_task_t *task)
+{
+  assert(worker->handoff == NULL);
+  worker->handoff = task;
+  libtask__task_pool_wakeup(worker->task_pool, current);
+  libtask__task_suspend_unpinned();
+}
+
+void
+libtask__task_pool_handoff(libtask_task_t *task)
+{
+  libtask_task_t *current = libtask_get_task_current();
+  libtask_worker_t *worker = libtask__get_worker_current();
+  if (!current || !worker || worker->task_pool != task->owner) {
+    libtask__task_pool_wakeup(task->owner, task);
+    return;
+  }
+  libtask__worker_handoff(worker, current, task);
+}
+
+error_t
+libtask_yield_to(libtask_task_t *task)
+{
+  libtask_task_t *current = libtask_get_task_current();
+  libtask_worker_t *worker = libtask__get_worker_current();
+  if (!current || !worker || task == current ||
+      libtask_atomic_load(&task->owner) != worker->task_pool) {
+    return EINVAL;
+  }
+
+  // Claim the task from its run queue, where the entry is left behind
+  // with a reference to the task.
+  if (libtask_atomic_cmpxchg(&task->runnable, 1, 0) != 1) {
+    return EAGAIN;
+  }
+  libtask_task_ref(task);
+
+  // Task may have moved to another task-pool since its owner was
+  // checked, so give it back to its owner.
+  if (libtask_atomic_load(&task->owner) != worker->task_pool) {
+    libtask__task_pool_wakeup(task->owner, task);
+    return EAGAIN;
+  }
+  libtask__worker_handoff(worker, current, task);
+  return 0;
+}
+
 void
 libtask__task_pool_insert(libtask_task_pool_t *task_pool,
 			  libtask_task_t *task)
@@ -75,22 +551,75 @@ libtask__task_pool_insert(libtask_task_pool_t *task_pool,
 
   libtask_spinlock_lock(&task_pool->spinlock);
   task_pool->ntasks++;
-  libtask_task_ref(task);
+  if (!task->recycler) {
+    libtask_task_ref(task);
+  }
   libtask_task_pool_ref(task_pool);
   libtask_list_push_back(&task_pool->task_list, &task->originating_pool_link);
-
   task->owner = libtask_task_pool_ref(task_pool);
-  libtask_list_push_back(&task_pool->waiting_list, &task->waiting_link);
-  libtask_condition_signal(&task_pool->waiting_condition);
+  libtask_spinlock_unlock(&task_pool->spinlock);
+
+  libtask__task_pool_wakeup(task_pool, task);
+}
+
+void
+libtask__task_pool_insert_many(libtask_task_pool_t *task_pool,
+			       libtask_task_t **tasks, int32_t ntasks)
+{
+  libtask_spinlock_lock(&task_pool->spinlock);
+  for (int32_t i = 0; i < ntasks; i++) {
+    libtask_task_t *task = tasks[i];
+    assert(libtask_list_empty(&task->originating_pool_link));
+    task_pool->ntasks++;
+    libtask_task_ref(task);
+    libtask_task_pool_ref(task_pool);
+    libtask_list_push_back(&task_pool->task_list,
+			   &task->originating_pool_link);
+    task->owner = libtask_task_pool_ref(task_pool);
+
+    task->runnable = 1;
+    libtask_list_push_back(&task_pool->waiting_list, &task->runnable_link);
+  }
+  task_pool->nwaiting += ntasks;
+
+  // Wake up no more sleeping threads than there are new tasks.
+  int32_t nwakes = task_pool->nidle < ntasks ? task_pool->nidle : ntasks;
+  if (libtask_atomic_load(&task_pool->nspinning) > 0) {
+    nwakes--;
+  }
+  for (int32_t i = 0; i < nwakes; i++) {
+    libtask__task_pool_signal(task_pool);
+  }
   libtask_spinlock_unlock(&task_pool->spinlock);
 }
 
+error_t
+libtask__task_pool_shared_stack(libtask_task_pool_t *task_pool,
+				libtask_shared_stack_t **sharedp)
+{
+  error_t error = 0;
+  libtask_spinlock_lock(&task_pool->spinlock);
+  libtask_shared_stack_t *shared =
+    &task_pool->shared_stacks[task_pool->nshared % LIBTASK_SHARED_STACKS];
+  if (!shared->memory) {
+    error = libtask__stack_cache_allocate(&task_pool->stack_cache,
+					  LIBTASK_SHARED_STACK_SIZE,
+					  &shared->memory, &shared->nbytes);
+  }
+  if (!error) {
+    task_pool->nshared++;
+    *sharedp = shared;
+  }
+  libtask_spinlock_unlock(&task_pool->spinlock);
+  return error;
+}
+
 void
 libtask__task_pool_erase(libtask_task_pool_t *task_pool)
 {
   libtask_task_t *task = libtask_get_task_current();
   assert(task);
-  assert(task->complete);
+  assert(task->complete == false);
 
   if (task->owner != task_pool) {
     libtask_task_pool_schedule(task_pool);
@@ -99,8 +628,9 @@ libtask__task_pool_erase(libtask_task_pool_t *task_pool)
   libtask_spinlock_lock(&task_pool->spinlock);
   task_pool->ntasks--;
   libtask_list_erase(&task->originating_pool_link);
-  libtask_task_unref(task);
   libtask_task_pool_unref(task_pool);
+  // Reference of the task list to the task is dropped by
+  // libtask__task_execute after the task leaves its stack.
   libtask_spinlock_unlock(&task_pool->spinlock);
 
   libtask_task_pool_unref(task->owner);
@@ -122,68 +652,435 @@ libtask_task_pool_schedule(libtask_task_pool_t *task_pool)
     current_task->owner = libtask_task_pool_ref(task_pool);
   }
 
-  libtask_spinlock_lock(&task_pool->spinlock);
-  libtask_list_push_back(&task_pool->waiting_list,
-			 &current_task->waiting_link);
-  libtask_condition_signal(&task_pool->waiting_condition);
-  libtask_spinlock_unlock(&task_pool->spinlock);
-
-  libtask__task_suspend();
+  libtask__task_pool_wakeup(task_pool, current_task);
+  libtask__task_suspend_unpinned();
   return 0;
 }
 
-static error_t
-libtask__task_pool_run(libtask_task_pool_t *task_pool)
+// Pop a task from the task-pool's waiting_list and move a fair share
+// of the remaining tasks into the worker's local queue.
+static libtask_task_t *
+libtask__task_pool_pop(libtask_task_pool_t *task_pool,
+		       libtask_worker_t *worker,
+		       bool batch)
 {
-  assert(libtask_spinlock_status(&task_pool->spinlock) == false);
-
-  if (libtask_list_empty(&task_pool->waiting_list)) {
-    return ENOENT;
+  if (libtask_atomic_load(&task_pool->nwaiting) == 0) {
+    return NULL;
   }
 
+  libtask_spinlock_lock(&task_pool->spinlock);
   libtask_list_t *link = libtask_list_pop_front(&task_pool->waiting_list);
-  libtask_task_t *task = libtask_list_entry(link, libtask_task_t,
-					    waiting_link);
+  if (!link) {
+    libtask_spinlock_unlock(&task_pool->spinlock);
+    return NULL;
+  }
+  task_pool->nwaiting--;
 
+  int32_t n = batch ? task_pool->nwaiting / task_pool->nthreads : 0;
+  if (n > LIBTASK_WORKER_QUEUE_SIZE / 2) {
+    n = LIBTASK_WORKER_QUEUE_SIZE / 2;
+  }
+  for (int32_t i = 0; i < n; i++) {
+    libtask_list_t *next = libtask_list_front(&task_pool->waiting_list);
+    libtask_task_t *task = libtask_list_entry(next, libtask_task_t,
+					      runnable_link);
+    if (!libtask__worker_push(worker, task)) {
+      break;
+    }
+    libtask_list_erase(next);
+    task_pool->nwaiting--;
+  }
   libtask_spinlock_unlock(&task_pool->spinlock);
-  libtask__task_execute(task);
+  return libtask_list_entry(link, libtask_task_t, runnable_link);
+}
+
+// Returns true if an idle thread has to wait in the reactor for
+// events or timers.
+static inline bool
+libtask__task_pool_waiting(libtask_task_pool_t *task_pool)
+{
+  return libtask_atomic_load(&task_pool->reactor.nwaiters) > 0 ||
+    libtask_atomic_load(&task_pool->timer_wheel.ntimers) > 0;
+}
+
+// Poll the reactor and make the tasks with events runnable. Idle
+// threads block in the reactor until the next timer deadline, where
+// they are counted in nidle, and busy threads only check it.
+// Task-pool spinlock must be held and is released.
+static void
+libtask__worker_poll(libtask_worker_t *worker, bool block)
+{
+  libtask_task_pool_t *task_pool = worker->task_pool;
+  libtask_reactor_t *reactor = &task_pool->reactor;
+  assert(reactor->polling == false);
+
+  reactor->polling = true;
+  reactor->blocked = block;
+  libtask_spinlock_unlock(&task_pool->spinlock);
+
+  // Timeout is computed after the blocked flag is set, so a new
+  // earlier timer either is seen here or interrupts the poll.
+  int timeout = 0;
+  if (block) {
+    timeout = libtask__timer_wheel_timeout(&task_pool->timer_wheel);
+  }
+  libtask_task_t *tasks[LIBTASK_REACTOR_BATCH];
+  int ntasks = libtask__reactor_poll(reactor, timeout, tasks);
+
   libtask_spinlock_lock(&task_pool->spinlock);
-  return 0;
+  reactor->polling = false;
+  reactor->blocked = false;
+  if (block) {
+    libtask_atomic_sub(&task_pool->nidle, 1);
+  }
+  // Hand over the reactor to a sleeping thread, if any, because this
+  // thread is going to be busy.
+  if (task_pool->nidle > 0 && libtask__task_pool_waiting(task_pool)) {
+    libtask_condition_signal(&task_pool->waiting_condition);
+    task_pool->nwakes++;
+  }
+  libtask_spinlock_unlock(&task_pool->spinlock);
+
+  for (int i = 0; i < ntasks; i++) {
+    libtask__task_pool_wakeup(task_pool, tasks[i]);
+  }
+  libtask__timer_wheel_run(&task_pool->timer_wheel);
 }
 
-typedef struct {
-  libtask_list_t link;
-  pthread_t pthread;
-} thread_entry_t;
+#ifdef LIBTASK_IO_URING
+// Submit the io operations queued by the last task and make the tasks
+// with completed operations runnable.
+static void
+libtask__worker_uring(libtask_worker_t *worker)
+{
+  libtask_uring_t *uring = worker->uring;
+  libtask__uring_submit(uring);
+  if (!libtask__uring_ready(uring)) {
+    return;
+  }
+
+  libtask_task_t *tasks[LIBTASK_REACTOR_BATCH];
+  int ntasks = libtask__uring_reap(uring, tasks, LIBTASK_REACTOR_BATCH);
+  libtask_atomic_sub(&worker->task_pool->reactor.nwaiters, ntasks);
+  for (int i = 0; i < ntasks; i++) {
+    libtask__task_pool_wakeup(worker->task_pool, tasks[i]);
+  }
+}
+#endif
+
+// Claim a task taken from a run queue for execution. Returns false
+// for a stale entry, whose reference to the task is dropped.
+static inline bool
+libtask__task_claim(libtask_task_t *task)
+{
+  if (libtask_atomic_cmpxchg(&task->runnable, 1, 0) == 1) {
+    return true;
+  }
+  libtask_task_unref(task);
+  return false;
+}
+
+// Find the next task for a worker to execute: from its local queue,
+// the task-pool's waiting_list or by stealing from other workers.
+static libtask_task_t *
+libtask__worker_next(libtask_worker_t *worker)
+{
+  libtask_task_pool_t *task_pool = worker->task_pool;
+  libtask_reactor_t *reactor = &task_pool->reactor;
+  libtask_task_t *task = NULL;
+
+  // Check the inbox and the waiting_list once in a while, so that
+  // tasks in there are not starved by the tasks in the local queue.
+  // Timers are checked too and so is the reactor when no thread is idle
+  // to poll it.
+  if (++worker->ntick % LIBTASK_WORKER_CHECK_INTERVAL == 0) {
+    libtask__timer_wheel_run(&task_pool->timer_wheel);
+    if (libtask_atomic_load(&reactor->nwaiters) > 0 &&
+	libtask_atomic_load(&task_pool->nidle) == 0) {
+      libtask_spinlock_lock(&task_pool->spinlock);
+      if (!reactor->polling) {
+	libtask__worker_poll(worker, false);
+      } else {
+	libtask_spinlock_unlock(&task_pool->spinlock);
+      }
+    }
+    if ((task = libtask__task_pool_pop(task_pool, worker, false))) {
+      return task;
+    }
+    if (worker->head == worker->tail &&
+	(task = libtask__worker_drain(worker))) {
+      return task;
+    }
+  }
+
+  if ((task = libtask__worker_pop(worker)) ||
+      (task = libtask__worker_drain(worker)) ||
+      (task = libtask__task_pool_pop(task_pool, worker, true))) {
+    return task;
+  }
+
+  // Steal from other workers starting after the current one.
+  libtask_worker_t *victim = worker;
+  while (true) {
+    victim = libtask_atomic_load_acquire(&victim->next);
+    if (!victim) {
+      victim = libtask_atomic_load_acquire(&task_pool->workers);
+    }
+    if (victim == worker) {
+      return NULL;
+    }
+    if ((task = libtask__worker_steal(worker, victim))) {
+      return task;
+    }
+  }
+}
+
+// Spin looking for tasks with backoff before the thread goes to
+// sleep. Spinning is limited to half of the busy threads, so that
+// idle threads don't burn the processors busy threads need. Returns
+// a task or NULL when the spin budget runs out.
+static libtask_task_t *
+libtask__worker_spin(libtask_worker_t *worker)
+{
+  libtask_task_pool_t *task_pool = worker->task_pool;
+  int32_t max_usecs = libtask_option_max_spin_usecs;
+  if (max_usecs <= 0 || num_cpus <= 1) {
+    return NULL;
+  }
+  int32_t nspinning = libtask_atomic_load(&task_pool->nspinning);
+  int32_t nbusy = libtask_atomic_load(&task_pool->nthreads) -
+    libtask_atomic_load(&task_pool->nidle);
+  if (nspinning > 0 && 2 * nspinning >= nbusy) {
+    return NULL;
+  }
+  libtask_atomic_add(&task_pool->nspinning, 1);
+
+  if (worker->spin_usecs <= 0 || worker->spin_usecs > max_usecs) {
+    worker->spin_usecs = max_usecs;
+  }
+  int64_t start_usecs = libtask_clock_usecs();
+  int64_t deadline_usecs = start_usecs + worker->spin_usecs;
+
+  libtask_task_t *task = NULL;
+  uint32_t backoff = 1;
+  while (!libtask_atomic_load(&worker->stop)) {
+    for (uint32_t i = 0; i < backoff; i++) {
+      libtask_cpu_relax();
+    }
+    if (backoff < 64) {
+      backoff *= 2;
+    }
+    if ((task = libtask__worker_next(worker))) {
+      break;
+    }
+    if (libtask_clock_usecs() >= deadline_usecs) {
+      break;
+    }
+  }
+
+  worker->nspins++;
+  worker->spin_usecs_total += libtask_clock_usecs() - start_usecs;
+  if (task) {
+    worker->nspins_found++;
+    worker->spin_usecs = worker->spin_usecs * 2;
+  } else {
+    worker->spin_usecs = worker->spin_usecs / 2;
+  }
+  if (worker->spin_usecs < 1) {
+    worker->spin_usecs = 1;
+  }
+
+  // Last spinning thread that finds a task wakes up a sleeping one,
+  // because notifications are skipped while threads are spinning and
+  // more tasks may be waiting.
+  if (libtask_atomic_sub(&task_pool->nspinning, 1) == 0 && task) {
+    libtask__task_pool_notify(task_pool);
+  }
+  return task;
+}
+
+// Returns true if any task is waiting for execution in the
+// task-pool. Task-pool spinlock must be held.
+static bool
+libtask__task_pool_busy(libtask_task_pool_t *task_pool)
+{
+  if (!libtask_list_empty(&task_pool->waiting_list) ||
+      libtask__inbox_busy(task_pool)) {
+    return true;
+  }
+  for (libtask_worker_t *worker = task_pool->workers; worker;
+       worker = worker->next) {
+    if (libtask_atomic_load(&worker->head) !=
+	libtask_atomic_load(&worker->tail)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Get a worker for the current thread. Task-pool spinlock must be
+// held.
+static libtask_worker_t *
+libtask__worker_attach(libtask_task_pool_t *task_pool)
+{
+  libtask_worker_t *worker = task_pool->workers;
+  while (worker && worker->active) {
+    worker = worker->next;
+  }
+  if (!worker) {
+    worker = (libtask_worker_t *)calloc(sizeof(libtask_worker_t), 1);
+    CHECK(worker);
+    worker->task_pool = task_pool;
+    worker->next = task_pool->workers;
+    libtask_atomic_store_release(&task_pool->workers, worker);
+  }
+  worker->active = true;
+  worker->stop = false;
+  worker->handoff = NULL;
+  worker->pthread = pthread_self();
+  libtask_list_initialize(&worker->link);
+  libtask_list_push_back(&task_pool->thread_list, &worker->link);
+  task_pool->nthreads++;
+  return worker;
+}
+
+// Release the current thread's worker. Task-pool spinlock must be
+// held.
+static void
+libtask__worker_detach(libtask_worker_t *worker)
+{
+  libtask_task_pool_t *task_pool = worker->task_pool;
+  assert(worker->handoff == NULL);
+
+  // Leftover tasks in the local queue are given to other threads.
+  libtask_task_t *task;
+  while ((task = libtask__worker_pop(worker))) {
+    libtask__task_pool_push_locked(task_pool, task);
+  }
+
+  assert(libtask_list_empty(&worker->link));
+  task_pool->nthreads--;
+  worker->active = false;
+
+  // Stale entries hold references to their tasks, which may have
+  // finished, so the last thread drops them from the waiting_list
+  // after moving the inbox in there.
+  if (task_pool->nthreads == 0) {
+    while (libtask_atomic_cmpxchg(&task_pool->inbox_draining, 0, 1) != 0) {
+      libtask_cpu_relax();
+    }
+    while (libtask__inbox_busy(task_pool)) {
+      if ((task = libtask__inbox_take(task_pool))) {
+	libtask__task_pool_push_locked(task_pool, task);
+      }
+    }
+    libtask_atomic_store_release(&task_pool->inbox_draining, 0);
+
+    libtask_list_t *iter = task_pool->waiting_list.next;
+    while (iter != &task_pool->waiting_list) {
+      task = libtask_list_entry(iter, libtask_task_t, runnable_link);
+      iter = iter->next;
+      if (!libtask_atomic_load(&task->runnable)) {
+	libtask_list_erase(&task->runnable_link);
+	task_pool->nwaiting--;
+	libtask_task_unref(task);
+      }
+    }
+  }
+}
 
 void *
 libtask__task_pool_main(void *arg_)
 {
   libtask_task_pool_t *task_pool = (libtask_task_pool_t *)arg_;
 
-  thread_entry_t entry;
-  entry.pthread = pthread_self();
-  libtask_list_initialize(&entry.link);
-
-  // Enqueue the current thread into task-pool's thread list and keep
-  // executing tasks from the task-pool until somebody signals to stop
-  // by unlinking from the thread list.
+  // Attach a worker to the current thread and keep executing tasks
+  // from the task-pool until somebody signals to stop by unlinking
+  // from the thread list.
 
   libtask_spinlock_lock(&task_pool->spinlock);
-  libtask_list_push_back(&task_pool->thread_list, &entry.link);
-  while (!libtask_list_empty(&entry.link)) {
-    if (libtask_list_empty(&task_pool->waiting_list)) {
+  libtask_worker_t *worker = libtask__worker_attach(task_pool);
+  libtask_spinlock_unlock(&task_pool->spinlock);
+  libtask__thread.worker = worker;
+
+  while (true) {
+    // Task handed off the thread to comes first, even when the thread
+    // is asked to stop, because it is in no run queue. Tasks from the
+    // run queues must be claimed.
+    libtask_task_t *task = worker->handoff;
+    worker->handoff = NULL;
+    if (!task) {
+      if (libtask_atomic_load(&worker->stop)) {
+	libtask_spinlock_lock(&task_pool->spinlock);
+	break;
+      }
+      task = libtask__worker_next(worker);
+      if (!task) {
+	task = libtask__worker_spin(worker);
+      }
+      if (task && !libtask__task_claim(task)) {
+	continue;
+      }
+    }
+    if (task) {
+      libtask__task_execute(task);
+#ifdef LIBTASK_IO_URING
+      if (worker->uring) {
+	libtask__worker_uring(worker);
+      }
+#endif
+      continue;
+    }
+
+    libtask_spinlock_lock(&task_pool->spinlock);
+    if (worker->stop) {
+      break;
+    }
+
+    // Announce that we are going to sleep before checking the queues
+    // for the last time; pairs with libtask__task_pool_notify.
+    libtask_atomic_add(&task_pool->nidle, 1);
+    if (!libtask__task_pool_busy(task_pool)) {
+      // Wait in the reactor if tasks are waiting for events or timers
+      // and no other thread is polling for them.
+      if (libtask__task_pool_waiting(task_pool) &&
+	  !task_pool->reactor.polling) {
+	worker->nparks++;
+	libtask__worker_poll(worker, true);
+	continue;
+      }
+      worker->nparks++;
       libtask_condition_wait(&task_pool->waiting_condition);
     }
-    libtask__task_pool_run(task_pool);
+    libtask_atomic_sub(&task_pool->nidle, 1);
+    libtask_spinlock_unlock(&task_pool->spinlock);
   }
+  libtask__worker_detach(worker);
   libtask_spinlock_unlock(&task_pool->spinlock);
+  libtask__thread.worker = NULL;
 
   // Release the task-pool reference taken when pthread is created.
   libtask_task_pool_unref(task_pool);
   return NULL;
 }
 
+void
+libtask_task_pool_get_stats(libtask_task_pool_t *task_pool,
+			    libtask_task_pool_stats_t *stats)
+{
+  memset(stats, 0, sizeof(*stats));
+  for (libtask_worker_t *worker = libtask_atomic_load(&task_pool->workers);
+       worker; worker = worker->next) {
+    stats->nspins += worker->nspins;
+    stats->nspins_found += worker->nspins_found;
+    stats->spin_usecs += worker->spin_usecs_total;
+    stats->nparks += worker->nparks;
+  }
+  stats->nwakes = task_pool->nwakes;
+  stats->nreclaims = task_pool->nreclaims;
+  stats->nreclaimed_bytes = task_pool->nreclaimed_bytes;
+}
+
 error_t
 libtask_task_pool_execute(libtask_task_pool_t *task_pool)
 {
@@ -221,13 +1118,18 @@ libtask_task_pool_stop(libtask_task_pool_t *task_pool, pthread_t pthread)
 
   libtask_spinlock_lock(&task_pool->spinlock);
   libtask_list_t *iter = libtask_list_front(&task_pool->thread_list);
-  while (iter != &task_pool->thread_list) {
-    thread_entry_t *entry = libtask_list_entry(iter, thread_entry_t, link);
-    if (pthread_equal(entry->pthread, pthread)) {
-      libtask_list_erase(&entry->link);
+  while (iter && iter != &task_pool->thread_list) {
+    libtask_worker_t *worker = libtask_list_entry(iter, libtask_worker_t,
+						  link);
+    if (pthread_equal(worker->pthread, pthread)) {
+      libtask_list_erase(&worker->link);
+      libtask_atomic_store(&worker->stop, true);
       // A signal may not wake up the desired thread, so wake up all
       // threads.
       libtask_condition_broadcast(&task_pool->waiting_condition);
+      if (task_pool->reactor.blocked) {
+	libtask__reactor_interrupt(&task_pool->reactor);
+      }
       libtask_spinlock_unlock(&task_pool->spinlock);
       return 0;
     }
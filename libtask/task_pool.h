@@ -25,8 +25,108 @@
 #include "libtask/task.h"
 #include "libtask/condition.h"
 #include "libtask/list.h"
+#include "libtask/reactor.h"
 #include "libtask/refcount.h"
 #include "libtask/spinlock.h"
+#include "libtask/stack.h"
+#include "libtask/timer.h"
+
+// Max. number of control blocks of finished detached tasks kept by a
+// task-pool for reuse.
+#define LIBTASK_TASK_CACHE_SIZE 256
+
+// Size of the local run queue of every worker thread. Must be a power
+// of two.
+#define LIBTASK_WORKER_QUEUE_SIZE 256
+
+// Number of tasks a worker picks between checks of the task-pool's
+// queues, timers and reactor. It is prime, so that the checks don't
+// fall into step with tasks that run in cycles of a regular length.
+#define LIBTASK_WORKER_CHECK_INTERVAL 61
+
+// Stack Reclaim
+//
+// A task that once went deep into its stack keeps those pages
+// resident while it is suspended. When the stack-reclaim option is
+// set as a task-pool is initialized, a timer of the task-pool looks at
+// a window of its task list every LIBTASK_TASK_POOL_RECLAIM_USECS and
+// gives the pages below the saved stack pointer of the tasks suspended
+// for longer than the option back to the system with MADV_DONTNEED.
+// The window rotates through the list, so every task is looked at once
+// in a number of runs. Tasks that are reclaimed are not looked at again
+// until they run, and a task whose stack is being reclaimed waits for
+// the reclaim before it resumes.
+//
+// Only stacks allocated with mmap are reclaimed, so reclaims need the
+// stack-mmap option too. Stacks painted for the watermarks are not
+// reclaimed either, because their zeroed pages would count as used.
+
+#define LIBTASK_TASK_POOL_RECLAIM_USECS 100000
+#define LIBTASK_TASK_POOL_RECLAIM_SCAN 1024
+#define LIBTASK_TASK_POOL_RECLAIM_BATCH 64
+
+// Worker
+//
+// Every thread executing tasks from a task-pool has a worker that
+// keeps a local queue of runnable tasks.  Tasks made runnable by a
+// worker thread of the same task-pool (yields, wakeups and new tasks)
+// go into its local queue without taking the task-pool lock.  The
+// queue is a bounded ring buffer where only the owner thread pushes at
+// the tail, and the owner and other workers of the task-pool pop from
+// the head with a compare-and-swap.  So, an idle worker can steal
+// tasks from busy workers without any locks.
+
+typedef struct libtask_worker {
+  // Link in the task-pool's thread_list while a thread is executing
+  // tasks with this worker.
+  libtask_list_t link;
+  pthread_t pthread;
+
+  // The task-pool and the next worker of the task-pool. Workers are
+  // never unlinked from this chain until the task-pool is destroyed,
+  // so other workers can walk the chain without locks to steal
+  // tasks.  When a thread leaves the task-pool its worker is marked
+  // inactive and is reused by the next thread.
+  struct libtask_task_pool *task_pool;
+  struct libtask_worker *next;
+  bool active;
+
+  // Set when the thread is requested to leave the task-pool.
+  volatile bool stop;
+
+  // Number of tasks picked so far; used to poll the task-pool's
+  // waiting_list every LIBTASK_WORKER_CHECK_INTERVAL picks for
+  // fairness.
+  uint32_t ntick;
+
+  // Task to execute next on this thread, before any task of the local
+  // queue, when a task hands the thread off to another one.
+  libtask_task_t *handoff;
+
+  // Context of the thread, which the task executed by the thread
+  // switches back to when it suspends.
+  libtask_context_t context;
+
+  // Current spin budget of the idle thread, which doubles when
+  // spinning finds a task and halves otherwise, and the statistics
+  // (see libtask_task_pool_stats_t).
+  int32_t spin_usecs;
+  uint64_t nspins;
+  uint64_t nspins_found;
+  uint64_t spin_usecs_total;
+  uint64_t nparks;
+
+  // The io_uring instance used for asynchronous io by the tasks
+  // running on this worker (see io.h). It is created on first use and
+  // uring_error keeps the error when that fails.
+  struct libtask_uring *uring;
+  error_t uring_error;
+
+  // The local run queue.
+  volatile uint32_t head;
+  volatile uint32_t tail;
+  libtask_task_t *queue[LIBTASK_WORKER_QUEUE_SIZE];
+} libtask_worker_t;
 
 // Task Pool
 //
@@ -39,6 +139,11 @@
 // respectively.
 
 typedef struct libtask_task_pool {
+  // Members are grouped by how they are accessed and the groups that
+  // are written often start on their own cache lines, so that the
+  // threads taking the spinlock, appending to the inbox and going
+  // idle don't slow each other down or the readers of the rest.
+
   // Since task-pools are accessed by multiple threads, it is
   // difficult to destroy a task-pool safely.  When a thread is
   // destroying a task-pool, another thread may choose to access other
@@ -47,12 +152,16 @@ typedef struct libtask_task_pool {
   // references are left.
   libtask_refcount_t refcount;
 
+  // All workers ever created for this task-pool. The chain only
+  // grows, so it is read without the spinlock.
+  libtask_worker_t *workers;
+
   // Tasks are kept in a unbounded list and are executed in FIFO
   // order.  Since the storage for the list is part of libtask_task_t,
   // there is no limit on number of tasks in a task-pool.  Since time
   // taken for addition and removal of a task is very small, a
   // spinlock is more appropriate.
-  libtask_spinlock_t spinlock;
+  libtask_spinlock_t spinlock LIBTASK_CACHE_ALIGNED;
 
   // Lists of tasks that belong to this task-pool for inspection,
   // analysis and debugging purposes. Tasks are linked into this list
@@ -66,12 +175,71 @@ typedef struct libtask_task_pool {
   int32_t ntasks;
 
   // List of tasks waiting for execution and the condition variable
-  // that wakes up waiting threads.
+  // that wakes up waiting threads.  Worker threads keep runnable
+  // tasks in their local queues and other threads use the inbox, so
+  // this list only receives tasks made runnable under the task-pool's
+  // spinlock and the overflow of the local queues.
   libtask_list_t waiting_list;
+  int32_t nwaiting;
   libtask_condition_t waiting_condition;
 
   // List of threads looking for work on this task-pool.
   libtask_list_t thread_list;
+  int32_t nthreads;
+
+  // Inbox of tasks made runnable by threads that are not workers of
+  // this task-pool, such as tasks moving in from other task-pools.
+  // It is an intrusive multi-producer, single-consumer queue of
+  // inbox_links: producers append a task with an atomic exchange on
+  // the tail without the spinlock, and the worker that sets the
+  // draining flag moves a batch from the head into its local queue.
+  // The stub keeps the queue from ever being empty.
+  libtask_inbox_link_t *volatile inbox_tail LIBTASK_CACHE_ALIGNED;
+  libtask_inbox_link_t *volatile inbox_head LIBTASK_CACHE_ALIGNED;
+  libtask_inbox_link_t inbox_stub;
+  volatile int32_t inbox_draining;
+
+  // Number of idle threads, which are sleeping on the
+  // waiting_condition or blocked in the reactor. It is read on every
+  // wake up.
+  int32_t nidle LIBTASK_CACHE_ALIGNED;
+
+  // Number of idle threads spinning for tasks before they sleep. New
+  // tasks wake up a sleeping thread only when no thread is spinning.
+  int32_t nspinning;
+
+  // Number of wake up signals sent to sleeping threads.
+  uint64_t nwakes;
+
+  // Stacks of finished tasks are kept here for reuse by new tasks of
+  // this task-pool.
+  libtask_stack_cache_t stack_cache LIBTASK_CACHE_ALIGNED;
+
+  // Control blocks of destroyed detached tasks kept for reuse by new
+  // detached tasks, linked through their originating_pool_link.
+  libtask_spinlock_t task_cache_spinlock;
+  libtask_list_t task_cache;
+  int32_t ntask_cache;
+
+  // Stacks for the tasks created by libtask_task_create_shared, which
+  // are allocated from the stack cache on first use, and the number of
+  // tasks assigned to them so far.
+  libtask_shared_stack_t shared_stacks[LIBTASK_SHARED_STACKS];
+  uint32_t nshared;
+
+  // Tasks of this task-pool waiting for file descriptor events.
+  libtask_reactor_t reactor;
+
+  // Timers expired by the threads of this task-pool.
+  libtask_timer_wheel_t timer_wheel;
+
+  // Age of the suspended tasks whose stacks are reclaimed, which is
+  // zero when stacks are not reclaimed, timer of the reclaims and their
+  // statistics, which are updated by the timer function only.
+  int64_t reclaim_usecs;
+  libtask_timer_t reclaim_timer;
+  uint64_t nreclaims;
+  uint64_t nreclaimed_bytes;
 } libtask_task_pool_t;
 
 // Initialize a task-pool created on stack.
@@ -166,6 +334,46 @@ libtask_task_pool_stop(libtask_task_pool_t *task_pool, pthread_t thread);
 error_t
 libtask_task_pool_schedule(libtask_task_pool_t *task_pool);
 
+// Give up the thread to a runnable task of the current task-pool,
+// which executes next on this thread ahead of the other runnable
+// tasks. Current task is put back in the local queue.
+//
+// task: Task to switch to.
+//
+// Returns 0 on success, EINVAL if not called from a task of the
+// task's task-pool and EAGAIN if the task is not waiting to run.
+error_t
+libtask_yield_to(libtask_task_t *task);
+
+// Task-pool statistics.
+typedef struct {
+  // Number of times idle threads have spun for tasks, the number of
+  // spins that have found a task and total time spent spinning.
+  uint64_t nspins;
+  uint64_t nspins_found;
+  uint64_t spin_usecs;
+
+  // Number of times idle threads have gone to sleep and the number of
+  // wake up signals sent to sleeping threads.
+  uint64_t nparks;
+  uint64_t nwakes;
+
+  // Number of suspended task stacks reclaimed and the size of the
+  // stack ranges given back to the system by them.
+  uint64_t nreclaims;
+  uint64_t nreclaimed_bytes;
+} libtask_task_pool_stats_t;
+
+// Get the task-pool statistics. Counters are collected without locks,
+// so they are approximate while the task-pool is running.
+//
+// task_pool: The task-pool.
+//
+// stats: Output structure.
+void
+libtask_task_pool_get_stats(libtask_task_pool_t *task_pool,
+			    libtask_task_pool_stats_t *stats);
+
 // Get the number of tasks in the task-pool.
 //
 // task_pool: The task-pool.
@@ -194,13 +402,56 @@ libtask_get_task_pool_current(void)
 // Private interfaces
 //
 
-// Associate a task with the task-pool for the first time.
+// Associate a task with the task-pool for the first time. Initial
+// reference of a detached task is handed over to the task-pool.
 void
 libtask__task_pool_insert(libtask_task_pool_t *task_pool,
 			  libtask_task_t *task);
 
+// Associate a batch of new tasks with the task-pool and make them
+// runnable under a single hold of the spinlock.
+void
+libtask__task_pool_insert_many(libtask_task_pool_t *task_pool,
+			       libtask_task_t **tasks, int32_t ntasks);
+
+// Pick a shared stack for a new task, allocating its memory if it is
+// the first task of the stack.
+//
+// Returns zero on success and ENOMEM on out of memory.
+error_t
+libtask__task_pool_shared_stack(libtask_task_pool_t *task_pool,
+				libtask_shared_stack_t **sharedp);
+
 // Remove current task from the task-pool because it is complete.
 void
 libtask__task_pool_erase(libtask_task_pool_t *task_pool);
 
+// Make a task runnable in a task-pool. Task is put in the local queue
+// when current thread is a worker of the task-pool and in the inbox
+// otherwise.
+void
+libtask__task_pool_wakeup(libtask_task_pool_t *task_pool,
+			  libtask_task_t *task);
+
+// Same as above, but always puts the task in the waiting_list. Caller
+// must hold the task-pool's spinlock.
+void
+libtask__task_pool_wakeup_locked(libtask_task_pool_t *task_pool,
+				 libtask_task_t *task);
+
+// Make a task runnable in its task-pool and switch the current
+// thread to it directly, when the current task runs in the same
+// task-pool. Current task is put back in the local queue. Falls back
+// to libtask__task_pool_wakeup otherwise.
+void
+libtask__task_pool_handoff(libtask_task_t *task);
+
+// Get the worker of the current thread. Returns NULL if current
+// thread is not executing tasks from a task-pool.
+static inline libtask_worker_t *
+libtask__get_worker_current(void)
+{
+  return libtask__thread.worker;
+}
+
 #endif // _LIBTASK_TASK_POOL_H_
@@ -0,0 +1,227 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+//
+// Testcase for the timed waits. Consumers down a semaphore with short
+// deadlines while producers up it at random times, so timeouts race
+// with the wakeups; no unit may be lost or duplicated. Condition and
+// task waits are checked to time out in task and pthread contexts.
+//
+
+#include <argp.h>
+
+#include "libtask/libtask.h"
+#include "libtask/log.h"
+
+#define TASK_STACK_SIZE (64*1024)
+
+static int32_t num_threads = 4;
+static int32_t num_items = 20000;
+static int32_t num_producers = 10;
+static int32_t num_consumers = 20;
+static int32_t timeout_usecs = 1000;
+
+static struct argp_option options[] = {
+  {"num-threads",   0, "PINT32", 0, "No. of threads in the task-pool."},
+  {"num-items",     1, "PINT32", 0, "No. of items to produce and consume."},
+  {"num-producers", 2, "PINT32", 0, "No. of producers."},
+  {"num-consumers", 3, "PINT32", 0, "No. of consumers."},
+  {"timeout-usecs", 4, "PINT32", 0, "Timeout of the consumers."},
+  {0}
+};
+
+static libtask_task_pool_t pool;
+static libtask_semaphore_t sem;
+
+static int32_t nproduced = 0;
+static int32_t nconsumed = 0;
+static int32_t ntimeouts = 0;
+
+static libtask_spinlock_t spinlock;
+static libtask_condition_t cond;
+
+int
+producer(void *arg_)
+{
+  while (libtask_atomic_add(&nproduced, 1) <= num_items) {
+    libtask_semaphore_up(&sem);
+    if (random() % 16 == 0) {
+      CHECK(libtask_sleep_usecs(random() % (2 * timeout_usecs)) == 0);
+    }
+  }
+  return 0;
+}
+
+int
+consumer(void *arg_)
+{
+  while (libtask_atomic_load(&nconsumed) < num_items) {
+    int64_t deadline = libtask_clock_usecs() + random() % timeout_usecs;
+    error_t error = libtask_semaphore_down_timed(&sem, deadline);
+    if (error == 0) {
+      libtask_atomic_add(&nconsumed, 1);
+    } else {
+      CHECK(error == ETIMEDOUT);
+      CHECK(libtask_clock_usecs() >= deadline);
+      libtask_atomic_add(&ntimeouts, 1);
+    }
+  }
+  return 0;
+}
+
+int
+sleeper(void *arg_)
+{
+  CHECK(libtask_sleep_usecs(50000) == 0);
+  return 0;
+}
+
+int
+waiter(void *arg_)
+{
+  // Nobody signals the condition.
+  libtask_spinlock_lock(&spinlock);
+  int64_t deadline = libtask_clock_usecs() + 10000;
+  CHECK(libtask_condition_wait_timed(&cond, deadline) == ETIMEDOUT);
+  CHECK(libtask_clock_usecs() >= deadline);
+  libtask_spinlock_unlock(&spinlock);
+
+  // Sleeper doesn't finish before the first deadline.
+  libtask_task_t task;
+  CHECK(libtask_task_initialize(&task, &pool, sleeper, NULL,
+				TASK_STACK_SIZE) == 0);
+  CHECK(libtask_task_wait_timed(&task, libtask_clock_usecs() + 1000) ==
+	ETIMEDOUT);
+  CHECK(libtask_task_wait_timed(&task, libtask_clock_usecs() + 10000000) == 0);
+  CHECK(libtask_task_unref(&task) == 0);
+  return 0;
+}
+
+static error_t
+parse_options(int key, char *arg, struct argp_state *state)
+{
+  switch(key) {
+  case 0: // num-threads
+    if (!str2pint32(arg, 10, &num_threads)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 1: // num-items
+    if (!str2pint32(arg, 10, &num_items)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 2: // num-producers
+    if (!str2pint32(arg, 10, &num_producers)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 3: // num-consumers
+    if (!str2pint32(arg, 10, &num_consumers)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 4: // timeout-usecs
+    if (!str2pint32(arg, 10, &timeout_usecs)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  default:
+    return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct argp_child children[2];
+  children[0] = libtask_argp_child;
+  children[1] = (struct argp_child){0};
+
+  struct argp argp = { options, parse_options, 0, 0, children };
+  argp_parse(&argp, argc, argv, 0, 0, 0);
+
+  libtask_semaphore_initialize(&sem, 0);
+  libtask_spinlock_initialize(&spinlock);
+  libtask_condition_initialize(&cond, &spinlock);
+
+  CHECK(libtask_task_pool_initialize(&pool) == 0);
+  pthread_t threads[num_threads];
+  for (int i = 0; i < num_threads; i++) {
+    CHECK(libtask_task_pool_start(&pool, &threads[i]) == 0);
+  }
+
+  libtask_task_t consumers[num_consumers];
+  for (int i = 0; i < num_consumers; i++) {
+    CHECK(libtask_task_initialize(&consumers[i], &pool, consumer, NULL,
+				  TASK_STACK_SIZE) == 0);
+  }
+  libtask_task_t producers[num_producers];
+  for (int i = 0; i < num_producers; i++) {
+    CHECK(libtask_task_initialize(&producers[i], &pool, producer, NULL,
+				  TASK_STACK_SIZE) == 0);
+  }
+  libtask_task_t waiter_task;
+  CHECK(libtask_task_initialize(&waiter_task, &pool, waiter, NULL,
+				TASK_STACK_SIZE) == 0);
+
+  // Timed wait in pthread context.
+  libtask_spinlock_lock(&spinlock);
+  int64_t deadline = libtask_clock_usecs() + 10000;
+  CHECK(libtask_condition_wait_timed(&cond, deadline) == ETIMEDOUT);
+  CHECK(libtask_clock_usecs() >= deadline);
+  libtask_spinlock_unlock(&spinlock);
+
+  for (int i = 0; i < num_producers; i++) {
+    CHECK(libtask_task_wait(&producers[i]) == 0);
+  }
+  for (int i = 0; i < num_consumers; i++) {
+    CHECK(libtask_task_wait(&consumers[i]) == 0);
+  }
+  CHECK(libtask_task_wait(&waiter_task) == 0);
+  DEBUG("consumed %d items with %d timeouts\n", nconsumed, ntimeouts);
+
+  // Every unit is consumed exactly once.
+  CHECK(nconsumed == num_items);
+  CHECK(sem.count == 0);
+  CHECK(libtask_list_empty(&sem.waiting_list));
+
+  for (int i = 0; i < num_threads; i++) {
+    CHECK(libtask_task_pool_stop(&pool, threads[i]) == 0);
+    CHECK(pthread_join(threads[i], NULL) == 0);
+  }
+  for (int i = 0; i < num_consumers; i++) {
+    CHECK(libtask_task_unref(&consumers[i]) == 0);
+  }
+  for (int i = 0; i < num_producers; i++) {
+    CHECK(libtask_task_unref(&producers[i]) == 0);
+  }
+  CHECK(libtask_task_unref(&waiter_task) == 0);
+  CHECK(libtask_task_pool_finalize(&pool) == 0);
+
+  libtask_condition_finalize(&cond);
+  libtask_semaphore_finalize(&sem);
+  return 0;
+}
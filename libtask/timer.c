@@ -0,0 +1,417 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "libtask/timer.h"
+#include "libtask/task_pool.h"
+#include "libtask/log.h"
+
+// Number of ticks covered by all levels of the wheel.
+#define LIBTASK_TIMER_RANGE_BITS (LIBTASK_TIMER_LEVELS * LIBTASK_TIMER_SLOT_BITS)
+
+static inline uint64_t
+libtask__timer_level_mask(int level)
+{
+  return ((uint64_t)1 << (LIBTASK_TIMER_SLOT_BITS * level)) - 1;
+}
+
+void
+libtask__timer_wheel_initialize(libtask_timer_wheel_t *wheel)
+{
+  libtask_spinlock_initialize(&wheel->spinlock);
+  wheel->origin_usecs = libtask_clock_usecs();
+  wheel->now = 0;
+  wheel->next = UINT64_MAX;
+  wheel->ntimers = 0;
+  wheel->running = false;
+  wheel->current = NULL;
+  for (int level = 0; level < LIBTASK_TIMER_LEVELS; level++) {
+    wheel->bitmap[level] = 0;
+    for (int slot = 0; slot < LIBTASK_TIMER_SLOTS; slot++) {
+      libtask_list_initialize(&wheel->slots[level][slot]);
+    }
+  }
+}
+
+void
+libtask__timer_wheel_finalize(libtask_timer_wheel_t *wheel)
+{
+  assert(wheel->ntimers == 0);
+  assert(wheel->running == false);
+  libtask_spinlock_finalize(&wheel->spinlock);
+}
+
+// Link a timer into the slot for its deadline and returns the tick at
+// which the slot has to be processed. Wheel spinlock must be held.
+static uint64_t
+libtask__timer_wheel_insert(libtask_timer_wheel_t *wheel,
+			    libtask_timer_t *timer)
+{
+  // Deadlines that have passed expire on the next tick and deadlines
+  // beyond the range of the wheel are re-inserted when the last slot
+  // of the wheel expires.
+  uint64_t expires = timer->expires;
+  if (expires <= wheel->now) {
+    expires = wheel->now + 1;
+  }
+  uint64_t limit = wheel->now |
+    (((uint64_t)1 << LIBTASK_TIMER_RANGE_BITS) - 1);
+  if (expires > limit) {
+    expires = limit;
+  }
+
+  // Lowest level where the deadline and current tick differ only in
+  // the slot digit and below.
+  int level = 0;
+  while (((expires ^ wheel->now) >>
+	  (LIBTASK_TIMER_SLOT_BITS * (level + 1))) != 0) {
+    level++;
+  }
+  int slot = (expires >> (LIBTASK_TIMER_SLOT_BITS * level)) &
+    (LIBTASK_TIMER_SLOTS - 1);
+
+  timer->slot = &wheel->slots[level][slot];
+  libtask_list_push_back(timer->slot, &timer->link);
+  wheel->bitmap[level] |= (uint64_t)1 << slot;
+
+  uint64_t tick = expires & ~libtask__timer_level_mask(level);
+  if (tick < wheel->next) {
+    libtask_atomic_store(&wheel->next, tick);
+  }
+  return tick;
+}
+
+// Unlink a timer from its slot. Wheel spinlock must be held.
+static void
+libtask__timer_wheel_erase(libtask_timer_wheel_t *wheel,
+			   libtask_timer_t *timer)
+{
+  libtask_list_erase(&timer->link);
+  if (timer->slot && libtask_list_empty(timer->slot)) {
+    int index = timer->slot - &wheel->slots[0][0];
+    wheel->bitmap[index / LIBTASK_TIMER_SLOTS] &=
+      ~((uint64_t)1 << (index % LIBTASK_TIMER_SLOTS));
+  }
+  timer->slot = NULL;
+}
+
+// Find the next tick with a non-empty slot. All non-empty slots come
+// after the current tick's slot in every level. Wheel spinlock must
+// be held.
+static uint64_t
+libtask__timer_wheel_next(libtask_timer_wheel_t *wheel)
+{
+  uint64_t next = UINT64_MAX;
+  for (int level = 0; level < LIBTASK_TIMER_LEVELS; level++) {
+    int shift = LIBTASK_TIMER_SLOT_BITS * level;
+    int digit = (wheel->now >> shift) & (LIBTASK_TIMER_SLOTS - 1);
+    uint64_t bitmap = wheel->bitmap[level] & ~(((uint64_t)2 << digit) - 1);
+    if (!bitmap) {
+      continue;
+    }
+    uint64_t tick = (wheel->now & ~libtask__timer_level_mask(level + 1)) |
+      ((uint64_t)__builtin_ctzll(bitmap) << shift);
+    if (tick < next) {
+      next = tick;
+    }
+  }
+  return next;
+}
+
+// Move the timers in a slot into the expired list or into the lower
+// levels. Wheel spinlock must be held.
+static void
+libtask__timer_wheel_cascade(libtask_timer_wheel_t *wheel, int level,
+			     libtask_list_t *expired)
+{
+  int slot = (wheel->now >> (LIBTASK_TIMER_SLOT_BITS * level)) &
+    (LIBTASK_TIMER_SLOTS - 1);
+  if (!(wheel->bitmap[level] & ((uint64_t)1 << slot))) {
+    return;
+  }
+  wheel->bitmap[level] &= ~((uint64_t)1 << slot);
+
+  libtask_list_t list;
+  libtask_list_initialize(&list);
+  libtask_list_move(&list, &wheel->slots[level][slot]);
+  while (!libtask_list_empty(&list)) {
+    libtask_list_t *link = libtask_list_pop_front(&list);
+    libtask_timer_t *timer = libtask_list_entry(link, libtask_timer_t, link);
+    if (timer->expires <= wheel->now) {
+      timer->slot = NULL;
+      libtask_list_push_back(expired, &timer->link);
+    } else {
+      libtask__timer_wheel_insert(wheel, timer);
+    }
+  }
+}
+
+void
+libtask__timer_wheel_run(libtask_timer_wheel_t *wheel)
+{
+  if (libtask_atomic_load(&wheel->ntimers) == 0) {
+    return;
+  }
+  int64_t usecs = libtask_clock_usecs() - wheel->origin_usecs;
+  uint64_t tick = usecs / LIBTASK_TIMER_TICK_USECS;
+  if (tick < libtask_atomic_load(&wheel->next)) {
+    return;
+  }
+
+  libtask_spinlock_lock(&wheel->spinlock);
+  if (wheel->running) {
+    libtask_spinlock_unlock(&wheel->spinlock);
+    return;
+  }
+  wheel->running = true;
+
+  libtask_list_t expired;
+  libtask_list_initialize(&expired);
+  while (wheel->next <= tick) {
+    wheel->now = wheel->next;
+    for (int level = LIBTASK_TIMER_LEVELS - 1; level >= 0; level--) {
+      if ((wheel->now & libtask__timer_level_mask(level)) == 0) {
+	libtask__timer_wheel_cascade(wheel, level, &expired);
+      }
+    }
+    libtask_atomic_store(&wheel->next, libtask__timer_wheel_next(wheel));
+  }
+  if (tick > wheel->now) {
+    wheel->now = tick;
+  }
+
+  // Call the timer functions without the lock. Timers in the expired
+  // list can still be canceled.
+  while (!libtask_list_empty(&expired)) {
+    libtask_list_t *link = libtask_list_pop_front(&expired);
+    libtask_timer_t *timer = libtask_list_entry(link, libtask_timer_t, link);
+    timer->task_pool = NULL;
+    libtask_atomic_sub(&wheel->ntimers, 1);
+    wheel->current = timer;
+    libtask_timer_function_t function = timer->function;
+    libtask_spinlock_unlock(&wheel->spinlock);
+
+    function(timer);
+
+    libtask_spinlock_lock(&wheel->spinlock);
+    wheel->current = NULL;
+  }
+  wheel->running = false;
+  libtask_spinlock_unlock(&wheel->spinlock);
+}
+
+int
+libtask__timer_wheel_timeout(libtask_timer_wheel_t *wheel)
+{
+  uint64_t next = libtask_atomic_load(&wheel->next);
+  if (next == UINT64_MAX) {
+    return -1;
+  }
+  int64_t usecs = wheel->origin_usecs + next * LIBTASK_TIMER_TICK_USECS -
+    libtask_clock_usecs();
+  if (usecs <= 0) {
+    return 0;
+  }
+  int64_t msecs = (usecs + 999) / 1000;
+  return msecs > INT_MAX ? INT_MAX : (int)msecs;
+}
+
+void
+libtask_timer_initialize(libtask_timer_t *timer,
+			 libtask_timer_function_t function,
+			 void *argument)
+{
+  libtask_list_initialize(&timer->link);
+  timer->expires = 0;
+  timer->slot = NULL;
+  timer->function = function;
+  timer->argument = argument;
+  timer->task_pool = NULL;
+  timer->wheel = NULL;
+}
+
+void
+libtask_timer_finalize(libtask_timer_t *timer)
+{
+  assert(timer->task_pool == NULL);
+  assert(libtask_list_empty(&timer->link));
+}
+
+// Make sure an idle thread of the task-pool is waiting for the
+// deadline of a new timer.
+static void
+libtask__timer_wheel_kick(libtask_task_pool_t *task_pool, bool earliest)
+{
+  // Pairs with the idle check in libtask__task_pool_main.
+  libtask_atomic_fence();
+  if (libtask_atomic_load(&task_pool->nidle) == 0) {
+    return;
+  }
+
+  libtask_reactor_t *reactor = &task_pool->reactor;
+  libtask_spinlock_lock(&task_pool->spinlock);
+  if (reactor->blocked) {
+    // Thread in the reactor may be waiting for a later deadline.
+    if (earliest) {
+      libtask__reactor_interrupt(reactor);
+    }
+  } else if (!reactor->polling && task_pool->nidle > 0) {
+    libtask_condition_signal(&task_pool->waiting_condition);
+  }
+  libtask_spinlock_unlock(&task_pool->spinlock);
+}
+
+error_t
+libtask_timer_start(libtask_timer_t *timer,
+		    libtask_task_pool_t *task_pool,
+		    int64_t deadline_usecs)
+{
+  assert(timer->task_pool == NULL);
+
+  // Idle threads wait for the deadlines in the reactor.
+  error_t error = libtask__reactor_open(task_pool);
+  if (error) {
+    return error;
+  }
+
+  libtask_timer_wheel_t *wheel = &task_pool->timer_wheel;
+  int64_t usecs = deadline_usecs - wheel->origin_usecs;
+  uint64_t expires = 0;
+  if (usecs > 0) {
+    expires = (usecs + LIBTASK_TIMER_TICK_USECS - 1) /
+      LIBTASK_TIMER_TICK_USECS;
+  }
+
+  libtask_spinlock_lock(&wheel->spinlock);
+  timer->expires = expires;
+  timer->task_pool = task_pool;
+  timer->wheel = wheel;
+  bool earliest = libtask__timer_wheel_insert(wheel, timer) == wheel->next;
+  libtask_atomic_add(&wheel->ntimers, 1);
+  libtask_spinlock_unlock(&wheel->spinlock);
+
+  libtask__timer_wheel_kick(task_pool, earliest);
+  return 0;
+}
+
+bool
+libtask_timer_cancel(libtask_timer_t *timer)
+{
+  libtask_timer_wheel_t *wheel = timer->wheel;
+  if (!wheel) {
+    return false;
+  }
+
+  libtask_spinlock_lock(&wheel->spinlock);
+  if (timer->task_pool) {
+    libtask__timer_wheel_erase(wheel, timer);
+    timer->task_pool = NULL;
+    libtask_atomic_sub(&wheel->ntimers, 1);
+    libtask_spinlock_unlock(&wheel->spinlock);
+    return true;
+  }
+
+  // Wait for the timer function to finish.
+  while (wheel->current == timer) {
+    libtask_spinlock_unlock(&wheel->spinlock);
+    libtask_spinlock_lock(&wheel->spinlock);
+  }
+  libtask_spinlock_unlock(&wheel->spinlock);
+  return false;
+}
+
+static void
+libtask__sleep_wakeup(libtask_timer_t *timer)
+{
+  libtask_task_t *task = (libtask_task_t *)timer->argument;
+  libtask__task_pool_wakeup(task->owner, task);
+}
+
+error_t
+libtask_sleep_until(int64_t deadline_usecs)
+{
+  libtask_task_t *task = libtask_get_task_current();
+  if (!task) {
+    struct timespec ts;
+    ts.tv_sec = deadline_usecs / 1000000;
+    ts.tv_nsec = (deadline_usecs % 1000000) * 1000;
+    error_t error;
+    while ((error = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+				    &ts, NULL)) == EINTR) {
+      continue;
+    }
+    return error;
+  }
+
+  // Timer function may run before the task is suspended, but task
+  // cannot be resumed until then.
+  libtask_timer_t timer;
+  libtask_timer_initialize(&timer, libtask__sleep_wakeup, task);
+  error_t error = libtask_timer_start(&timer, task->owner, deadline_usecs);
+  if (error) {
+    return error;
+  }
+  libtask__task_suspend();
+  libtask_timer_finalize(&timer);
+  return 0;
+}
+
+static void
+libtask__timed_wait_expired(libtask_timer_t *timer)
+{
+  libtask_timed_wait_t *wait = (libtask_timed_wait_t *)timer->argument;
+  libtask_task_t *task = wait->task;
+
+  // The task is still in the waiting list unless it is woken up
+  // already.
+  bool timed_out = false;
+  libtask_spinlock_lock(wait->spinlock);
+  if (!libtask_list_empty(&task->waiting_link)) {
+    libtask_list_erase(&task->waiting_link);
+    wait->timed_out = timed_out = true;
+  }
+  libtask_spinlock_unlock(wait->spinlock);
+
+  if (timed_out) {
+    libtask__task_pool_wakeup(task->owner, task);
+  }
+}
+
+error_t
+libtask__timed_wait_start(libtask_timed_wait_t *wait,
+			  libtask_task_t *task,
+			  libtask_spinlock_t *spinlock,
+			  int64_t deadline_usecs)
+{
+  assert(libtask_spinlock_status(spinlock) == false);
+  wait->task = task;
+  wait->spinlock = spinlock;
+  wait->timed_out = false;
+  libtask_timer_initialize(&wait->timer, libtask__timed_wait_expired, wait);
+  return libtask_timer_start(&wait->timer, task->owner, deadline_usecs);
+}
+
+error_t
+libtask__timed_wait_finish(libtask_timed_wait_t *wait)
+{
+  // Timer function may still be running after it has woken up the
+  // task.
+  libtask_timer_cancel(&wait->timer);
+  libtask_timer_finalize(&wait->timer);
+  return wait->timed_out ? ETIMEDOUT : 0;
+}
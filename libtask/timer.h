@@ -0,0 +1,219 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _LIBTASK_TIMER_H_
+#define _LIBTASK_TIMER_H_
+
+#include <time.h>
+
+#include "libtask/base.h"
+#include "libtask/list.h"
+#include "libtask/spinlock.h"
+
+// Timers
+//
+// Every task-pool has a hierarchical timing wheel driven by its worker
+// threads. The wheel has LIBTASK_TIMER_LEVELS levels of 64 slots,
+// where a slot of the first level covers one tick of
+// LIBTASK_TIMER_TICK_USECS and a slot of every other level covers all
+// slots of the level below. Timers are linked into the slot of the
+// lowest level that contains their deadline, so starting and
+// canceling a timer takes constant time. When time moves into a slot
+// of a higher level, its timers are cascaded into the lower levels
+// and the timers in a slot of the first level expire. Every level has
+// a bitmap of non-empty slots, so the next deadline is found without
+// walking the slots.
+//
+// Busy worker threads check the wheel once in a while and an idle
+// thread waits for the next deadline in the reactor, so pending
+// timers don't add any cost to task switches.  Timers never fire
+// before their deadline, but may fire up to a tick late.
+
+#define LIBTASK_TIMER_TICK_USECS 1000
+#define LIBTASK_TIMER_LEVELS 6
+#define LIBTASK_TIMER_SLOT_BITS 6
+#define LIBTASK_TIMER_SLOTS (1 << LIBTASK_TIMER_SLOT_BITS)
+
+struct libtask_timer;
+struct libtask_task_pool;
+
+// Function called when a timer expires. It is called by a worker
+// thread outside of task context, so it must not block.
+typedef void (*libtask_timer_function_t)(struct libtask_timer *timer);
+
+typedef struct libtask_timer {
+  // Link in a slot of the timing wheel while the timer is pending.
+  libtask_list_t link;
+
+  // Deadline in ticks of the wheel and the slot the timer is linked
+  // into, which is NULL while timer is about to fire.
+  uint64_t expires;
+  libtask_list_t *slot;
+
+  libtask_timer_function_t function;
+  void *argument;
+
+  // The task-pool while the timer is pending or NULL and the wheel
+  // the timer was last started on.
+  struct libtask_task_pool *task_pool;
+  struct libtask_timer_wheel *wheel;
+} libtask_timer_t;
+
+typedef struct libtask_timer_wheel {
+  libtask_spinlock_t spinlock;
+
+  // Clock time of tick zero and the current tick.
+  int64_t origin_usecs;
+  uint64_t now;
+
+  // Tick at which next timer has to be expired or cascaded, which is
+  // UINT64_MAX when no timers are pending.
+  uint64_t next;
+
+  // Number of pending timers.
+  int32_t ntimers;
+
+  // Set while a thread is expiring timers and the timer whose
+  // function is being called.
+  bool running;
+  libtask_timer_t *current;
+
+  uint64_t bitmap[LIBTASK_TIMER_LEVELS];
+  libtask_list_t slots[LIBTASK_TIMER_LEVELS][LIBTASK_TIMER_SLOTS];
+} libtask_timer_wheel_t;
+
+// Get the current time of the monotonic clock used by the timers in
+// microseconds.
+static inline int64_t
+libtask_clock_usecs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Initialize a timer.
+//
+// timer: The timer.
+//
+// function: Function to call when timer expires.
+//
+// argument: User data for the function.
+void
+libtask_timer_initialize(libtask_timer_t *timer,
+			 libtask_timer_function_t function,
+			 void *argument);
+
+// Destroy a timer. Timer must not be pending.
+void
+libtask_timer_finalize(libtask_timer_t *timer);
+
+// Start a timer.
+//
+// timer: The timer, which must not be pending.
+//
+// task_pool: Task-pool whose threads expire the timer.
+//
+// deadline_usecs: Absolute deadline in libtask_clock_usecs time.
+//
+// Returns zero on success or an error number if reactor of the
+// task-pool cannot be created.
+error_t
+libtask_timer_start(libtask_timer_t *timer,
+		    struct libtask_task_pool *task_pool,
+		    int64_t deadline_usecs);
+
+// Cancel a timer. If timer function is running, waits for it to
+// finish, so it must not be called from the timer's own function.
+//
+// Returns true if timer was pending and is canceled and false
+// otherwise.
+bool
+libtask_timer_cancel(libtask_timer_t *timer);
+
+// Suspend current task until a deadline. In pthread context the
+// thread sleeps instead.
+//
+// deadline_usecs: Absolute deadline in libtask_clock_usecs time.
+//
+// Returns zero on success or an error number.
+error_t
+libtask_sleep_until(int64_t deadline_usecs);
+
+// Suspend current task for some time. In pthread context the thread
+// sleeps instead.
+//
+// Returns zero on success or an error number.
+static inline error_t
+libtask_sleep_usecs(int64_t usecs)
+{
+  return libtask_sleep_until(libtask_clock_usecs() + usecs);
+}
+
+//
+// Private interfaces
+//
+
+void
+libtask__timer_wheel_initialize(libtask_timer_wheel_t *wheel);
+
+void
+libtask__timer_wheel_finalize(libtask_timer_wheel_t *wheel);
+
+// Expire the timers whose deadlines have passed. Does nothing if
+// another thread is expiring the timers.
+void
+libtask__timer_wheel_run(libtask_timer_wheel_t *wheel);
+
+// Get the time until next deadline in milliseconds for epoll_wait,
+// which is -1 when there are no pending timers.
+int
+libtask__timer_wheel_timeout(libtask_timer_wheel_t *wheel);
+
+// A task waiting with a deadline in the waiting list of a
+// synchronization primitive. When the deadline passes before the
+// task is woken up, the timer unlinks the task from the waiting list
+// and wakes it up.  Primitive's spinlock decides which of the two
+// wins.
+typedef struct {
+  libtask_timer_t timer;
+  struct libtask_task *task;
+  libtask_spinlock_t *spinlock;
+  bool timed_out;
+} libtask_timed_wait_t;
+
+// Start the timer of a timed wait. Task must be linked into the
+// waiting list through its waiting_link and the spinlock protecting
+// the list must be held.
+//
+// Returns zero on success or an error number.
+error_t
+libtask__timed_wait_start(libtask_timed_wait_t *wait,
+			  struct libtask_task *task,
+			  libtask_spinlock_t *spinlock,
+			  int64_t deadline_usecs);
+
+// Finish a timed wait after the task is resumed.
+//
+// Returns ETIMEDOUT if the task is woken up by the timer and zero
+// otherwise.
+error_t
+libtask__timed_wait_finish(libtask_timed_wait_t *wait);
+
+#endif // _LIBTASK_TIMER_H_
@@ -0,0 +1,215 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+//
+// Testcase for the timers. Tasks sleep for random durations, timers
+// with deadlines across the levels of the timing wheel fire and a
+// large number of far away timers are started and canceled.
+//
+
+#include <argp.h>
+
+#include "libtask/libtask.h"
+#include "libtask/log.h"
+
+#define TASK_STACK_SIZE (64*1024)
+
+static int32_t num_threads = 4;
+static int32_t num_tasks = 1000;
+static int32_t num_sleeps = 5;
+static int32_t num_timers = 1000000;
+static int32_t max_sleep_usecs = 300000;
+
+static struct argp_option options[] = {
+  {"num-threads",     0, "PINT32", 0, "No. of threads in the task-pool."},
+  {"num-tasks",       1, "PINT32", 0, "No. of sleeping tasks."},
+  {"num-sleeps",      2, "PINT32", 0, "No. of sleeps per task."},
+  {"num-timers",      3, "PINT32", 0, "No. of timers to start and cancel."},
+  {"max-sleep-usecs", 4, "PINT32", 0, "Maximum duration of a sleep."},
+  {0}
+};
+
+static libtask_task_pool_t pool;
+
+static int32_t nfired = 0;
+
+typedef struct {
+  libtask_timer_t timer;
+  int64_t deadline_usecs;
+} test_timer_t;
+
+static void
+timer_fired(libtask_timer_t *timer)
+{
+  test_timer_t *test = (test_timer_t *)timer->argument;
+  CHECK(libtask_clock_usecs() >= test->deadline_usecs);
+  libtask_atomic_add(&nfired, 1);
+}
+
+int
+sleeper(void *arg_)
+{
+  for (int i = 0; i < num_sleeps; i++) {
+    int64_t deadline = libtask_clock_usecs() + random() % max_sleep_usecs;
+    CHECK(libtask_sleep_until(deadline) == 0);
+    CHECK(libtask_clock_usecs() >= deadline);
+  }
+  return 0;
+}
+
+int
+canceler(void *arg_)
+{
+  // Far away timers are canceled before they fire.
+  test_timer_t *timers = malloc(sizeof(test_timer_t) * num_timers);
+  CHECK(timers);
+
+  int64_t start_usecs = libtask_clock_usecs();
+  for (int i = 0; i < num_timers; i++) {
+    timers[i].deadline_usecs = start_usecs + 3600000000LL +
+      random() % 3600000000LL;
+    libtask_timer_initialize(&timers[i].timer, timer_fired, &timers[i]);
+    CHECK(libtask_timer_start(&timers[i].timer, &pool,
+			      timers[i].deadline_usecs) == 0);
+  }
+  int64_t started_usecs = libtask_clock_usecs();
+
+  // Pending timers should not slow down the task switches.
+  for (int i = 0; i < 1000; i++) {
+    CHECK(libtask_yield() == 0);
+  }
+  CHECK(libtask_sleep_usecs(10000) == 0);
+
+  for (int i = 0; i < num_timers; i++) {
+    CHECK(libtask_timer_cancel(&timers[i].timer) == true);
+    libtask_timer_finalize(&timers[i].timer);
+  }
+  DEBUG("started %d timers in %ld usecs and canceled in %ld usecs\n",
+	num_timers, started_usecs - start_usecs,
+	libtask_clock_usecs() - started_usecs);
+  free(timers);
+  return 0;
+}
+
+static error_t
+parse_options(int key, char *arg, struct argp_state *state)
+{
+  switch(key) {
+  case 0: // num-threads
+    if (!str2pint32(arg, 10, &num_threads)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 1: // num-tasks
+    if (!str2pint32(arg, 10, &num_tasks)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 2: // num-sleeps
+    if (!str2pint32(arg, 10, &num_sleeps)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 3: // num-timers
+    if (!str2pint32(arg, 10, &num_timers)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  case 4: // max-sleep-usecs
+    if (!str2pint32(arg, 10, &max_sleep_usecs)) {
+      argp_error(state, "Invalid value %s for --%s\n", arg, options[key].name);
+    }
+    break;
+
+  default:
+    return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct argp_child children[2];
+  children[0] = libtask_argp_child;
+  children[1] = (struct argp_child){0};
+
+  struct argp argp = { options, parse_options, 0, 0, children };
+  argp_parse(&argp, argc, argv, 0, 0, 0);
+
+  CHECK(libtask_task_pool_initialize(&pool) == 0);
+  pthread_t threads[num_threads];
+  for (int i = 0; i < num_threads; i++) {
+    CHECK(libtask_task_pool_start(&pool, &threads[i]) == 0);
+  }
+
+  // Timers with deadlines in the first few levels of the wheel.
+  int64_t start_usecs = libtask_clock_usecs();
+  test_timer_t timers[num_tasks];
+  for (int i = 0; i < num_tasks; i++) {
+    timers[i].deadline_usecs = start_usecs + random() % (5 * max_sleep_usecs);
+    libtask_timer_initialize(&timers[i].timer, timer_fired, &timers[i]);
+    CHECK(libtask_timer_start(&timers[i].timer, &pool,
+			      timers[i].deadline_usecs) == 0);
+  }
+
+  libtask_task_t canceler_task;
+  CHECK(libtask_task_initialize(&canceler_task, &pool, canceler, NULL,
+				TASK_STACK_SIZE) == 0);
+  libtask_task_t sleepers[num_tasks];
+  for (int i = 0; i < num_tasks; i++) {
+    CHECK(libtask_task_initialize(&sleepers[i], &pool, sleeper, NULL,
+				  TASK_STACK_SIZE) == 0);
+  }
+
+  // Sleep in pthread context.
+  int64_t deadline = libtask_clock_usecs() + 1000;
+  CHECK(libtask_sleep_until(deadline) == 0);
+  CHECK(libtask_clock_usecs() >= deadline);
+
+  CHECK(libtask_task_wait(&canceler_task) == 0);
+  for (int i = 0; i < num_tasks; i++) {
+    CHECK(libtask_task_wait(&sleepers[i]) == 0);
+  }
+  DEBUG("sleepers finished in %ld usecs\n", libtask_clock_usecs() - start_usecs);
+
+  // Wait for the remaining timers.
+  while (libtask_atomic_load(&nfired) < num_tasks) {
+    CHECK(libtask_sleep_usecs(1000) == 0);
+  }
+  for (int i = 0; i < num_tasks; i++) {
+    CHECK(libtask_timer_cancel(&timers[i].timer) == false);
+    libtask_timer_finalize(&timers[i].timer);
+  }
+
+  for (int i = 0; i < num_threads; i++) {
+    CHECK(libtask_task_pool_stop(&pool, threads[i]) == 0);
+    CHECK(pthread_join(threads[i], NULL) == 0);
+  }
+  CHECK(libtask_task_unref(&canceler_task) == 0);
+  for (int i = 0; i < num_tasks; i++) {
+    CHECK(libtask_task_unref(&sleepers[i]) == 0);
+  }
+  CHECK(libtask_task_pool_finalize(&pool) == 0);
+  return 0;
+}
@@ -0,0 +1,255 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "libtask/uring.h"
+#include "libtask/log.h"
+
+static inline int
+io_uring_setup(uint32_t entries, struct io_uring_params *params)
+{
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static inline int
+io_uring_register(int fd, uint32_t opcode, void *arg, uint32_t nargs)
+{
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+static inline int
+io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete,
+	       uint32_t flags)
+{
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		      flags, NULL, 0);
+}
+
+// Operations submitted by the asynchronous io functions (see io.c).
+static const uint8_t libtask__uring_opcodes[] = {
+  IORING_OP_READ, IORING_OP_WRITE, IORING_OP_ACCEPT, IORING_OP_CONNECT,
+};
+
+// Check that the kernel supports all operations used by the
+// asynchronous io functions. Kernels without the probe are older than
+// the read and write operations too.
+static error_t
+libtask__uring_probe(int fd)
+{
+  size_t size = sizeof(struct io_uring_probe) +
+    IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = (struct io_uring_probe *)calloc(size, 1);
+  if (!probe) {
+    return ENOMEM;
+  }
+
+  error_t error = 0;
+  if (io_uring_register(fd, IORING_REGISTER_PROBE, probe,
+			IORING_OP_LAST) != 0) {
+    error = errno == EINVAL ? EOPNOTSUPP : errno;
+  } else {
+    for (size_t i = 0; i < sizeof(libtask__uring_opcodes); i++) {
+      uint8_t opcode = libtask__uring_opcodes[i];
+      if (opcode > probe->last_op ||
+	  !(probe->ops[opcode].flags & IO_URING_OP_SUPPORTED)) {
+	error = EOPNOTSUPP;
+	break;
+      }
+    }
+  }
+  free(probe);
+  return error;
+}
+
+error_t
+libtask__uring_create(libtask_uring_t **uringp)
+{
+  libtask_uring_t *uring = (libtask_uring_t *)calloc(sizeof(*uring), 1);
+  if (!uring) {
+    return ENOMEM;
+  }
+
+  // Completion queue is twice the submission queue and in-flight
+  // operations are limited to the submission queue size, so the
+  // completion queue never overflows.
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  uring->fd = io_uring_setup(LIBTASK_URING_ENTRIES, &params);
+  if (uring->fd < 0) {
+    error_t error = errno;
+    free(uring);
+    return error;
+  }
+
+  error_t error = libtask__uring_probe(uring->fd);
+  if (error) {
+    close(uring->fd);
+    free(uring);
+    return error;
+  }
+
+  uring->nentries = params.sq_entries;
+  uring->sq_ring_size = params.sq_off.array +
+    params.sq_entries * sizeof(uint32_t);
+  uring->cq_ring_size = params.cq_off.cqes +
+    params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (uring->cq_ring_size > uring->sq_ring_size) {
+      uring->sq_ring_size = uring->cq_ring_size;
+    }
+    uring->cq_ring_size = uring->sq_ring_size;
+  }
+
+  uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, uring->fd,
+			IORING_OFF_SQ_RING);
+  if (uring->sq_ring == MAP_FAILED) {
+    goto error;
+  }
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    uring->cq_ring = uring->sq_ring;
+  } else {
+    uring->cq_ring = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, uring->fd,
+			  IORING_OFF_CQ_RING);
+    if (uring->cq_ring == MAP_FAILED) {
+      munmap(uring->sq_ring, uring->sq_ring_size);
+      goto error;
+    }
+  }
+
+  uring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+		     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		     uring->fd, IORING_OFF_SQES);
+  if (uring->sqes == MAP_FAILED) {
+    if (uring->cq_ring != uring->sq_ring) {
+      munmap(uring->cq_ring, uring->cq_ring_size);
+    }
+    munmap(uring->sq_ring, uring->sq_ring_size);
+    goto error;
+  }
+
+  char *sq = (char *)uring->sq_ring;
+  uring->sq_head = (uint32_t *)(sq + params.sq_off.head);
+  uring->sq_tail = (uint32_t *)(sq + params.sq_off.tail);
+  uring->sq_mask = *(uint32_t *)(sq + params.sq_off.ring_mask);
+  uring->sq_array = (uint32_t *)(sq + params.sq_off.array);
+
+  char *cq = (char *)uring->cq_ring;
+  uring->cq_head = (uint32_t *)(cq + params.cq_off.head);
+  uring->cq_tail = (uint32_t *)(cq + params.cq_off.tail);
+  uring->cq_mask = *(uint32_t *)(cq + params.cq_off.ring_mask);
+  uring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  libtask_spinlock_initialize(&uring->spinlock);
+  *uringp = uring;
+  return 0;
+
+error:
+  {
+    error_t error = errno;
+    close(uring->fd);
+    free(uring);
+    return error;
+  }
+}
+
+void
+libtask__uring_destroy(libtask_uring_t *uring)
+{
+  assert(uring->npending == 0);
+  assert(uring->ninflight == 0);
+
+  munmap(uring->sqes, uring->nentries * sizeof(struct io_uring_sqe));
+  if (uring->cq_ring != uring->sq_ring) {
+    munmap(uring->cq_ring, uring->cq_ring_size);
+  }
+  munmap(uring->sq_ring, uring->sq_ring_size);
+  close(uring->fd);
+  libtask_spinlock_finalize(&uring->spinlock);
+  free(uring);
+}
+
+struct io_uring_sqe *
+libtask__uring_get_sqe(libtask_uring_t *uring,
+		       libtask_uring_request_t *request)
+{
+  if (libtask_atomic_load(&uring->ninflight) >= uring->nentries) {
+    return NULL;
+  }
+
+  uint32_t tail = *uring->sq_tail;
+  uint32_t head = libtask_atomic_load_acquire(uring->sq_head);
+  if (tail - head >= uring->nentries) {
+    return NULL;
+  }
+
+  uint32_t index = tail & uring->sq_mask;
+  struct io_uring_sqe *sqe = &uring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = (uint64_t)(uintptr_t)request;
+  uring->sq_array[index] = index;
+  libtask_atomic_store_release(uring->sq_tail, tail + 1);
+
+  uring->npending++;
+  libtask_atomic_add(&uring->ninflight, 1);
+  return sqe;
+}
+
+void
+libtask__uring_submit(libtask_uring_t *uring)
+{
+  while (uring->npending) {
+    int nsubmitted = io_uring_enter(uring->fd, uring->npending, 0, 0);
+    if (nsubmitted < 0) {
+      // Kernel may be short of memory temporarily; since completion
+      // queue cannot overflow, there is nothing else to wait for.
+      CHECK(errno == EINTR || errno == EAGAIN);
+      continue;
+    }
+    uring->npending -= nsubmitted;
+  }
+}
+
+int
+libtask__uring_reap(libtask_uring_t *uring, struct libtask_task **tasks,
+		    int max)
+{
+  int ntasks = 0;
+
+  libtask_spinlock_lock(&uring->spinlock);
+  uint32_t head = *uring->cq_head;
+  uint32_t tail = libtask_atomic_load_acquire(uring->cq_tail);
+  for (; head != tail && ntasks < max; head++) {
+    struct io_uring_cqe *cqe = &uring->cqes[head & uring->cq_mask];
+    libtask_uring_request_t *request =
+      (libtask_uring_request_t *)(uintptr_t)cqe->user_data;
+    request->result = cqe->res;
+    tasks[ntasks++] = request->task;
+  }
+  libtask_atomic_store_release(uring->cq_head, head);
+  libtask_spinlock_unlock(&uring->spinlock);
+
+  libtask_atomic_sub(&uring->ninflight, ntasks);
+  return ntasks;
+}
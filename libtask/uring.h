@@ -0,0 +1,128 @@
+//
+// Libtask: A thread-safe coroutine library.
+//
+// Copyright (C) 2013  BVK Chaitanya
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _LIBTASK_URING_H_
+#define _LIBTASK_URING_H_
+
+#include <linux/io_uring.h>
+
+#include "libtask/base.h"
+#include "libtask/spinlock.h"
+
+// Uring
+//
+// An io_uring instance driven with raw system calls. Every worker
+// thread creates one on its first asynchronous io operation. Tasks
+// running on the worker queue submission entries without a system
+// call and the worker submits them all at once after the task is
+// suspended. Completions are reaped by the worker after every task it
+// executes and, through the ring's file descriptor registered in the
+// task-pool's reactor, by the thread polling the reactor.
+//
+// Submission queue is accessed only by the worker's thread, so it has
+// no locks. Completion queue is protected by the spinlock because
+// multiple threads may reap it.
+
+// Number of submission entries in a ring.
+#define LIBTASK_URING_ENTRIES 256
+
+struct libtask_task;
+
+typedef struct libtask_uring {
+  int fd;
+  libtask_spinlock_t spinlock;
+
+  // Number of entries that are queued but not submitted and the
+  // number of operations that are not reaped yet.
+  uint32_t npending;
+  uint32_t ninflight;
+
+  uint32_t nentries;
+  uint32_t *sq_head;
+  uint32_t *sq_tail;
+  uint32_t sq_mask;
+  uint32_t *sq_array;
+  struct io_uring_sqe *sqes;
+
+  uint32_t *cq_head;
+  uint32_t *cq_tail;
+  uint32_t cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+} libtask_uring_t;
+
+// An operation waiting for its completion. It lives on the stack of
+// the task that is suspended for the operation.
+typedef struct {
+  struct libtask_task *task;
+  int32_t result;
+} libtask_uring_request_t;
+
+//
+// Private interfaces
+//
+
+// Create an io_uring instance.
+//
+// uringp: Output variable for the new ring.
+//
+// Returns zero on success or an error number, e.g. ENOSYS when kernel
+// doesn't support io_uring or EOPNOTSUPP when it doesn't support all
+// operations used by the asynchronous io functions.
+error_t
+libtask__uring_create(libtask_uring_t **uringp);
+
+void
+libtask__uring_destroy(libtask_uring_t *uring);
+
+// Get a submission entry for a request. Returns NULL if the ring is
+// out of entries. Must be called only by the worker's thread.
+struct io_uring_sqe *
+libtask__uring_get_sqe(libtask_uring_t *uring,
+		       libtask_uring_request_t *request);
+
+// Submit the queued entries to the kernel. Must be called only by the
+// worker's thread.
+void
+libtask__uring_submit(libtask_uring_t *uring);
+
+// Reap completions and collect the tasks of the completed requests.
+//
+// tasks: Output array.
+//
+// max: Size of the output array.
+//
+// Returns the number of tasks collected.
+int
+libtask__uring_reap(libtask_uring_t *uring, struct libtask_task **tasks,
+		    int max);
+
+// Returns true if completions are waiting to be reaped.
+static inline bool
+libtask__uring_ready(libtask_uring_t *uring)
+{
+  return libtask_atomic_load_acquire(uring->cq_tail) !=
+    libtask_atomic_load_relaxed(uring->cq_head);
+}
+
+#endif // _LIBTASK_URING_H_